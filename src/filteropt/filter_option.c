@@ -15,12 +15,24 @@
    License along with this program; if not, write to the Free  Software Foundation, Inc., 
    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
 */
+#include <stdlib.h>
 #include <cups/cups.h>
 #include "debuglog.h"
 #include "memory.h"
 #include "filter_option.h"
 
 #define WATERMAKR_OPTION_NAME		"Watermark"
+#define RASTER_THREADS_ATTR_NAME	"epcgRasterThreads"
+#define RASTER_THREADS_ENV_NAME		"EPS_RASTER_THREADS"
+#define RASTER_THREADS_MAX		16
+#define SCALE_FILTER_ATTR_NAME		"epcgScaleFilter"
+#define SCALE_FILTER_ENV_NAME		"EPS_SCALE_FILTER"
+#define SCALE_TOLERANCE_ATTR_NAME	"epcgScaleTolerance"
+#define SCALE_TOLERANCE_ENV_NAME	"EPS_SCALE_TOLERANCE"
+#define SCALE_TOLERANCE_DEFAULT		3
+#define REVERSE_MEMORY_ATTR_NAME	"epcgReverseMemory"
+#define REVERSE_MEMORY_ENV_NAME		"EPS_REVERSE_MEMORY"
+#define REVERSE_MEMORY_DEFAULT		256
 
 extern ppd_file_t *	PPD;
 extern const char *	JobOptions;
@@ -125,6 +137,18 @@ static EpsFilterOption filterOptionWatermarkSize = {
 	}
 };
 
+static EpsFilterOption filterOptionScaleFilter = {
+	SCALE_FILTER_ATTR_NAME,
+	5,
+	{
+		{"Auto", EPS_SCALE_FILTER_AUTO},
+		{"Nearest", EPS_SCALE_FILTER_NEAREST},
+		{"Box", EPS_SCALE_FILTER_BOX},
+		{"Bilinear", EPS_SCALE_FILTER_BILINEAR},
+		{"Bicubic", EPS_SCALE_FILTER_BICUBIC}
+	}
+};
+
 ppd_attr_t * get_ppd_attr(const char * name, int isFirst)
 {
 	ppd_attr_t * attr = NULL;
@@ -211,6 +235,20 @@ static int get_filter_option(int *value, EpsFilterOption option)
 	return error;
 }
  
+static EpsScaleFilter get_scale_filter(const char *choice)
+{
+	int	i;
+
+	for (i = 0; i < filterOptionScaleFilter.choice_num; i++) {
+		if (strcmp(choice, filterOptionScaleFilter.choiceList[i].choice) == 0) {
+			return filterOptionScaleFilter.choiceList[i].value;
+		}
+	}
+	debuglog(("Unknown scale filter %s", choice));
+
+	return EPS_SCALE_FILTER_AUTO;
+}
+
 int setup_filter_option (EpsFilterPrintOption *filterPrintOption)
 {
 	debuglog(("TRACE IN"));
@@ -231,6 +269,10 @@ int setup_filter_option (EpsFilterPrintOption *filterPrintOption)
 	filterPrintOption->watermarkDensity = EPS_PAGE_WATERMARK_DENSITY_LEVEL4;
 	filterPrintOption->watermarkColor = EPS_PAGE_WATERMARK_COLOR_RED;
 	filterPrintOption->size_ratio = EPS_PAGE_WATERMARK_SIZE_70 / 10.0;
+	filterPrintOption->rasterThreads = 0;
+	filterPrintOption->scaleFilter = EPS_SCALE_FILTER_AUTO;
+	filterPrintOption->scaleTolerance = SCALE_TOLERANCE_DEFAULT;
+	filterPrintOption->reverseMemory = REVERSE_MEMORY_DEFAULT;
 
 	// Page Layout
 	error = get_filter_option(&value, filterOptionPageLayout);
@@ -297,6 +339,61 @@ int setup_filter_option (EpsFilterPrintOption *filterPrintOption)
 	  filterPrintOption->size_ratio = value / 10.0;
 	}
 
+	// Raster worker threads (opt-in), the environment overrides the PPD
+	attr = get_ppd_attr (RASTER_THREADS_ATTR_NAME, 1);
+	if (attr && attr->value) {
+	  filterPrintOption->rasterThreads = atoi(attr->value);
+	}
+	choice = getenv (RASTER_THREADS_ENV_NAME);
+	if (choice) {
+	  filterPrintOption->rasterThreads = atoi(choice);
+	}
+	if (filterPrintOption->rasterThreads > RASTER_THREADS_MAX) {
+	  filterPrintOption->rasterThreads = RASTER_THREADS_MAX;
+	}
+	debuglog(("Raster threads=%d", filterPrintOption->rasterThreads));
+
+	// Scaling filter of the queue, the environment overrides the PPD
+	attr = get_ppd_attr (SCALE_FILTER_ATTR_NAME, 1);
+	if (attr && attr->value) {
+	  filterPrintOption->scaleFilter = get_scale_filter(attr->value);
+	}
+	choice = getenv (SCALE_FILTER_ENV_NAME);
+	if (choice) {
+	  filterPrintOption->scaleFilter = get_scale_filter(choice);
+	}
+	debuglog(("Scale filter=%d", filterPrintOption->scaleFilter));
+
+	// Pixels a page may be off the printable area by and be cropped or
+	// padded instead of scaled, the environment overrides the PPD
+	attr = get_ppd_attr (SCALE_TOLERANCE_ATTR_NAME, 1);
+	if (attr && attr->value) {
+	  filterPrintOption->scaleTolerance = atoi(attr->value);
+	}
+	choice = getenv (SCALE_TOLERANCE_ENV_NAME);
+	if (choice) {
+	  filterPrintOption->scaleTolerance = atoi(choice);
+	}
+	if (filterPrintOption->scaleTolerance < 0) {
+	  filterPrintOption->scaleTolerance = 0;
+	}
+	debuglog(("Scale tolerance=%d", filterPrintOption->scaleTolerance));
+
+	// Megabytes a page printed bottom up is kept in memory for, a larger
+	// one goes to a temporary file, the environment overrides the PPD
+	attr = get_ppd_attr (REVERSE_MEMORY_ATTR_NAME, 1);
+	if (attr && attr->value) {
+	  filterPrintOption->reverseMemory = atoi(attr->value);
+	}
+	choice = getenv (REVERSE_MEMORY_ENV_NAME);
+	if (choice) {
+	  filterPrintOption->reverseMemory = atoi(choice);
+	}
+	if (filterPrintOption->reverseMemory < 0) {
+	  filterPrintOption->reverseMemory = 0;
+	}
+	debuglog(("Reverse memory=%d", filterPrintOption->reverseMemory));
+
 	error = 0;
 	debuglog(("TRACE OUT=%d", error));
 
@@ -38,6 +38,10 @@ typedef struct {
 	EpsPageWatermarkPosition	watermarkPosition;
 	EpsPageWatermarkDensity		watermarkDensity;
 	EpsPageWatermarkColor		watermarkColor;
+	int		rasterThreads;
+	EpsScaleFilter	scaleFilter;
+	int		scaleTolerance;
+	int		reverseMemory;
 } EpsFilterPrintOption;
 
 ppd_attr_t * get_ppd_attr(const char * name, int isFirst);
@@ -67,6 +67,37 @@ eps_malloc_trace(char * filename, int line, size_t size)
 	return p;
 }
 
+void *
+eps_realloc_trace(char * filename, int line, void * ptr, size_t size)
+{
+	unsigned int * pi;
+	void * p;
+
+	if (ptr == NULL) {
+		return eps_malloc_trace(filename, line, size);
+	}
+
+	pi = (unsigned int *) ptr;
+	pi--;
+	p = realloc(pi, size + sizeof(unsigned int));
+	if(p) {
+		pi = (unsigned int *) p;
+		curusage += (int) size - (int) *pi;
+		*pi++ = size;
+		p = (void *) pi;
+
+		if(curusage > maxusage) {
+			maxusage = curusage;
+		}
+#ifdef DEBUG_VERBOSE
+		debuglog(("MEMREALLOC (%s:%d) address %#x, size %d, max %d, leak %d", filename, line, p, size, maxusage, curusage));
+#endif
+	} else {
+		debuglog(("MEMREALLOC FAILED %d bytes !", size));
+	}
+	return p;
+}
+
 void
 eps_free_trace(char * filename, int line, void * ptr)
 {
@@ -89,6 +120,12 @@ eps_malloc(size_t size)
 	return calloc(size, 1);
 }
 
+void *
+eps_realloc(void * ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
 void
 eps_free(void * ptr)
 {
@@ -38,15 +38,18 @@ extern "C"
 void eps_heap_usage_start(void);
 void eps_heap_usage_end(void);
 void * eps_malloc_trace(char * filename, int line, size_t size);
+void * eps_realloc_trace(char * filename, int line, void * ptr, size_t size);
 void eps_free_trace(char * filename, int line, void * ptr);
 #define DUMP_HEAP_INIT()	eps_heap_usage_start()
 #define DUMP_HEAP_USAGE()	eps_heap_usage_end()
 #define eps_malloc(size)	eps_malloc_trace(__FILE__, __LINE__, size)
+#define eps_realloc(ptr, size)	eps_realloc_trace(__FILE__, __LINE__, ptr, size)
 #define eps_free(ptr)		eps_free_trace(__FILE__, __LINE__, ptr)
 #else
 #define DUMP_HEAP_INIT()
 #define DUMP_HEAP_USAGE()
 void * eps_malloc(size_t size);
+void * eps_realloc(void * ptr, size_t size);	/* the bytes added are not cleared */
 void eps_free(void * ptr);
 #endif
 
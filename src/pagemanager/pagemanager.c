@@ -32,13 +32,17 @@ extern int JobCanceled;
 
 typedef struct PageManagerPrivateData {
 	EpsPageRegion sourceRegion; 
-	EpsRasterPipeline * pipeline;
-	RASTER raster_h;
+	EpsRasterCache * rasterCache;
+	EpsRasterCache ownCache;	/* used without a job-scoped cache */
+	RASTER raster_h;	/* NULL when the page is taken as it is read */
+	EpsFilterPrintOption filterPrintOption;	/* the watermark path of a prepare page */
 	char* raster_buf;
 } PageManagerPrivateData;
 
+/* the next line of the page into dst, of sourceRegion.bytesPerLine
+   bytes. returns 0 when there is none. */
 static int
-fetchRaster(EpsPageManager *pageManager)
+fetchRaster(EpsPageManager *pageManager, char *dst)
 {
 	PageManagerPrivateData  *privateData = (PageManagerPrivateData *)pageManager->privateData;
 	EpsRasterFetchStatus status;
@@ -50,11 +54,18 @@ fetchRaster(EpsPageManager *pageManager)
 	int read_bytes = 0;
 	int nraster;
 
+	if (privateData->raster_h == NULL) {
+		if (pageManager->currentLine >= pageManager->cupsHeight || JobCanceled) {
+			return 0;
+		}
+		return (pageManager->rasterSource(dst, pageManager->cupsBytesPerLine) > 0) ? 1 : 0;
+	}
+
 	while (error == 0 && did_fetch == 0 && JobCanceled == 0) {
 		eps_raster_fetch(privateData->raster_h, NULL, 0, 0, &status);
 		switch (status) {
 			case EPS_RASTER_FETCH_STATUS_HAS_RASTER:
-				error = eps_raster_fetch(privateData->raster_h, ptr, bytes, pixels, &status);
+				error = eps_raster_fetch(privateData->raster_h, dst, bytes, pixels, &status);
 				if (error == 0) {
 					did_fetch = 1;
 				}
@@ -82,13 +93,47 @@ fetchRaster(EpsPageManager *pageManager)
 	return (error == 0) ? 1 : 0;
 }
 
-EpsPageManager* pageManagerCreate(EpsPageRegion pageRegion, EpsFilterPrintOption filterPrintOption, EpsRasterSource rasterSource)
+/* what the page manager does to the source page before it is laid out */
+static void
+prepareInfo(EpsPageRegion pageRegion, EpsFilterPrintOption *filterPrintOption, EpsPageInfo *page)
+{
+	memset(page, 0, sizeof(EpsPageInfo));
+
+	page->bytes_per_pixel = pageRegion.bitsPerPixel / 8;
+	page->src_print_area_x = pageRegion.width;
+	page->src_print_area_y = pageRegion.height; 
+	
+	page->prt_print_area_x = pageRegion.width;
+	page->prt_print_area_y = pageRegion.height;
+	
+	page->mirror = filterPrintOption->mirrorImage;
+	if (filterPrintOption->rotate180) {
+		page->reverse = 1;
+		if (page->mirror) {
+			page->mirror = 0;
+		} else {
+			page->mirror = 1;
+		}
+	}
+	page->reverse_memory = filterPrintOption->reverseMemory;
+	
+	page->watermark.use = filterPrintOption->useWatermark;
+	if (page->watermark.use) {
+		page->watermark.filepath = filterPrintOption->watermarkFilePath;
+		page->watermark.size_ratio = filterPrintOption->size_ratio;
+		page->watermark.position = filterPrintOption->watermarkPosition;
+		page->watermark.density = filterPrintOption->watermarkDensity;
+		page->watermark.color = filterPrintOption->watermarkColor;
+	}
+}
+
+static EpsPageManager*
+createPageManager(EpsPageRegion pageRegion, EpsFilterPrintOption filterPrintOption, EpsRasterSource rasterSource, EpsRasterCache *rasterCache, EpsPageInfo *prepare)
 {
 	EpsPageManager*		pageManager;
-	EpsSubPageManager	subPageManager;
 	PageManagerPrivateData  *privateData;	
 
-	EpsPageInfo page = { 0 };
+	EpsPageInfo page;
 	EpsRasterOpt rasteropt;
 
 	pageManager = (EpsPageManager *)eps_malloc(sizeof(EpsPageManager));
@@ -130,39 +175,27 @@ EpsPageManager* pageManagerCreate(EpsPageRegion pageRegion, EpsFilterPrintOption
 
 		rasteropt.drv_handle = NULL;
 		rasteropt.raster_output = NULL;
-		page.bytes_per_pixel = pageRegion.bitsPerPixel / 8;
-		page.src_print_area_x = pageRegion.width;
-		page.src_print_area_y = pageRegion.height; 
-		
-		page.prt_print_area_x = pageRegion.width;
-		page.prt_print_area_y = pageRegion.height;
-		
-		page.mirror = filterPrintOption.mirrorImage;
-		if (filterPrintOption.rotate180) {
-			page.reverse = 1;
-			if (page.mirror) {
-				page.mirror = 0;
-			} else {
-				page.mirror = 1;
+		rasteropt.threads = filterPrintOption.rasterThreads;
+		privateData->filterPrintOption = filterPrintOption;
+		prepareInfo(pageRegion, &privateData->filterPrintOption, &page);
+
+		privateData->rasterCache = (rasterCache) ? rasterCache : &privateData->ownCache;
+		if (prepare) {
+			/* the caller runs the pipes in its own pipeline */
+			memcpy(prepare, &page, sizeof(EpsPageInfo));
+			debuglog(("pageManager : fetching pipeline handed over"));
+		} else if (raster_helper_passthrough(&page)) {
+			debuglog(("pageManager : no fetching pipeline"));
+		} else {
+			privateData->raster_h = raster_helper_cache_get(privateData->rasterCache, &page, EPS_RASTER_PROCESS_MODE_FETCHING, &rasteropt);
+			if (privateData->raster_h == NULL) {
+				subPageManagerDestroy(pageManager->subPageManager);
+				eps_free(privateData->raster_buf);
+				eps_free(pageManager);
+				eps_free(privateData);
+				return NULL;
 			}
 		}
-		
-		page.watermark.use = filterPrintOption.useWatermark;
-		if (page.watermark.use) {
-			page.watermark.filepath = filterPrintOption.watermarkFilePath;
-			page.watermark.size_ratio = filterPrintOption.size_ratio;
-			page.watermark.position = filterPrintOption.watermarkPosition;
-			page.watermark.density = filterPrintOption.watermarkDensity;
-			page.watermark.color = filterPrintOption.watermarkColor;
-		}
-		privateData->pipeline = (EpsRasterPipeline *) raster_helper_create_pipeline(&page, EPS_RASTER_PROCESS_MODE_FETCHING);
-
-		if (eps_raster_init(&privateData->raster_h, &rasteropt, privateData->pipeline)) {
-			subPageManagerDestroy(pageManager->subPageManager);
-			eps_free(pageManager);
-			eps_free(privateData);
-			return NULL;
-		}
 	}
 	
 	pageManager->privateData 		= privateData;	
@@ -170,6 +203,20 @@ EpsPageManager* pageManagerCreate(EpsPageRegion pageRegion, EpsFilterPrintOption
 	return pageManager;
 }
 
+EpsPageManager* pageManagerCreate(EpsPageRegion pageRegion, EpsFilterPrintOption filterPrintOption, EpsRasterSource rasterSource, EpsRasterCache *rasterCache)
+{
+	return createPageManager(pageRegion, filterPrintOption, rasterSource, rasterCache, NULL);
+}
+
+EpsPageManager* pageManagerCreateRaw(EpsPageRegion pageRegion, EpsFilterPrintOption filterPrintOption, EpsRasterSource rasterSource, EpsPageInfo *prepare)
+{
+	if (filterPrintOption.pageLayout != EPS_PAGE_LAYOUT_1x1 || prepare == NULL) {
+		return NULL;
+	}
+
+	return createPageManager(pageRegion, filterPrintOption, rasterSource, NULL, prepare);
+}
+
 void pageManagerDestroy(EpsPageManager *pageManager)
 {
 	PageManagerPrivateData  *privateData;
@@ -184,12 +231,8 @@ void pageManagerDestroy(EpsPageManager *pageManager)
 			eps_free(privateData->raster_buf);
 		}
 
-		if (privateData->raster_h) {
-			eps_raster_free(privateData->raster_h);
-		}
-
-		if (privateData->pipeline) {
-			raster_helper_destroy_pipeline(privateData->pipeline);
+		if (privateData->rasterCache == &privateData->ownCache) {
+			raster_helper_cache_clear(&privateData->ownCache);
 		}
 
 		eps_free(privateData);
@@ -229,13 +272,22 @@ int pageManagerGetRaster(EpsPageManager *pageManager, char *buf, int bufSize)
 	if (privateData == NULL) {
 		return EPS_ERROR;
 	}
+
+	/* a page printed as it is goes to buf without a subpage */
+	if (pageManager->pageLayout == EPS_PAGE_LAYOUT_1x1 && bufSize >= pageManager->cupsBytesPerLine) {
+		if (pageManager->currentLine >= pageManager->cupsHeight || fetchRaster(pageManager, buf) == 0) {
+			return EPS_ERROR;
+		}
+		pageManager->currentLine++;
+		return error;
+	}
 	
 	while (1) {
 		if (subPageManagerGetRaster(pageManager->subPageManager, buf, bufSize) == EPS_OK) {
 			break;
 		}
 		
-		if (fetchRaster(pageManager) == 0) {
+		if (fetchRaster(pageManager, privateData->raster_buf) == 0) {
 			//when printing poster, some subpages contain redundant line at the bottom
 			//to avoid such situation, redundant lines must be cleaned by 0xFF
 			if ((pageManager->subPageManager->pageLayout != EPS_PAGE_LAYOUT_2x1) && (pageManager->subPageManager->pageLayout != EPS_PAGE_LAYOUT_1x1)){
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include "filter_option.h"
 #include "subpagemanager.h"
+#include "raster-helper.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -44,7 +45,12 @@ typedef struct {
 	void *		privateData;
 } EpsPageManager;
 
-EpsPageManager* pageManagerCreate(EpsPageRegion pageRegion, EpsFilterPrintOption filterPrintOption, EpsRasterSource rasterSource);
+/* rasterCache keeps the fetching pipeline for the job, NULL for one page */
+EpsPageManager* pageManagerCreate(EpsPageRegion pageRegion, EpsFilterPrintOption filterPrintOption, EpsRasterSource rasterSource, EpsRasterCache *rasterCache);
+/* a 1x1 page read as it is, prepare gets what pageManagerCreate would do to
+   it for the caller's raster_helper_cache_get_chain. prepare is valid while
+   the page manager is. */
+EpsPageManager* pageManagerCreateRaw(EpsPageRegion pageRegion, EpsFilterPrintOption filterPrintOption, EpsRasterSource rasterSource, EpsPageInfo *prepare);
 void pageManagerDestroy(EpsPageManager *pageManager);
 int pageManagerGetPageRegion(EpsPageManager *pageManager, EpsPageRegion *pageRegion);
 int pageManagerGetRaster(EpsPageManager *pageManager, char *buf, int bufSize);
@@ -25,7 +25,176 @@
 #include "memory.h"
 #include "subpage.h"
 
-EpsSubPage* subPageCreate(int raster_start, int bytesPerLine, int height, int bytesPerPixel)
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* rotated lines are written as columns this many at a time */
+#define SUBPAGE_BAND_LINES	32
+
+/* and the columns a block of rows at a time, so the rows written stay in cache */
+#define SUBPAGE_TILE_ROWS	64
+
+// The band is transposed 8x8 pixels at a time for 1 bpp and 4x4 for 4 bpp
+// where the compiler targets SSE2, 4x4 for 3 bpp with SSSE3, and a pixel
+// at a time elsewhere.
+#if defined(__SSE2__)
+/* rows 0 to 7 of 8 bytes, src lines apart, to columns 0 to 7 */
+static void
+subpage_transpose_8x8_1(char *dst, int dstStride, const char *src, int srcStride)
+{
+	__m128i a0, a1, a2, a3, b0, b1, b2, b3, c;
+
+	a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src), _mm_loadl_epi64((const __m128i *) (src + srcStride)));
+	a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (src + 2 * srcStride)), _mm_loadl_epi64((const __m128i *) (src + 3 * srcStride)));
+	a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (src + 4 * srcStride)), _mm_loadl_epi64((const __m128i *) (src + 5 * srcStride)));
+	a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (src + 6 * srcStride)), _mm_loadl_epi64((const __m128i *) (src + 7 * srcStride)));
+	b0 = _mm_unpacklo_epi16(a0, a1);
+	b1 = _mm_unpackhi_epi16(a0, a1);
+	b2 = _mm_unpacklo_epi16(a2, a3);
+	b3 = _mm_unpackhi_epi16(a2, a3);
+
+	c = _mm_unpacklo_epi32(b0, b2);
+	_mm_storel_epi64((__m128i *) dst, c);
+	_mm_storel_epi64((__m128i *) (dst + dstStride), _mm_unpackhi_epi64(c, c));
+	c = _mm_unpackhi_epi32(b0, b2);
+	_mm_storel_epi64((__m128i *) (dst + 2 * dstStride), c);
+	_mm_storel_epi64((__m128i *) (dst + 3 * dstStride), _mm_unpackhi_epi64(c, c));
+	c = _mm_unpacklo_epi32(b1, b3);
+	_mm_storel_epi64((__m128i *) (dst + 4 * dstStride), c);
+	_mm_storel_epi64((__m128i *) (dst + 5 * dstStride), _mm_unpackhi_epi64(c, c));
+	c = _mm_unpackhi_epi32(b1, b3);
+	_mm_storel_epi64((__m128i *) (dst + 6 * dstStride), c);
+	_mm_storel_epi64((__m128i *) (dst + 7 * dstStride), _mm_unpackhi_epi64(c, c));
+}
+
+/* the 4 pixels of 4 bytes of each of r[0] to r[3] to columns */
+static void
+subpage_transpose_4x4(__m128i *r)
+{
+	__m128i t0, t1, t2, t3;
+
+	t0 = _mm_unpacklo_epi32(r[0], r[1]);
+	t1 = _mm_unpacklo_epi32(r[2], r[3]);
+	t2 = _mm_unpackhi_epi32(r[0], r[1]);
+	t3 = _mm_unpackhi_epi32(r[2], r[3]);
+	r[0] = _mm_unpacklo_epi64(t0, t1);
+	r[1] = _mm_unpackhi_epi64(t0, t1);
+	r[2] = _mm_unpacklo_epi64(t2, t3);
+	r[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+static void
+subpage_transpose_4x4_4(char *dst, int dstStride, const char *src, int srcStride)
+{
+	__m128i r[4];
+	int k;
+
+	for (k = 0; k < 4; k++) {
+		r[k] = _mm_loadu_si128((const __m128i *) (src + k * srcStride));
+	}
+	subpage_transpose_4x4(r);
+	for (k = 0; k < 4; k++) {
+		_mm_storeu_si128((__m128i *) (dst + k * dstStride), r[k]);
+	}
+}
+#endif
+
+#if defined(__SSSE3__)
+/* reads 4 bytes past the 12 of each row */
+static void
+subpage_transpose_4x4_3(char *dst, int dstStride, const char *src, int srcStride)
+{
+	const __m128i widen = _mm_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128);
+	const __m128i narrow = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128, -128);
+	__m128i r[4];
+	int k, tail;
+
+	for (k = 0; k < 4; k++) {
+		r[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + k * srcStride)), widen);
+	}
+	subpage_transpose_4x4(r);
+	for (k = 0; k < 4; k++) {
+		r[k] = _mm_shuffle_epi8(r[k], narrow);
+		_mm_storel_epi64((__m128i *) (dst + k * dstStride), r[k]);
+		tail = _mm_cvtsi128_si32(_mm_srli_si128(r[k], 8));
+		memcpy(dst + k * dstStride + 8, &tail, 4);
+	}
+}
+#endif
+
+/* dst row y, pixel c gets pixel y of src line c, for lines lines of rows
+   pixels */
+static void
+subpage_transpose(char *dst, int dstStride, const char *src, int srcStride, int lines, int rows, int bpp)
+{
+	const char *p;
+	char *q;
+	int y0, y1, y, c, c1, k;
+
+	for (y0 = 0; y0 < rows; y0 += SUBPAGE_TILE_ROWS) {
+		y1 = (y0 + SUBPAGE_TILE_ROWS < rows) ? y0 + SUBPAGE_TILE_ROWS : rows;
+		for (c = 0; c < lines; c += 8) {
+			c1 = (c + 8 < lines) ? c + 8 : lines;
+			y = y0;
+#if defined(__SSE2__)
+			if (c1 - c == 8 && bpp == 1) {
+				for (; y + 8 <= y1; y += 8) {
+					subpage_transpose_8x8_1(dst + y * dstStride + c, dstStride, src + c * srcStride + y, srcStride);
+				}
+			} else if (c1 - c == 8 && bpp == 4) {
+				for (; y + 4 <= y1; y += 4) {
+					subpage_transpose_4x4_4(dst + y * dstStride + c * 4, dstStride, src + c * srcStride + y * 4, srcStride);
+					subpage_transpose_4x4_4(dst + y * dstStride + (c + 4) * 4, dstStride, src + (c + 4) * srcStride + y * 4, srcStride);
+				}
+			}
+#endif
+#if defined(__SSSE3__)
+			if (c1 - c == 8 && bpp == 3) {
+				for (; y + 4 <= y1; y += 4) {
+					subpage_transpose_4x4_3(dst + y * dstStride + c * 3, dstStride, src + c * srcStride + y * 3, srcStride);
+					subpage_transpose_4x4_3(dst + y * dstStride + (c + 4) * 3, dstStride, src + (c + 4) * srcStride + y * 3, srcStride);
+				}
+			}
+#endif
+			for (; y < y1; y++) {
+				q = dst + y * dstStride + c * bpp;
+				p = src + c * srcStride + y * bpp;
+				if (bpp == 3) {
+					for (k = c; k < c1; k++, q += 3, p += srcStride) {
+						q[0] = p[0];
+						q[1] = p[1];
+						q[2] = p[2];
+					}
+				} else {
+					for (k = c; k < c1; k++, q += bpp, p += srcStride) {
+						memcpy(q, p, bpp);
+					}
+				}
+			}
+		}
+	}
+}
+
+/* writes the lines of the band as their columns, the first line to the
+   rightmost one */
+static void
+subPageWriteBand(EpsSubPage *subPage)
+{
+	int first = SUBPAGE_BAND_LINES - subPage->bandLines;
+	int column = subPage->width - subPage->bufferedLine + subPage->bandLines - SUBPAGE_BAND_LINES;
+
+	if (subPage->bandLines > 0) {
+		subpage_transpose(subPage->raster + (column + first) * subPage->bytesPerPixel, subPage->bytesPerLine,
+			subPage->band + first * subPage->bandStride, subPage->bandStride,
+			subPage->bandLines, subPage->height, subPage->bytesPerPixel);
+		subPage->bandLines = 0;
+	}
+}
+
+EpsSubPage* subPageCreate(int raster_start, int bytesPerLine, int width, int height, int bytesPerPixel)
 {
 	EpsSubPage* subPage = NULL;
 	
@@ -37,6 +206,7 @@ EpsSubPage* subPageCreate(int raster_start, int bytesPerLine, int height, int by
 	
 	subPage->raster_start	= raster_start;
 	subPage->bytesPerLine	= bytesPerLine;
+	subPage->width		= width;
 	subPage->height		= height;
 	subPage->bufferedLine	= 0;
 	subPage->fetchedLine	= 0;
@@ -59,6 +229,10 @@ int subPageDestroy(EpsSubPage *subPage)
 	if (subPage->raster != NULL) {
 		eps_free(subPage->raster);
 	}
+
+	if (subPage->band != NULL) {
+		eps_free(subPage->band);
+	}
 	
 	eps_free(subPage);
 	subPage = NULL;
@@ -105,6 +279,7 @@ int subPageFlushRaster(EpsSubPage *subPage)
 	}
 	
 	if (subPage->bufferedLine > 0) {
+		subPageWriteBand(subPage);
 		subPage->fetchedLine = 0;
 		subPage->status = EPS_SUBPAGE_STATUS_BUFFERING_COMPLETE;
 		return EPS_OK;
@@ -155,9 +330,13 @@ int subPageSetRasterRotate0(EpsSubPage *subPage, char *raster, int bufSize)
 	return EPS_OK;
 }
 
+/* raster is a line of the page turned a quarter clockwise, it is kept
+   in the band until the band is full or the subpage is, then the band is
+   written as columns from right to left */
 int subPageSetRasterRotate90(EpsSubPage *subPage, char *raster, int bufSize)
 {
-	int y, width, height;
+	char *line;
+	int bytes;
 
 	if (subPage == NULL) {
 		return EPS_ERROR;
@@ -167,29 +346,33 @@ int subPageSetRasterRotate90(EpsSubPage *subPage, char *raster, int bufSize)
 		return EPS_ERROR;
 	}
 
-	if (subPage->height > bufSize) {
-		height = bufSize;
-	} else {
-		height = subPage->height;
-	}
-	width = (subPage->bytesPerLine / subPage->bytesPerPixel - 1) - subPage->bufferedLine;
-
-	if (width >= 0)
-	{
-		for (y = 0; y < height; y++) {
-			subPage->raster[y * subPage->bytesPerLine + subPage->bytesPerPixel * width]
-				= raster[subPage->raster_start + subPage->bytesPerPixel * y];
-			subPage->raster[y * subPage->bytesPerLine + subPage->bytesPerPixel * width + 1]
-				= raster[subPage->raster_start + subPage->bytesPerPixel * y + 1];
-			subPage->raster[y * subPage->bytesPerLine + subPage->bytesPerPixel * width + 2]
-				= raster[subPage->raster_start + subPage->bytesPerPixel * y + 2];
+	if (subPage->band == NULL) {
+		/* room for the kernels reading past the last pixel */
+		subPage->bandStride = (subPage->height * subPage->bytesPerPixel + 16 + 15) / 16 * 16;
+		subPage->band = (char *)eps_malloc(subPage->bandStride * SUBPAGE_BAND_LINES);
+		if (subPage->band == NULL) {
+			return EPS_ERROR;
 		}
+	}
+
+	if (subPage->bufferedLine < subPage->width) {
+		line = subPage->band + (SUBPAGE_BAND_LINES - 1 - subPage->bandLines) * subPage->bandStride;
+		bytes = subPage->height * subPage->bytesPerPixel;
+		if (bytes > bufSize - subPage->raster_start) {
+			bytes = (bufSize > subPage->raster_start) ? bufSize - subPage->raster_start : 0;
+			memset(line + bytes, 0xff, subPage->height * subPage->bytesPerPixel - bytes);
+		}
+		memcpy(line, raster + subPage->raster_start, bytes);
+		subPage->bandLines++;
 		subPage->bufferedLine++;
 	}
 #ifdef DEBUG_VERBOSE
 	debuglog(("subPageSetRaster. : %p", subPage));
 #endif	
-	if (subPage->bufferedLine >= subPage->bytesPerLine / subPage->bytesPerPixel) {
+	if (subPage->bandLines == SUBPAGE_BAND_LINES || subPage->bufferedLine >= subPage->width) {
+		subPageWriteBand(subPage);
+	}
+	if (subPage->bufferedLine >= subPage->width) {
 		subPage->fetchedLine = 0;
 		subPage->status = EPS_SUBPAGE_STATUS_BUFFERING_COMPLETE;
 	}
@@ -38,14 +38,18 @@ typedef struct {
 	char	*raster;
 	int		raster_start;
 	int		bytesPerLine;
+	int		width;
 	int		height;
 	int		bufferedLine;
 	int		fetchedLine;
 	EpsSubPageStatus status;
 	int		bytesPerPixel;
+	char	*band;		/* rotated: lines not yet written as columns */
+	int		bandStride;
+	int		bandLines;
 } EpsSubPage;
 
-EpsSubPage* subPageCreate(int raster_start, int bytesPerLine, int height, int bytesPerPixel);
+EpsSubPage* subPageCreate(int raster_start, int bytesPerLine, int width, int height, int bytesPerPixel);
 int subPageDestroy(EpsSubPage *subPage);
 int subPageGetRaster(EpsSubPage *subPage, char *buf, int bufSize);
 int subPageFlushRaster(EpsSubPage *subPage);
@@ -94,7 +94,7 @@ EpsSubPageManager* subPageManagerCreate(EpsPageRegion *pageRegion, EpsPageLayout
 			height = pageRegion->height;
 		}
 
-		subPageManager->subPage[i] = subPageCreate(pageRegion->bytesPerLine * i, pageRegion->bytesPerLine, height, bytesPerPixel);
+		subPageManager->subPage[i] = subPageCreate(pageRegion->bytesPerLine * i, pageRegion->bytesPerLine, pageRegion->width, height, bytesPerPixel);
 
 		if (subPageManager->subPage[i] == NULL) {
 			if (subPageManager != NULL) {
@@ -23,13 +23,264 @@
 #include <stdlib.h>
 #include <string.h>
 #include "blend.h"
+#include "mirror.h"
+#include "span.h"
 
 typedef struct EpsBlend {
 	EpsBlendOpt *init_data;
 	EpsBlendSource *blender;
 	int raster_index;
+	char *scratch;		/* used only when the input line is not writable */
+	int scratch_bytes;
+	EpsRasterExtent * extents;
+	int num_extent;
+	EpsRasterSpan * spans;	/* mirrored spans */
+	int span_size;
+	EpsRasterSpan * blended;	/* spans around the blended pixels */
+	int blended_size;
 } EpsBlend;
 
+static void
+mirror_line(char * dst, const char * src, int raster_bytes, int pixel_num, EpsRasterExtent * extent)
+{
+	eps_mirror_line(dst, src, raster_bytes, pixel_num, raster_bytes / pixel_num, extent);
+}
+
+/* copies the line into scratch, the white margins are filled only */
+static void
+copy_line(char * dst, const char * src, int raster_bytes, int pixel_num, const EpsRasterExtent * extent)
+{
+	int bpp = raster_bytes / pixel_num;
+	int pixel_bytes = pixel_num * bpp;
+
+	if (EPS_RASTER_EXTENT_BLANK(extent)) {
+		memset(dst, 0xFF, pixel_bytes);
+	} else {
+		memset(dst, 0xFF, extent->left * bpp);
+		memcpy(dst + extent->left * bpp, src + extent->left * bpp, (extent->right - extent->left) * bpp);
+		memset(dst + extent->right * bpp, 0xFF, pixel_bytes - extent->right * bpp);
+	}
+	if (raster_bytes > pixel_bytes) {
+		memcpy(dst + pixel_bytes, src + pixel_bytes, raster_bytes - pixel_bytes);
+	}
+}
+
+static EpsRasterExtent *
+blend_extents(EpsBlend * lp_blend, int lines, int pixel_num)
+{
+	int i;
+
+	if (lp_blend->num_extent < lines) {
+		if (lp_blend->extents) {
+			eps_free(lp_blend->extents);
+		}
+		lp_blend->extents = (EpsRasterExtent *) eps_malloc(sizeof(EpsRasterExtent) * lines);
+		lp_blend->num_extent = (lp_blend->extents) ? lines : 0;
+	}
+
+	for (i = 0; i < lp_blend->num_extent && i < lines; i++) {
+		eps_raster_pipe_extent(lp_blend->init_data->pipe, i, pixel_num, &lp_blend->extents[i]);
+	}
+
+	return lp_blend->extents;
+}
+
+static int
+blend_scratch(EpsBlend * lp_blend, int bytes)
+{
+	if (lp_blend->scratch_bytes < bytes) {
+		eps_free(lp_blend->scratch);
+		lp_blend->scratch = (char *)eps_malloc(bytes);
+		lp_blend->scratch_bytes = (lp_blend->scratch) ? bytes : 0;
+	}
+
+	return (lp_blend->scratch) ? 0 : 1;
+}
+
+/* returns the band itself, or a packed copy of it when the band may not
+   be written. a mirrored pipe mirrors the lines on the way. each line
+   stands for repeat input lines. */
+static char *
+writable_band(EpsBlend * lp_blend, char * band, int stride, int lines, int repeat, int writable, int raster_bytes, int pixel_num, EpsRasterExtent * extents)
+{
+	EpsRasterPipe * pipe = lp_blend->init_data->pipe;
+	int mirror = lp_blend->init_data->mirror;
+	int i;
+
+	if (writable) {
+		for (i = 0; mirror && i < lines; i++) {
+			if (!eps_raster_run_dropped(pipe, lp_blend->raster_index + i * repeat, repeat)) {
+				mirror_line(band + i * stride, band + i * stride, raster_bytes, pixel_num, &extents[i]);
+			}
+		}
+		return band;
+	}
+
+	if (blend_scratch(lp_blend, raster_bytes * lines) == 0) {
+		for (i = 0; i < lines; i++) {
+			if (eps_raster_run_dropped(pipe, lp_blend->raster_index + i * repeat, repeat)) {
+				continue;
+			}
+			if (mirror) {
+				mirror_line(lp_blend->scratch + i * raster_bytes, band + i * stride, raster_bytes, pixel_num, &extents[i]);
+			} else {
+				copy_line(lp_blend->scratch + i * raster_bytes, band + i * stride, raster_bytes, pixel_num, &extents[i]);
+			}
+		}
+	} else {
+		debuglog(("BLEND MEMALLOC ERROR %d bytes", raster_bytes * lines));
+	}
+
+	return lp_blend->scratch;
+}
+
+/* line index of the page has pixels the blender changes */
+static int
+blend_row_covered(EpsBlend * lp_blend, int index)
+{
+	EpsBlendOpt * lp_data = lp_blend->init_data;
+	EpsBlendSource * blender = lp_blend->blender;
+	int left, right;
+
+	if (!is_current_raster_in_blending_bounds(index, lp_data->bounds)) {
+		return 0;
+	}
+	if (blender->coveredRange) {
+		return blender->coveredRange(blender->privateData, index - lp_data->bounds.origin.y, &left, &right);
+	}
+
+	return 1;
+}
+
+/* the pixels left to right of line index the blender changes, on the line
+   as it leaves the pipe. returns 0 when there are none. */
+static int
+blend_covered(EpsBlend * lp_blend, int index, int pixel_num, int * left, int * right)
+{
+	EpsBlendOpt * lp_data = lp_blend->init_data;
+	EpsBlendSource * blender = lp_blend->blender;
+	int width = lp_data->bounds.size.width;
+	int x = lp_data->bounds.origin.x;
+	int l = 0;
+	int r = width;
+
+	if (!is_current_raster_in_blending_bounds(index, lp_data->bounds)) {
+		return 0;
+	}
+	if (blender->coveredRange
+			&& !blender->coveredRange(blender->privateData, index - lp_data->bounds.origin.y, &l, &r)) {
+		return 0;
+	}
+	l = (l < 0) ? 0 : l;
+	r = (r > width) ? width : r;
+	if (l >= r) {
+		return 0;
+	}
+
+	if (lp_data->mirror) {
+		x = pixel_num - (x + width);
+		*left = x + width - r;
+		*right = x + width - l;
+	} else {
+		*left = x + l;
+		*right = x + r;
+	}
+
+	return 1;
+}
+
+/* blends line index of the page, which is already mirrored for a mirrored
+   pipe, and widens its extent by the pixels blended. the blender is only
+   read. */
+static void
+blend_line(EpsBlend * lp_blend, int index, char * raster_p, int raster_bytes, int pixel_num, EpsRasterExtent * extent)
+{
+	EpsBlendOpt * lp_data = lp_blend->init_data;
+	int bytes_per_pixel;
+	int x = lp_data->bounds.origin.x;
+	int left, right;
+
+	if (EPS_RASTER_LINE_DROPPED(lp_data->pipe, index)) {
+		return;
+	}
+
+	if (blend_covered(lp_blend, index, pixel_num, &left, &right)) {
+		bytes_per_pixel = raster_bytes / pixel_num;
+		if (lp_data->mirror) {
+			x = pixel_num - (lp_data->bounds.origin.x + lp_data->bounds.size.width);
+		}
+		lp_blend->blender->blendingPixels(lp_blend->blender->privateData,
+			index - lp_data->bounds.origin.y,
+			raster_p + (x * bytes_per_pixel),
+			bytes_per_pixel * lp_data->bounds.size.width,
+			lp_data->bounds.size.width,
+			lp_data->mirror);
+
+		if (EPS_RASTER_EXTENT_BLANK(extent)) {
+			extent->left = left;
+			extent->right = right;
+		} else {
+			if (extent->left > left) {
+				extent->left = left;
+			}
+			if (extent->right < right) {
+				extent->right = right;
+			}
+		}
+		if (extent->left < 0) {
+			extent->left = 0;
+		}
+		if (extent->right > pixel_num) {
+			extent->right = pixel_num;
+		}
+	}
+}
+
+/* any of repeat lines from index has pixels of the watermark */
+static int
+blend_rows_touched(EpsBlend * lp_blend, int index, int repeat)
+{
+	EpsBlendOpt * lp_data = lp_blend->init_data;
+	int start = lp_data->bounds.origin.y;
+	int end = start + lp_data->bounds.size.height;
+	int i;
+
+	start = (index > start) ? index : start;
+	end = (index + repeat - 1 < end) ? index + repeat - 1 : end;
+	for (i = start; i <= end; i++) {
+		if (blend_row_covered(lp_blend, i)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+blend_raster(EpsBlend * lp_blend, char * raster_p, int raster_bytes, int pixel_num, EpsRasterExtent * extent)
+{
+	blend_line(lp_blend, lp_blend->raster_index, raster_p, raster_bytes, pixel_num, extent);
+	lp_blend->raster_index++;
+}
+
+/* line kernel */
+static int
+blend_kernel(PIPEOBJ blend, int index, char * src, char * raster_p, int raster_bytes, int pixel_num, EpsRasterExtent * extent)
+{
+	EpsBlend * lp_blend = (EpsBlend *) blend;
+
+	if (EPS_RASTER_LINE_DROPPED(lp_blend->init_data->pipe, index)) {
+		return 0;
+	}
+
+	if (lp_blend->init_data->mirror) {
+		mirror_line(raster_p, raster_p, raster_bytes, pixel_num, extent);
+	}
+	blend_line(lp_blend, index, raster_p, raster_bytes, pixel_num, extent);
+
+	return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // * A P I for blend (extern functions)
@@ -66,6 +317,18 @@ eps_init_blend (RASTERPIPE * blend_p, PIPEOPT init_p)
 		blend->raster_index = 0;
 		blend->init_data = blendOpt;
 		blend->blender = blender;
+		blend->scratch = NULL;
+		blend->scratch_bytes = 0;
+		blend->extents = NULL;
+		blend->num_extent = 0;
+		blend->spans = NULL;
+		blend->span_size = 0;
+		blend->blended = NULL;
+		blend->blended_size = 0;
+
+		/* blended in place, or in scratch when the input is read-only */
+		blendOpt->pipe->output_ownership = EPS_RASTER_LINE_WRITABLE;
+		blendOpt->pipe->pipe_kernel = blend_kernel;
 
 		*blend_p = (BLEND) blend;
 
@@ -81,10 +344,7 @@ eps_process_blend (RASTERPIPE blend, char* raster_p, int raster_bytes, int pixel
 {
 	EpsBlend * lp_blend = (EpsBlend *) blend;
 	EpsBlendOpt * lp_data = NULL;
-	char * blend_p = NULL;
-	int blend_bytes;
-	int blend_pixels;
-	int bytes_per_pixel;
+	EpsRasterExtent extent;
 	int error = 0;
 	int nraster = 0;
 
@@ -92,20 +352,19 @@ eps_process_blend (RASTERPIPE blend, char* raster_p, int raster_bytes, int pixel
 
 	if (lp_blend && (lp_data = (EpsBlendOpt *) lp_blend->init_data))  {
 		if (raster_p) {
-			if (is_current_raster_in_blending_bounds(lp_blend->raster_index, lp_data->bounds)) {
-				bytes_per_pixel = raster_bytes / pixel_num;
-				blend_p = raster_p + (lp_data->bounds.origin.x * bytes_per_pixel);
-				blend_pixels = lp_data->bounds.size.width;
-				blend_bytes = bytes_per_pixel *  blend_pixels;
-
-				lp_blend->blender->blendingPixels(lp_blend->blender->privateData, blend_p, blend_bytes, blend_pixels);
+			eps_raster_pipe_extent(lp_data->pipe, 0, pixel_num, &extent);
+			raster_p = writable_band(lp_blend, raster_p, raster_bytes, 1, 1, lp_data->pipe->input_ownership == EPS_RASTER_LINE_WRITABLE, raster_bytes, pixel_num, &extent);
+			if (raster_p == NULL) {
+				return 1;
 			}
 
+			blend_raster(lp_blend, raster_p, raster_bytes, pixel_num, &extent);
+			EPS_RASTER_PASS_EXTENT(lp_data->pipe, &extent);
+
 			error = lp_data->pipe->output(lp_data->pipe->output_h, raster_p, raster_bytes, pixel_num, &nraster);
 			if (error == 0) {
 				*outraster = 1;
 			}
-			lp_blend->raster_index++;
 		} else {
 			debuglog(("BLEND FLUSHING HERE ..."));
 			lp_data->pipe->output(lp_data->pipe->output_h, NULL, 0, 0, &nraster);
@@ -115,11 +374,221 @@ eps_process_blend (RASTERPIPE blend, char* raster_p, int raster_bytes, int pixel
 	return error;
 }
 
+int
+eps_process_blend_band (RASTERPIPE blend, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	EpsBlend * lp_blend = (EpsBlend *) blend;
+	EpsBlendOpt * lp_data = NULL;
+	EpsRasterExtent * extents = NULL;
+	char * p = NULL;
+	int error = 1;
+	int nraster = 0;
+	int i;
+
+	*outraster = 0;
+
+	if (lp_blend && (lp_data = (EpsBlendOpt *) lp_blend->init_data))  {
+		extents = blend_extents(lp_blend, lines, pixel_num);
+		if (extents) {
+			p = writable_band(lp_blend, band, stride, lines, 1, lp_data->pipe->input_ownership == EPS_RASTER_LINE_WRITABLE, raster_bytes, pixel_num, extents);
+		}
+		if (p) {
+			if (p != band) {
+				stride = raster_bytes;
+			}
+
+			for (i = 0; i < lines; i++) {
+				blend_raster(lp_blend, p + i * stride, raster_bytes, pixel_num, &extents[i]);
+			}
+			EPS_RASTER_PASS_EXTENT(lp_data->pipe, extents);
+
+			error = lp_data->pipe->output_band(lp_data->pipe->output_band_h, p, stride, lines, raster_bytes, pixel_num, &nraster);
+			if (error == 0) {
+				*outraster = lines;
+			}
+		}
+	}
+
+	return error;
+}
+
+/* the run goes on as one line unless the watermark crosses it. there each
+   line is blended on its own copy, the input is needed for the next one. */
+int
+eps_process_blend_repeat (RASTERPIPE blend, char * raster_p, int raster_bytes, int pixel_num, int repeat, int * outraster)
+{
+	EpsBlend * lp_blend = (EpsBlend *) blend;
+	EpsBlendOpt * lp_data = lp_blend->init_data;
+	EpsRasterExtent extent;
+	char * p = NULL;
+	int error = 0;
+	int nraster = 0;
+	int i;
+
+	*outraster = 0;
+
+	if (blend_rows_touched(lp_blend, lp_blend->raster_index, repeat)) {
+		for (i = 0; i < repeat && error == 0; i++) {
+			eps_raster_pipe_extent(lp_data->pipe, 0, pixel_num, &extent);
+			p = writable_band(lp_blend, raster_p, raster_bytes, 1, 1, 0, raster_bytes, pixel_num, &extent);
+			if (p == NULL) {
+				return 1;
+			}
+
+			blend_raster(lp_blend, p, raster_bytes, pixel_num, &extent);
+			EPS_RASTER_PASS_EXTENT(lp_data->pipe, &extent);
+
+			error = lp_data->pipe->output(lp_data->pipe->output_h, p, raster_bytes, pixel_num, &nraster);
+			if (error == 0) {
+				*outraster += 1;
+			}
+		}
+	} else {
+		eps_raster_pipe_extent(lp_data->pipe, 0, pixel_num, &extent);
+		p = writable_band(lp_blend, raster_p, raster_bytes, 1, repeat, lp_data->pipe->input_ownership == EPS_RASTER_LINE_WRITABLE, raster_bytes, pixel_num, &extent);
+		if (p == NULL) {
+			return 1;
+		}
+
+		lp_blend->raster_index += repeat;
+		EPS_RASTER_PASS_EXTENT(lp_data->pipe, &extent);
+
+		error = lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, p, raster_bytes, pixel_num, repeat, &nraster);
+		if (error == 0) {
+			*outraster = repeat;
+		}
+	}
+
+	return error;
+}
+
+/* the pixels of a row the watermark covers are expanded and blended on
+   their own, the spans around them are kept */
+static int
+blend_span_row(EpsBlend * lp_blend, int index, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsBlendOpt * lp_data = lp_blend->init_data;
+	EpsRasterSpanLine blended = *line;
+	EpsRasterSpan * out = lp_blend->blended;
+	int bpp = line->bytes_per_pixel;
+	int width = lp_data->bounds.size.width;
+	int x = lp_data->bounds.origin.x;
+	int left, right;
+	int num_span;
+
+	if (lp_data->mirror) {
+		x = line->pixels - (lp_data->bounds.origin.x + width);
+	}
+	blend_covered(lp_blend, index, line->pixels, &left, &right);
+
+	/* scratch stands for the bounds, only the covered part is filled */
+	eps_span_expand(lp_blend->scratch + (left - x) * bpp, line, left, right, 0);
+	lp_blend->blender->blendingPixels(lp_blend->blender->privateData,
+		index - lp_data->bounds.origin.y,
+		lp_blend->scratch,
+		bpp * width,
+		width,
+		lp_data->mirror);
+
+	num_span = eps_span_clip(out, line->spans, line->num_span, 0, left);
+	out[num_span].data = lp_blend->scratch + (left - x) * bpp;
+	out[num_span].length = right - left;
+	out[num_span].step = bpp;
+	num_span++;
+	num_span += eps_span_clip(out + num_span, line->spans, line->num_span, right, line->pixels);
+
+	blended.spans = out;
+	blended.num_span = num_span;
+	blended.repeat = 1;
+
+	return lp_data->pipe->output_span(lp_data->pipe->output_span_h, &blended, outraster);
+}
+
+/* rows out of the watermark go on together, the spans as they came */
+int
+eps_process_blend_span (RASTERPIPE blend, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsBlend * lp_blend = (EpsBlend *) blend;
+	EpsBlendOpt * lp_data = lp_blend->init_data;
+	EpsRasterSpanLine run = *line;
+	int index = lp_blend->raster_index;
+	int error = 0;
+	int nraster = 0;
+	int i, n;
+
+	*outraster = 0;
+
+	if (lp_data->mirror) {
+		if (eps_span_reserve(&lp_blend->spans, &lp_blend->span_size, line->num_span)) {
+			debuglog(("BLEND MEMALLOC ERROR %d spans", line->num_span));
+			return 1;
+		}
+		memcpy(lp_blend->spans, line->spans, sizeof(EpsRasterSpan) * line->num_span);
+		eps_span_mirror(lp_blend->spans, line->num_span);
+		run.spans = lp_blend->spans;
+	}
+
+	if (blend_rows_touched(lp_blend, index, line->repeat)) {
+		if (eps_span_reserve(&lp_blend->blended, &lp_blend->blended_size, line->num_span + 3)
+				|| blend_scratch(lp_blend, lp_data->bounds.size.width * line->bytes_per_pixel)) {
+			debuglog(("BLEND MEMALLOC ERROR %d spans", line->num_span + 3));
+			return 1;
+		}
+	}
+
+	for (i = 0; i < line->repeat && error == 0; i += n) {
+		n = 1;
+		if (blend_row_covered(lp_blend, index + i)
+				&& !EPS_RASTER_LINE_DROPPED(lp_data->pipe, index + i)) {
+			error = blend_span_row(lp_blend, index + i, &run, &nraster);
+		} else {
+			while (i + n < line->repeat
+					&& (!blend_row_covered(lp_blend, index + i + n)
+					|| EPS_RASTER_LINE_DROPPED(lp_data->pipe, index + i + n))) {
+				n++;
+			}
+			run.repeat = n;
+			error = lp_data->pipe->output_span(lp_data->pipe->output_span_h, &run, &nraster);
+		}
+		*outraster += nraster;
+	}
+	lp_blend->raster_index += line->repeat;
+
+	return error;
+}
+
+/* the opened blend source is kept, so the watermark is decoded once */
+int
+eps_reset_blend (RASTERPIPE blend)
+{
+	EpsBlend * lp_blend = (EpsBlend *) blend;
+
+	lp_blend->raster_index = 0;
+
+	return 0;
+}
+
 int
 eps_free_blend (RASTERPIPE blend)
 {
 	EpsBlend * lp_blend = (EpsBlend *) blend;
 	if (lp_blend) {
+		if (lp_blend->scratch) {
+			eps_free(lp_blend->scratch);
+		}
+
+		if (lp_blend->extents) {
+			eps_free(lp_blend->extents);
+		}
+
+		if (lp_blend->spans) {
+			eps_free(lp_blend->spans);
+		}
+
+		if (lp_blend->blended) {
+			eps_free(lp_blend->blended);
+		}
+
 		if (lp_blend->init_data) {
 			eps_free(lp_blend->init_data);
 		}
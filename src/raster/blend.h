@@ -40,10 +40,15 @@ typedef struct EpsBlendOpt {
 	EpsRect frame;
 	EpsRect bounds;
 	EpsColor color;
+	int mirror;		/* lines leave the pipe mirrored */
 } EpsBlendOpt;
 
 int eps_init_blend (RASTERPIPE *, PIPEOPT);
 int eps_process_blend (RASTERPIPE, char *, int, int, int *);
+int eps_process_blend_band (RASTERPIPE, char *, int, int, int, int, int *);
+int eps_process_blend_repeat (RASTERPIPE, char *, int, int, int, int *);
+int eps_process_blend_span (RASTERPIPE, const EpsRasterSpanLine *, int *);
+int eps_reset_blend (RASTERPIPE);
 int eps_free_blend (RASTERPIPE);
 
 #ifdef __cplusplus
@@ -55,7 +55,11 @@ typedef struct EpsColor {
 #define EPS_BLEND_SOURCE_ERROR	1
 
 typedef int (*BlendSourceOpen)(void *privateData, const char* sourcePath, EpsSize size, EpsColor color);
-typedef int (*BlendSourceBlendingPixels)(void *privateData, unsigned char* pixelBuf, int bytesPixelBuf, int pixelCount);
+/* mirror: pixelBuf holds the pixels of the row right to left */
+typedef int (*BlendSourceBlendingPixels)(void *privateData, int row, unsigned char* pixelBuf, int bytesPixelBuf, int pixelCount, int mirror);
+/* optional. returns 0 when row has no pixels to blend, else the pixels
+   left to right blendingPixels changes, before any mirror */
+typedef int (*BlendSourceCoveredRange)(void *privateData, int row, int *left, int *right);
 typedef int (*BlendSourceClose)(void *privateData);
 typedef void (*BlendSourcePrivateFinalize)(void *privateData);
 
@@ -63,6 +67,7 @@ typedef struct EpsBlendSource {
 	void *privateData;
 	BlendSourceOpen open;
 	BlendSourceBlendingPixels blendingPixels;
+	BlendSourceCoveredRange coveredRange;
 	BlendSourceClose close;
 	BlendSourcePrivateFinalize finalize;
 } EpsBlendSource;
@@ -0,0 +1,303 @@
+/*
+   Copyright (C) Seiko Epson Corporation 2009.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free  Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "blend-watermark.h"
+
+/* Coverage masks rendered from a watermark file are kept in a directory
+   shared by the filter processes, one file for each source and page size.
+   A file is named after a hash of the key and holds the key again, so a
+   file of another key or an older source is never taken. Files are
+   written aside and renamed in, a filter maps either a whole file or
+   none. */
+
+#define WBF_CACHE_DIR_ENV_NAME		"EPS_WATERMARK_CACHE"
+#define WBF_CACHE_CUPS_ENV_NAME		"CUPS_CACHEDIR"
+#define WBF_CACHE_CUPS_SUBDIR		"epson-watermark"
+#define WBF_CACHE_MAGIC			"EPSWMC1"
+
+typedef struct {
+	char magic[8];
+	unsigned int header_size;
+	int target_width;
+	int target_height;
+	int image_width;
+	int image_height;
+	int stride;
+	int rows;
+	long long source_mtime;
+	long long source_size;
+	unsigned long long path_hash;
+} wbf_cache_header_t;
+
+typedef struct {
+	void *map;
+	size_t map_size;
+} wbf_cache_private_data_t;
+
+static unsigned long long wbf_cache_hash(unsigned long long hash, const void *p, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *) p;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* the header a cache file of sourcePath at size must have, image size and
+   mask geometry left to the caller. returns 0 when the source is gone. */
+static int wbf_cache_key(const char *sourcePath, EpsSize size, wbf_cache_header_t *header, unsigned long long *name)
+{
+	struct stat st;
+
+	if (stat(sourcePath, &st) != 0) {
+		return 0;
+	}
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, WBF_CACHE_MAGIC, sizeof(WBF_CACHE_MAGIC));
+	header->header_size = sizeof(*header);
+	header->target_width = size.width;
+	header->target_height = size.height;
+	header->source_mtime = (long long) st.st_mtime;
+	header->source_size = (long long) st.st_size;
+	header->path_hash = wbf_cache_hash(0xcbf29ce484222325ULL, sourcePath, strlen(sourcePath));
+
+	*name = wbf_cache_hash(header->path_hash, &header->target_width, sizeof(int) * 2);
+	*name = wbf_cache_hash(*name, &header->source_mtime, sizeof(long long) * 2);
+
+	return 1;
+}
+
+/* the cache file of the key into path, 0 when there is no cache
+   directory to use */
+static int wbf_cache_path(unsigned long long name, char *path, size_t path_size)
+{
+	const char *dir = getenv(WBF_CACHE_DIR_ENV_NAME);
+	int n;
+
+	if (dir && *dir) {
+		n = snprintf(path, path_size, "%s", dir);
+	} else {
+		/* a directory of its own under the one of the scheduler */
+		dir = getenv(WBF_CACHE_CUPS_ENV_NAME);
+		if (dir == NULL || *dir == '\0') {
+			return 0;
+		}
+		n = snprintf(path, path_size, "%s/%s", dir, WBF_CACHE_CUPS_SUBDIR);
+		if (n < 0 || n >= (int) path_size) {
+			return 0;
+		}
+		if (mkdir(path, 0775) != 0 && errno != EEXIST) {
+			debuglog(("failed to make : %s -> %s", path, strerror(errno)));
+			return 0;
+		}
+	}
+	if (n < 0 || n >= (int) path_size) {
+		return 0;
+	}
+
+	n += snprintf(path + n, path_size - n, "/%016llx.wmc", name);
+
+	return (n < (int) path_size);
+}
+
+/* Maps the mask rendered from sourcePath at size when the cache has one.
+   imageSize, stride and rows are those it was rendered with. */
+void * wbfCacheOpen(const char *sourcePath, EpsSize size, EpsSize *imageSize, int *stride, int *rows)
+{
+	wbf_cache_private_data_t *data = NULL;
+	wbf_cache_header_t key;
+	const wbf_cache_header_t *header;
+	unsigned long long name;
+	char path[1024];
+	struct stat st;
+	void *map = MAP_FAILED;
+	int fd = -1;
+
+	do {
+		if (!wbf_cache_key(sourcePath, size, &key, &name)
+			|| !wbf_cache_path(name, path, sizeof(path))) {
+			break;
+		}
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			break;
+		}
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(key)) {
+			break;
+		}
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			break;
+		}
+
+		header = (const wbf_cache_header_t *) map;
+		if (memcmp(header->magic, key.magic, sizeof(key.magic)) != 0
+			|| header->header_size != key.header_size
+			|| header->target_width != key.target_width
+			|| header->target_height != key.target_height
+			|| header->source_mtime != key.source_mtime
+			|| header->source_size != key.source_size
+			|| header->path_hash != key.path_hash
+			|| header->image_width <= 0 || header->image_height <= 0
+			|| header->stride <= 0 || header->rows <= 0
+			|| st.st_size != (off_t) sizeof(key) + (off_t) header->stride * header->rows) {
+			debuglog(("watermark cache : stale %s", path));
+			break;
+		}
+
+		data = (wbf_cache_private_data_t *) eps_malloc(sizeof(wbf_cache_private_data_t));
+		if (data == NULL) {
+			break;
+		}
+		data->map = map;
+		data->map_size = st.st_size;
+		map = MAP_FAILED;
+
+		imageSize->width = header->image_width;
+		imageSize->height = header->image_height;
+		*stride = header->stride;
+		*rows = header->rows;
+
+		debuglog(("watermark cache : mapped %s", path));
+	} while (0);
+
+	if (map != MAP_FAILED) {
+		munmap(map, st.st_size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return data;
+}
+
+const unsigned char * wbfCacheBits(void *cache_handle)
+{
+	wbf_cache_private_data_t *data = (wbf_cache_private_data_t *) cache_handle;
+
+	return (const unsigned char *) data->map + sizeof(wbf_cache_header_t);
+}
+
+int wbfCacheClose(void *cache_handle)
+{
+	wbf_cache_private_data_t *data = (wbf_cache_private_data_t *) cache_handle;
+
+	if (data) {
+		munmap(data->map, data->map_size);
+		eps_free(data);
+	}
+
+	return EPS_BLEND_SOURCE_OK;
+}
+
+/* Adds the mask rendered from sourcePath at size to the cache. Another
+   filter storing the same key at once is fine, the last rename wins and
+   both files are whole. */
+int wbfCacheStore(const char *sourcePath, EpsSize size, EpsSize imageSize, const unsigned char *bits, int stride, int rows)
+{
+	wbf_cache_header_t header;
+	unsigned long long name;
+	char path[1024];
+	char temp[1024 + 32];
+	const unsigned char *p;
+	size_t left;
+	ssize_t written;
+	int error = EPS_BLEND_SOURCE_ERROR;
+	int fd = -1;
+
+	temp[0] = '\0';
+	do {
+		if (!wbf_cache_key(sourcePath, size, &header, &name)
+			|| !wbf_cache_path(name, path, sizeof(path))) {
+			break;
+		}
+		header.image_width = imageSize.width;
+		header.image_height = imageSize.height;
+		header.stride = stride;
+		header.rows = rows;
+
+		/* left over by a filter of the same pid that died */
+		snprintf(temp, sizeof(temp), "%s.%ld", path, (long) getpid());
+		unlink(temp);
+		fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			debuglog(("failed to open : %s -> %s", temp, strerror(errno)));
+			temp[0] = '\0';
+			break;
+		}
+
+		if (write(fd, &header, sizeof(header)) != (ssize_t) sizeof(header)) {
+			break;
+		}
+		p = bits;
+		left = (size_t) stride * rows;
+		while (left > 0) {
+			written = write(fd, p, left);
+			if (written <= 0) {
+				break;
+			}
+			p += written;
+			left -= written;
+		}
+		if (left > 0) {
+			break;
+		}
+
+		if (close(fd) != 0) {
+			fd = -1;
+			break;
+		}
+		fd = -1;
+
+		if (rename(temp, path) != 0) {
+			debuglog(("failed to rename : %s -> %s", temp, strerror(errno)));
+			break;
+		}
+
+		debuglog(("watermark cache : stored %s", path));
+		error = EPS_BLEND_SOURCE_OK;
+	} while (0);
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (error != EPS_BLEND_SOURCE_OK && temp[0]) {
+		unlink(temp);
+	}
+
+	return error;
+}
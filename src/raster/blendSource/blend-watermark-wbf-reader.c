@@ -83,76 +83,121 @@ static void print_wbf_info_header(BITMAPINFOHEADER* bi)
 	debuglog(("\tClrImportant  : %d", bi->ClrImportant));
 }
 
-static void wbf_setbit(char *bits, int index)
+/* rows of the bitmap start on a word */
+#define WBF_STRIDE_ALIGN	sizeof(unsigned long)
+
+/* sets count bits from index on, whole bytes at once */
+static void wbf_setbits(unsigned char *bits, int index, int count)
 {
-	unsigned char *setbit_byte = (unsigned char *)bits + (index / 8);
-	*setbit_byte |= (1 << (index % 8));
+	int end = index + count;
+	unsigned char *first = bits + (index >> 3);
+	unsigned char *last = bits + (end >> 3);
+
+	if (count <= 0) {
+		return;
+	}
+	if (first == last) {
+		*first |= (unsigned char) ((0xFF << (index & 7)) & ~(0xFF << (end & 7)));
+		return;
+	}
+	*first++ |= (unsigned char) (0xFF << (index & 7));
+	if (last > first) {
+		memset(first, 0xFF, last - first);
+	}
+	if (end & 7) {
+		*last |= (unsigned char) ~(0xFF << (end & 7));
+	}
 }
 
-static int wbf_getbit(char *bits, int index)
+/* sets every other bit of count bits from index on */
+static void wbf_setbits_alternate(unsigned char *bits, int index, int count)
 {
-	unsigned char *getbit_byte = (unsigned char *)bits + (index / 8);
-	return (*getbit_byte & (1 << (index % 8))) ? 1 : 0;
+	for (; count > 0; index += 2, count -= 2) {
+		bits[index >> 3] |= (unsigned char) (1 << (index & 7));
+	}
 }
 
-static int wbf_decompress_RLE4(FILE *stream, EpsSize size, char **decompressedPixels)
+static int wbf_getbit(const unsigned char *bits, int index)
 {
-	int error = 0;
+	return (bits[index >> 3] >> (index & 7)) & 1;
+}
+
+/* Decodes RLE4 pixels from p to end into the bitmap, a bit set for each
+   black pixel, color 0. Rows of the image are kept top down, the data
+   gives them bottom up. Pixels off the image are dropped, and data
+   ending early ends the image. Returns the row it ended at, -1 when all
+   rows were given. */
+static int wbf_decompress_RLE4(const unsigned char *p, const unsigned char *end, EpsSize size, unsigned char *bitmap, int stride)
+{
+	unsigned char *row;
 	int y;
 	int x;
-
 	int pixelCount;
-	int color;
+	int count;
 	int i;
-	int offset_x;
-	int offset_y;
 	unsigned char data;
 
 	y = size.height - 1;
 	x = 0;
-	while (y >= 0) {
-		data = fgetc(stream);
+	while (y >= 0 && p < end) {
+		row = bitmap + y * stride;
+		data = *p++;
 		if (data == 0) { /* Escape code */
-			data = fgetc(stream);
+			if (p >= end) {
+				break;
+			}
+			data = *p++;
 			if (data == 0) { /* End of Line */
 				x = 0;
 				y--;
 			} else if (data == 1) { /* End of Image */
 				break;
 			} else if (data == 2) { /* Data offset */
-				offset_x = fgetc(stream);
-				offset_y = fgetc(stream);
-				x += offset_x;
-				y -= offset_y;
-			} else { /* In-contigious pixels */
+				if (end - p < 2) {
+					break;
+				}
+				x += p[0];
+				y -= p[1];
+				p += 2;
+			} else { /* In-contigious pixels, padded to a word */
 				pixelCount = data;
-				for (i = 0; i < pixelCount; i++) {
-					if ((i & 1) == 1) {
-						color = (data & 0x0F);
-					} else {
-						data = fgetc(stream);
-						color = (data & 0xF0) >> 4;
-					}
-					if (color == 0) { /* black */
-						wbf_setbit(decompressedPixels[y], x);
+				if (end - p < (pixelCount + 1) / 2) {
+					break;
+				}
+				count = (x < size.width) ? size.width - x : 0;
+				if (count > pixelCount) {
+					count = pixelCount;
+				}
+				for (i = 0; i < count; i++) {
+					data = (i & 1) ? (p[i >> 1] & 0x0F) : (p[i >> 1] >> 4);
+					if (data == 0) { /* black */
+						row[(x + i) >> 3] |= (unsigned char) (1 << ((x + i) & 7));
 					}
-					x++;
 				}
-
+				x += pixelCount;
+				p += (pixelCount + 1) / 2;
 				if (((pixelCount & 3) == 1) || ((pixelCount & 3) == 2)) {
-					fgetc(stream); /* eatup padding byte */
+					p++; /* eatup padding byte */
 				}
 			}
-		} else { /* Contigious pixels */
+		} else { /* Contigious pixels, two colors by turns */
 			pixelCount = data;
-			data = fgetc(stream);
-			for (i = 0; i < pixelCount; i++) {
-				color = (i & 1) ? (data & 0x0F) : ((data >> 4) & 0x0F);
-				if (color == 0) { /* black */
-					wbf_setbit(decompressedPixels[y], x);
-				}
-				x++;
+			if (p >= end) {
+				break;
+			}
+			data = *p++;
+			count = (x < size.width) ? size.width - x : 0;
+			if (count > pixelCount) {
+				count = pixelCount;
+			}
+			if (data == 0x00) {
+				wbf_setbits(row, x, count);
+			} else if ((data & 0xF0) == 0) {
+				wbf_setbits_alternate(row, x, count);
+			} else if ((data & 0x0F) == 0) {
+				wbf_setbits_alternate(row, x + 1, count - 1);
 			}
+			x += pixelCount;
 		}
 	}
 
@@ -162,11 +207,15 @@ static int wbf_decompress_RLE4(FILE *stream, EpsSize size, char **decompressedPi
 typedef struct wbf_stream_private_data_s
 {
 	EpsSize imageSize;
-	char **decompressedPixels;
+	unsigned char *bitmap;
+	int stride;
 	RGBQUAD palettes [16];
 	FILE* stream;
 } wbf_stream_private_data_t;
 
+int wbfReaderClose(void *wbf_handle);
+
+/* Reads the whole of fstream and decodes it into one bitmap. */
 void * wbfReaderOpen(FILE* fstream, EpsSize *size)
 {
 	const int pixels_per_byte = 8;
@@ -174,12 +223,10 @@ void * wbfReaderOpen(FILE* fstream, EpsSize *size)
 	wbf_stream_private_data_t *data = NULL;
 	BITMAPFILEHEADER bf;
 	BITMAPINFOHEADER bi;
+	unsigned char *file = NULL;
+	long file_size;
 	int error = EPS_BLEND_SOURCE_ERROR;
-	int decompressed_lines;
-	int read_bytes;
 	int bytes_per_line;
-	int i;
-	char dummy;
 
 	do {
 		data = (wbf_stream_private_data_t *) eps_malloc(sizeof(wbf_stream_private_data_t));
@@ -189,11 +236,26 @@ void * wbfReaderOpen(FILE* fstream, EpsSize *size)
 
 		data->stream = fstream;
 
-		read_bytes = fread(&bf, 1, sizeof(bf), data->stream);
-		if (read_bytes <= 0) {
+		if (fseek(data->stream, 0, SEEK_END) != 0) {
+			break;
+		}
+		file_size = ftell(data->stream);
+		rewind(data->stream);
+		if (file_size < (long) (sizeof(bf) + sizeof(bi))) {
 			debuglog(("No more file header read."));
 			break;
 		}
+
+		file = (unsigned char *) eps_malloc(file_size);
+		if (file == NULL) {
+			break;
+		}
+		if (fread(file, 1, file_size, data->stream) != (size_t) file_size) {
+			debuglog(("failed to read %ld bytes", file_size));
+			break;
+		}
+
+		memcpy(&bf, file, sizeof(bf));
 		print_wbf_file_header(&bf);
 
 		if (bf.Type != 19778) {
@@ -201,46 +263,33 @@ void * wbfReaderOpen(FILE* fstream, EpsSize *size)
 			break;
 		}
 
-		read_bytes = fread(&bi, sizeof(bi), 1, data->stream);
-		if (read_bytes <= 0) {
-			debuglog(("No more info header read."));
+		memcpy(&bi, file + sizeof(bf), sizeof(bi));
+		print_wbf_info_header(&bi);
+
+		if (bi.Width == 0 || bi.Height == 0 || bi.Width > 0x8000 || bi.Height > 0x8000
+			|| bi.Compression != 2 /* BI_RLE4 */ || bi.BitCount != 4
+			|| bi.ClrUsed > 16
+			|| bf.OffBits < sizeof(bf) + sizeof(bi) + bi.ClrUsed * sizeof(RGBQUAD)
+			|| bf.OffBits >= file_size) {
+			debuglog(("Invalid BMP info header."));
 			break;
 		}
-		print_wbf_info_header(&bi);
-		
+
 		data->imageSize.width = bi.Width;
 		data->imageSize.height = bi.Height;
-
-		for (i = 0; i < bi.ClrUsed; i++) {
-			fread(&data->palettes[i], sizeof(RGBQUAD), 1, data->stream);
-			bf.OffBits -= sizeof(RGBQUAD);
-		}	
+		memcpy(data->palettes, file + sizeof(bf) + sizeof(bi), bi.ClrUsed * sizeof(RGBQUAD));
 
 		bytes_per_line = ((data->imageSize.width + (pixels_per_byte - 1)) / pixels_per_byte);
+		data->stride = (bytes_per_line + WBF_STRIDE_ALIGN - 1) / WBF_STRIDE_ALIGN * WBF_STRIDE_ALIGN;
 		debuglog(("Bytes per line : %d", bytes_per_line));
 
-		data->decompressedPixels = (char **) eps_malloc(sizeof(char *) * data->imageSize.height);
-		if (data->decompressedPixels == NULL) {
+		data->bitmap = (unsigned char *) eps_malloc(data->stride * data->imageSize.height);
+		if (data->bitmap == NULL) {
 			break;
 		}
+		memset(data->bitmap, 0x00, data->stride * data->imageSize.height);
 
-		for (i = 0; i < data->imageSize.height; i++) {
-			data->decompressedPixels[i] = NULL;
-		}
-
-		for (i = 0; i < data->imageSize.height; i++) {
-			data->decompressedPixels[i] = (char *) eps_malloc(bytes_per_line);
-			if (data->decompressedPixels[i] == NULL) {
-				break;
-			}
-			memset(data->decompressedPixels[i], 0x00, bytes_per_line);
-		}
-
-		if (i < data->imageSize.height) {
-			break;
-		}
-
-		wbf_decompress_RLE4(data->stream, data->imageSize, data->decompressedPixels);
+		wbf_decompress_RLE4(file + bf.OffBits, file + file_size, data->imageSize, data->bitmap, data->stride);
 
 		size->width = data->imageSize.width;
 		size->height = data->imageSize.height;
@@ -249,8 +298,12 @@ void * wbfReaderOpen(FILE* fstream, EpsSize *size)
 
 	} while (0);
 
+	if (file) {
+		eps_free(file);
+	}
+
 	if (error == EPS_BLEND_SOURCE_ERROR && data) {
-		eps_free(data);
+		wbfReaderClose(data);
 		data = NULL;
 	}
 
@@ -260,17 +313,10 @@ void * wbfReaderOpen(FILE* fstream, EpsSize *size)
 int wbfReaderClose(void *wbf_handle)
 {
 	wbf_stream_private_data_t* data = (wbf_stream_private_data_t*)wbf_handle;
-	int i;
 	if (data) {
-		if (data->decompressedPixels) {
-			for (i = 0; i < data->imageSize.height; i++) {
-				if (data->decompressedPixels[i]) {
-					eps_free(data->decompressedPixels[i]);
-					data->decompressedPixels[i] = NULL;
-				}
-			}
-			eps_free(data->decompressedPixels);
-			data->decompressedPixels = NULL;
+		if (data->bitmap) {
+			eps_free(data->bitmap);
+			data->bitmap = NULL;
 		}
 
 		eps_free(data);
@@ -284,11 +330,22 @@ int wbfReaderIsBlackPixel(void *wbf_handle, EpsPoint point)
 {
 	wbf_stream_private_data_t* data = (wbf_stream_private_data_t*)wbf_handle;
 	int answer = 0;
-	if (data && data->decompressedPixels) {
+	if (data && data->bitmap) {
 		if ((point.y < data->imageSize.height) && (point.x < data->imageSize.width)) {
-			answer = wbf_getbit(data->decompressedPixels[point.y], point.x);
+			answer = wbf_getbit(data->bitmap + point.y * data->stride, point.x);
 		}
 	}
 
 	return answer;
 }
+
+/* the bitmap, a bit for each black pixel, rows top down stride bytes
+   apart */
+const unsigned char * wbfReaderBits(void *wbf_handle, int *stride)
+{
+	wbf_stream_private_data_t* data = (wbf_stream_private_data_t*)wbf_handle;
+
+	*stride = data->stride;
+
+	return data->bitmap;
+}
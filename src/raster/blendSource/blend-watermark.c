@@ -26,16 +26,38 @@
 
 #include "blend-source.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* implementation (blend-watermark-wbf-reader.c) */
 extern void * wbfReaderOpen(FILE* fstream, EpsSize *size);
 extern int wbfReaderClose(void *wbf_handle);
 extern int wbfReaderIsBlackPixel(void *wbf_handle, EpsPoint point);
+extern const unsigned char * wbfReaderBits(void *wbf_handle, int *stride);
+extern void * wbfCacheOpen(const char *sourcePath, EpsSize size, EpsSize *imageSize, int *stride, int *rows);
+extern const unsigned char * wbfCacheBits(void *cache_handle);
+extern int wbfCacheClose(void *cache_handle);
+extern int wbfCacheStore(const char *sourcePath, EpsSize size, EpsSize imageSize, const unsigned char *bits, int stride, int rows);
 
 static int WatermarkOpen(void *privateData, const char* sourcePath, EpsSize size, EpsColor color);
-static int WatermarkBlendingPixels(void *privateData, unsigned char* pixelBuf, int bytesPixelBuf, int pixelCount);
+static int WatermarkBlendingPixels(void *privateData, int row, unsigned char* pixelBuf, int bytesPixelBuf, int pixelCount, int mirror);
+static int WatermarkCoveredRange(void *privateData, int row, int *left, int *right);
 static int WatermarkClose(void *privateData);
 static void WatermarkPrivateFinalize(void *privateData);
 
+/* pixels start to start + length of a row the image is black at */
+typedef struct WatermarkSpan {
+	int start;
+	int length;
+} WatermarkSpan;
+
+/* spans first to first + count of the span list, rows alike share them */
+typedef struct WatermarkRow {
+	int first;
+	int count;
+} WatermarkRow;
+
 typedef struct WatermarkPrivateData {
 	FILE *wbfFile;
 	void *wbfReaderHandle;
@@ -43,8 +65,14 @@ typedef struct WatermarkPrivateData {
 	EpsColor watermarkColor;
 	EpsRect fitPageBounds;
 	float scaleRatio;
-	int rasterLineIndex;
-	int blendingLineIndex;
+	unsigned short mul;		/* 1 - alpha, in 1/65536 */
+	unsigned short add[3];		/* alpha * color, in 1/256, rounded */
+	unsigned char blended[3][256];	/* each channel value blended with the color */
+	int coverageWidth;
+	int coverageRows;
+	int coverageStride;
+	WatermarkRow *rows;		/* a row for each row of the fit bounds */
+	WatermarkSpan *spans;
 } WatermarkPrivateData;
 
 int blend_watermark_initialize_instance(EpsBlendSource *instance)
@@ -54,6 +82,7 @@ int blend_watermark_initialize_instance(EpsBlendSource *instance)
 	if (privateData) {
 		instance->open = WatermarkOpen;
 		instance->blendingPixels = WatermarkBlendingPixels;
+		instance->coveredRange = WatermarkCoveredRange;
 		instance->close = WatermarkClose;
 		instance->finalize = WatermarkPrivateFinalize;
 		instance->privateData = privateData;
@@ -64,23 +93,257 @@ int blend_watermark_initialize_instance(EpsBlendSource *instance)
 	return error;
 }
 
-static int WatermarkOpen(void *privateData, const char* sourcePath, EpsSize size, EpsColor color)
+/* value v of a channel blended with the color, in 8.8 fixed point */
+#define WATERMARK_BLEND(v, mul, add) \
+	((((((unsigned int) (v) << 8) * (mul)) >> 16) + (add) > 0xFFFF) ? 0xFF : (((((unsigned int) (v) << 8) * (mul)) >> 16) + (add)) >> 8)
+
+/* the blend of every value of each channel, worked out once. registers
+   blend the same way, so both give the same pixels. */
+static void WatermarkBuildTables(WatermarkPrivateData *data)
+{
+	float color[3];
+	float alpha = data->watermarkColor.alpha;
+	int mul, v, k;
+
+	color[0] = data->watermarkColor.red;
+	color[1] = data->watermarkColor.green;
+	color[2] = data->watermarkColor.blue;
+
+	alpha = (alpha < 0.f) ? 0.f : (alpha > 1.f) ? 1.f : alpha;
+	mul = (int) ((1.0 - alpha) * 65536.0 + 0.5);
+	data->mul = (unsigned short) ((mul > 0xFFFF) ? 0xFFFF : mul);
+
+	for (k = 0; k < 3; k++) {
+		color[k] = (color[k] < 0.f) ? 0.f : (color[k] > 1.f) ? 1.f : color[k];
+		data->add[k] = (unsigned short) ((int) (alpha * color[k] * 255.0 * 256.0 + 0.5) + 128);
+		for (v = 0; v < 256; v++) {
+			data->blended[k][v] = (unsigned char) WATERMARK_BLEND(v, data->mul, data->add[k]);
+		}
+	}
+}
+
+#if defined(__SSE2__)
+/* blends bytes of p, 48 at a time for 3 channels so that only whole
+   pixels are done. add repeats the channels of the pixels over 48 bytes.
+   returns the bytes done, the rest are left to the tables. */
+static int WatermarkBlendRegisters(unsigned char *p, int bytes, int bytesPerPixel, unsigned short mul, const unsigned short *add)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi16((short) mul);
+	__m128i v, lo, hi;
+	int j, off;
+
+	bytes -= bytes % (16 * bytesPerPixel);
+	for (j = 0, off = 0; j < bytes; j += 16, off = (off + 16) % 48) {
+		v = _mm_loadu_si128((const __m128i *) (p + j));
+		lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, v), w);
+		hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, v), w);
+		lo = _mm_srli_epi16(_mm_adds_epu16(lo, _mm_loadu_si128((const __m128i *) (add + off))), 8);
+		hi = _mm_srli_epi16(_mm_adds_epu16(hi, _mm_loadu_si128((const __m128i *) (add + off + 8))), 8);
+		_mm_storeu_si128((__m128i *) (p + j), _mm_packus_epi16(lo, hi));
+	}
+
+	return j;
+}
+#endif
+
+/* Renders the image into coverage bits, at the size it is blended at:
+   row r of the fit bounds and pixel i of a row take the image pixel at r
+   and i / scaleRatio. A row taking the same image row as the one before
+   is copied. */
+static unsigned char * WatermarkRenderCoverage(WatermarkPrivateData *data, EpsSize size)
+{
+	unsigned char *coverage;
+	unsigned char *bits;
+	const unsigned char *image;
+	const unsigned char *line;
+	int *column = NULL;
+	int imageStride;
+	int last_y = -1;
+	int r, i, x, y;
+
+	data->coverageWidth = size.width;
+	data->coverageRows = data->fitPageBounds.size.height + 1;
+	data->coverageStride = (size.width + 7) / 8;
+	coverage = (unsigned char *) eps_malloc(data->coverageStride * data->coverageRows);
+	column = (int *) eps_malloc(sizeof(int) * (size.width + 1));
+	if (coverage == NULL || column == NULL) {
+		if (coverage) {
+			eps_free(coverage);
+		}
+		if (column) {
+			eps_free(column);
+		}
+		return NULL;
+	}
+
+	image = wbfReaderBits(data->wbfReaderHandle, &imageStride);
+
+	for (i = 0; i < size.width; i++) {
+		column[i] = (float) i / data->scaleRatio;
+	}
+
+	for (r = 0; r < data->coverageRows; r++) {
+		bits = coverage + r * data->coverageStride;
+		y = (float) r / data->scaleRatio;
+		if (y == last_y) {
+			memcpy(bits, bits - data->coverageStride, data->coverageStride);
+			continue;
+		}
+		last_y = y;
+		if (y >= data->wbfImageSize.height) {
+			continue;
+		}
+		line = image + y * imageStride;
+		for (i = 0; i < size.width; i++) {
+			x = column[i];
+			if (x < data->wbfImageSize.width && ((line[x >> 3] >> (x & 7)) & 1)) {
+				bits[i >> 3] |= (unsigned char) (1 << (i & 7));
+			}
+		}
+	}
+
+	eps_free(column);
+
+	return coverage;
+}
+
+/* the spans of a row of coverage bits into spans, when it is given.
+   returns the number of them. */
+static int WatermarkRowSpans(const unsigned char *bits, int width, WatermarkSpan *spans)
+{
+	int num = 0;
+	int x = 0;
+	int start;
+
+	while (x < width) {
+		if ((x & 7) == 0 && bits[x >> 3] == 0) {
+			x += 8;
+			continue;
+		}
+		if (((bits[x >> 3] >> (x & 7)) & 1) == 0) {
+			x++;
+			continue;
+		}
+
+		start = x;
+		while (x < width) {
+			if ((x & 7) == 0 && x + 8 <= width && bits[x >> 3] == 0xFF) {
+				x += 8;
+			} else if ((bits[x >> 3] >> (x & 7)) & 1) {
+				x++;
+			} else {
+				break;
+			}
+		}
+
+		if (spans) {
+			spans[num].start = start;
+			spans[num].length = x - start;
+		}
+		num++;
+	}
+
+	return num;
+}
+
+/* Lists the spans of each row of the coverage, a row the same as the one
+   before shares its spans. The bits are not needed past this. */
+static int WatermarkBuildSpans(WatermarkPrivateData *data, const unsigned char *coverage)
+{
+	const unsigned char *bits;
+	int total = 0;
+	int pass, r;
+
+	data->rows = (WatermarkRow *) eps_malloc(sizeof(WatermarkRow) * data->coverageRows);
+	if (data->rows == NULL) {
+		return EPS_BLEND_SOURCE_ERROR;
+	}
+
+	/* counted first, then listed */
+	for (pass = 0; pass < 2; pass++) {
+		total = 0;
+		for (r = 0; r < data->coverageRows; r++) {
+			bits = coverage + r * data->coverageStride;
+			if (r > 0 && memcmp(bits, bits - data->coverageStride, data->coverageStride) == 0) {
+				data->rows[r] = data->rows[r - 1];
+				continue;
+			}
+			data->rows[r].first = total;
+			data->rows[r].count = WatermarkRowSpans(bits, data->coverageWidth, (pass) ? data->spans + total : NULL);
+			total += data->rows[r].count;
+		}
+
+		if (pass == 0) {
+			data->spans = (WatermarkSpan *) eps_malloc(sizeof(WatermarkSpan) * (total + 1));
+			if (data->spans == NULL) {
+				return EPS_BLEND_SOURCE_ERROR;
+			}
+		}
+	}
+	debuglog(("watermark spans : %d over %d rows", total, data->coverageRows));
+
+	return EPS_BLEND_SOURCE_OK;
+}
+
+/* the image scaled to fit size, at its center */
+static void WatermarkFitBounds(WatermarkPrivateData *data, EpsSize size)
 {
 	float x_scale;
 	float y_scale;
 
+	x_scale = (float) size.width / (float) data->wbfImageSize.width;
+	y_scale = (float) size.height / (float) data->wbfImageSize.height;
+	data->scaleRatio = x_scale < y_scale ? x_scale : y_scale;
+	debuglog(("scale (%.2f, %.2f) -> %.2f", x_scale, y_scale, data->scaleRatio));
+
+	data->fitPageBounds.size.width = (float) data->wbfImageSize.width * data->scaleRatio;
+	data->fitPageBounds.size.height = (float) data->wbfImageSize.height * data->scaleRatio;
+	data->fitPageBounds.origin.x = (size.width - data->fitPageBounds.size.width) / 2;
+	data->fitPageBounds.origin.y = (size.height - data->fitPageBounds.size.height) / 2;
+
+	debuglog(("fit page bounds origin (%d, %d)", data->fitPageBounds.origin.x, data->fitPageBounds.origin.y));
+	debuglog(("fit page bounds size   (%d, %d)", data->fitPageBounds.size.width, data->fitPageBounds.size.height));
+}
+
+static int WatermarkOpen(void *privateData, const char* sourcePath, EpsSize size, EpsColor color)
+{
 	debuglog(("sourcePath : %s", sourcePath));
 	debuglog(("size (%d, %d)", size.width, size.height));
 	debuglog(("color (%f, %f, %f, %f)", color.red, color.green, color.blue, color.alpha));
 
 	int error = EPS_BLEND_SOURCE_ERROR;
 	WatermarkPrivateData *data = (WatermarkPrivateData *) privateData;
+	unsigned char *coverage;
+	void *cache;
+	int result;
 
 	do {
 		if (sourcePath == NULL) {
 			break;
 		}
 
+		data->watermarkColor = color;
+		WatermarkBuildTables(data);
+		data->coverageWidth = size.width;
+
+		/* a mask another filter rendered at this size is taken as it is */
+		cache = wbfCacheOpen(sourcePath, size, &data->wbfImageSize, &data->coverageStride, &data->coverageRows);
+		if (cache) {
+			WatermarkFitBounds(data, size);
+			if (data->coverageRows == data->fitPageBounds.size.height + 1
+				&& data->coverageStride == (size.width + 7) / 8) {
+				result = WatermarkBuildSpans(data, wbfCacheBits(cache));
+				wbfCacheClose(cache);
+				if (result != EPS_BLEND_SOURCE_OK) {
+					break;
+				}
+				error = EPS_BLEND_SOURCE_OK;
+				break;
+			}
+			wbfCacheClose(cache);
+		}
+
 		data->wbfFile = fopen(sourcePath, "rb");
 		if (data->wbfFile == NULL) {
 			debuglog(("failed to open : %s -> %s", sourcePath, strerror(errno)));
@@ -94,22 +357,26 @@ static int WatermarkOpen(void *privateData, const char* sourcePath, EpsSize size
 			break;
 		}
 
-		x_scale = (float) size.width / (float) data->wbfImageSize.width;
-		y_scale = (float) size.height / (float) data->wbfImageSize.height;
-		data->scaleRatio = x_scale < y_scale ? x_scale : y_scale;
-		debuglog(("scale (%.2f, %.2f) -> %.2f", x_scale, y_scale, data->scaleRatio));
+		WatermarkFitBounds(data, size);
 
-		data->fitPageBounds.size.width = (float) data->wbfImageSize.width * data->scaleRatio;
-		data->fitPageBounds.size.height = (float) data->wbfImageSize.height * data->scaleRatio;
-		data->fitPageBounds.origin.x = (size.width - data->fitPageBounds.size.width) / 2;
-		data->fitPageBounds.origin.y = (size.height - data->fitPageBounds.size.height) / 2;
+		/* the image is not read past this, the spans are kept for the job */
+		coverage = WatermarkRenderCoverage(data, size);
+		wbfReaderClose(data->wbfReaderHandle);
+		data->wbfReaderHandle = NULL;
+		fclose(data->wbfFile);
+		data->wbfFile = NULL;
+		if (coverage == NULL) {
+			debuglog(("failed to render the watermark coverage"));
+			break;
+		}
 
-		debuglog(("fit page bounds origin (%d, %d)", data->fitPageBounds.origin.x, data->fitPageBounds.origin.y));
-		debuglog(("fit page bounds size   (%d, %d)", data->fitPageBounds.size.width, data->fitPageBounds.size.height));
+		wbfCacheStore(sourcePath, size, data->wbfImageSize, coverage, data->coverageStride, data->coverageRows);
 
-		data->rasterLineIndex = 0;
-		data->blendingLineIndex = 0;
-		data->watermarkColor = color;
+		result = WatermarkBuildSpans(data, coverage);
+		eps_free(coverage);
+		if (result != EPS_BLEND_SOURCE_OK) {
+			break;
+		}
 
 		error = EPS_BLEND_SOURCE_OK;
 	} while (0);
@@ -117,52 +384,109 @@ static int WatermarkOpen(void *privateData, const char* sourcePath, EpsSize size
 	return error;
 }
 
-static int WatermarkBlendingPixels(void *privateData, unsigned char* pixelBuf, int bytesPixelBuf, int pixelCount)
+/* row is the line index within the blending bounds. the watermark is only
+   read here, so lines may be blended from several threads at once. only
+   the spans of the row are blended, through the tables. channels past the
+   third are left as they are. */
+static int WatermarkBlendingPixels(void *privateData, int row, unsigned char* pixelBuf, int bytesPixelBuf, int pixelCount, int mirror)
 {
-	float alpha;
-	float valueA;
-	float valueB;
-	float value;
-	float color[3];
-	int i;
-	int k;
-
 	WatermarkPrivateData *data = (WatermarkPrivateData *) privateData;
 	int bytesPerPixel = bytesPixelBuf / pixelCount;
-	unsigned char *pixelPtr = pixelBuf;
-	EpsPoint point = epsMakePoint(0, 0);
-	int black = 0;
-
-	if (is_current_raster_in_blending_bounds(data->rasterLineIndex++, data->fitPageBounds)) {
-		point.y = (float)data->blendingLineIndex++ / data->scaleRatio;
-		color[0] = data->watermarkColor.red;
-		color[1] = data->watermarkColor.green;
-		color[2] = data->watermarkColor.blue;
-		alpha = data->watermarkColor.alpha;
-
-		for (i = 0; i < pixelCount; i++) {
-			point.x = (float) i / data->scaleRatio;
-			black = wbfReaderIsBlackPixel(data->wbfReaderHandle, point);
-			for (k = 0; k < bytesPerPixel; k++) {
-				if (black) {
-					valueA = ((float) pixelPtr[k]) / 255.f;
-					valueB = color[k];
-					value = ((1.0 - alpha) * valueA) + (alpha * valueB);
-					pixelPtr[k] = (unsigned char) (value * 255.f);
-				}
+	int channels = (bytesPerPixel < 3) ? bytesPerPixel : 3;
+	const WatermarkRow *spanRow;
+	const WatermarkSpan *span;
+	unsigned char *pixelPtr;
+	int n, start, end, done, pos, k;
+#if defined(__SSE2__)
+	unsigned short add[48];
+	int simd = 0;
+#endif
+
+	if (!is_current_raster_in_blending_bounds(row, data->fitPageBounds)) {
+		return EPS_BLEND_SOURCE_OK;
+	}
+	spanRow = &data->rows[row - data->fitPageBounds.origin.y];
+	if (spanRow->count == 0) {
+		return EPS_BLEND_SOURCE_OK;
+	}
+
+#if defined(__SSE2__)
+	if (bytesPerPixel == 1 || bytesPerPixel == 3) {
+		simd = 1;
+		for (k = 0; k < 48; k++) {
+			add[k] = data->add[k % bytesPerPixel];
+		}
+	}
+#endif
+
+	/* the pixels of a span run the other way in a mirrored buffer */
+	for (n = 0; n < spanRow->count; n++) {
+		span = &data->spans[spanRow->first + n];
+		start = span->start;
+		end = start + span->length;
+		if (end > pixelCount) {
+			end = pixelCount;
+		}
+		if (start >= end) {
+			continue;
+		}
+		pixelPtr = pixelBuf + ((mirror) ? pixelCount - end : start) * bytesPerPixel;
+
+		done = 0;
+#if defined(__SSE2__)
+		if (simd) {
+			done = WatermarkBlendRegisters(pixelPtr, (end - start) * bytesPerPixel, bytesPerPixel, data->mul, add) / bytesPerPixel;
+		}
+#endif
+
+		for (pos = done; pos < end - start; pos++) {
+			for (k = 0; k < channels; k++) {
+				pixelPtr[pos * bytesPerPixel + k] = data->blended[k][pixelPtr[pos * bytesPerPixel + k]];
 			}
-			pixelPtr += bytesPerPixel;
 		}
 	}
 
 	return EPS_BLEND_SOURCE_OK;
 }
 
+/* pixels left to right of row the image covers, as WatermarkBlendingPixels
+   takes them */
+static int WatermarkCoveredRange(void *privateData, int row, int *left, int *right)
+{
+	WatermarkPrivateData *data = (WatermarkPrivateData *) privateData;
+	const WatermarkRow *spanRow;
+	const WatermarkSpan *last;
+
+	if (!is_current_raster_in_blending_bounds(row, data->fitPageBounds)) {
+		return 0;
+	}
+	spanRow = &data->rows[row - data->fitPageBounds.origin.y];
+	if (spanRow->count == 0) {
+		return 0;
+	}
+
+	last = &data->spans[spanRow->first + spanRow->count - 1];
+	*left = data->spans[spanRow->first].start;
+	*right = last->start + last->length;
+
+	return 1;
+}
+
 static int WatermarkClose(void *privateData)
 {
 	int error = EPS_BLEND_SOURCE_ERROR;
 	WatermarkPrivateData *data = (WatermarkPrivateData *) privateData;
 	do {
+		if (data->rows) {
+			eps_free(data->rows);
+			data->rows = NULL;
+		}
+
+		if (data->spans) {
+			eps_free(data->spans);
+			data->spans = NULL;
+		}
+
 		if (data->wbfReaderHandle) {
 			wbfReaderClose(data->wbfReaderHandle);
 			data->wbfReaderHandle = NULL;
@@ -22,119 +22,115 @@
 #include <string.h>
 #include "fetch-pool.h"
 
-typedef struct EpsFetchDataList {
-	int did_fetch;
-	int id;
-	EpsFetchData * data;
-	struct EpsFetchDataList * next;
-} EpsFetchDataList;
+/* lines of the copy slab start on this */
+#define FETCH_LINE_ALIGN	16
 
+/* the copy slab is never smaller than this many lines */
+#define FETCH_MIN_LINES		8
+
+/* one line added, or a run of identical ones */
+typedef struct EpsFetchEntry {
+	EpsFetchData data;	/* raster_p is in the copy slab for a duplicate */
+	int repeat;		/* lines of the entry not fetched yet */
+} EpsFetchEntry;
+
+/* Lines are fetched in the order they are added, so the entries are a
+   ring, and so are the copies of duplicate lines in the slab. */
 typedef struct EpsFetchDataPool {
 	int required_count;
 	int retained_count;
 	int fetched_count;
-	int serial_number;
-	EpsFetchDataList * list;
+	EpsFetchEntry * entries;
+	int entry_size;
+	int entry_head;
+	int entry_count;
+	char * slab;
+	int line_size;		/* lines in the slab */
+	int line_stride;
+	int line_head;
+	int line_count;
 } EpsFetchDataPool;
 
-static EpsFetchData *
-retain_fetch_data(const EpsFetchData * fetch_p)
+/* makes room for one more entry, the entries are moved to the front */
+static int
+fetchpool_reserve_entry(EpsFetchDataPool * pool)
 {
-	EpsFetchData *data_p = (EpsFetchData *) eps_malloc(sizeof(EpsFetchData));
-	if (data_p) {
-		if (fetch_p->duplicate) {
-			data_p->duplicate = 1;
-			data_p->raster_p = (char *) eps_malloc(fetch_p->raster_bytes);
-			if (data_p->raster_p) {
-				memcpy(data_p->raster_p, fetch_p->raster_p, fetch_p->raster_bytes);
-			} else {
-				if (data_p) {
-					eps_free(data_p);
-					data_p = NULL;
-				}
-			}
-		} else {
-			data_p->duplicate = 0;
-			data_p->raster_p = fetch_p->raster_p; /* just assigned */
-		}
+	EpsFetchEntry * entries;
+	int size, i;
 
-		data_p->raster_bytes = fetch_p->raster_bytes;
-		data_p->pixel_num = fetch_p->pixel_num;
+	if (pool->entry_count < pool->entry_size) {
+		return 0;
 	}
 
-	return data_p;
-}
-
-static void
-release_fetch_data(EpsFetchData * data_p)
-{
-	if (data_p) {
-		if (data_p->duplicate) {
-			if (data_p->raster_p) {
-				eps_free(data_p->raster_p);
-				data_p->raster_p = NULL;
-			}
-		}
-		eps_free(data_p);
-		data_p = NULL;
+	size = (pool->entry_size > 0) ? pool->entry_size * 2 : 1;
+	entries = (EpsFetchEntry *) eps_malloc(sizeof(EpsFetchEntry) * size);
+	if (entries == NULL) {
+		debuglog(("FETCHPOOL MEMALLOC ERROR %d entries", size));
+		return 1;
+	}
+	for (i = 0; i < pool->entry_count; i++) {
+		entries[i] = pool->entries[(pool->entry_head + i) % pool->entry_size];
+	}
+	if (pool->entries) {
+		eps_free(pool->entries);
 	}
+	pool->entries = entries;
+	pool->entry_size = size;
+	pool->entry_head = 0;
+
+	return 0;
 }
 
-static EpsFetchDataList * /* return valid head node of list */
-datalist_add(EpsFetchDataList *list, EpsFetchData *data, int id)
+/* makes room for the copy of one more line of bytes. the copies held are
+   moved to the front of a new slab when it has to grow. */
+static int
+fetchpool_reserve_line(EpsFetchDataPool * pool, int bytes)
 {
-	EpsFetchDataList * node = list;
-	EpsFetchDataList * head = list;
-	EpsFetchDataList * prev = list;
-
-	while (node) {
-		if (node->did_fetch == 1) {
-			node->did_fetch = 0;
-			node->id = id;
-			release_fetch_data(node->data);
-			node->data = retain_fetch_data(data);
-			break;
-		} else {
-			prev = node;
-			node = node->next;
-		}
-	}
+	EpsFetchEntry * entry;
+	char * slab;
+	int stride, size, line, i;
 
-	if (node == NULL) {
-		node = (EpsFetchDataList *) eps_malloc(sizeof(EpsFetchDataList));
-		if (node) {
-			node->did_fetch = 0;
-			node->id = id;
-			node->data = retain_fetch_data(data);
-			node->next = NULL;
-			if (prev) {
-				prev->next = node;
-			} else {
-				head = node;
-			}
-		}
+	stride = (bytes > 0) ? (bytes + FETCH_LINE_ALIGN - 1) / FETCH_LINE_ALIGN * FETCH_LINE_ALIGN : FETCH_LINE_ALIGN;
+	if (pool->line_count < pool->line_size && stride <= pool->line_stride) {
+		return 0;
 	}
 
-	return head;
-}
+	if (stride < pool->line_stride) {
+		stride = pool->line_stride;
+	}
+	size = pool->line_size;
+	if (pool->line_count >= size) {
+		size = (size > 0) ? size * 2 : FETCH_MIN_LINES;
+	}
+	if (size > pool->required_count && pool->line_count < pool->required_count) {
+		size = pool->required_count;	/* a page never holds more */
+	}
 
-static EpsFetchData *
-datalist_fetch(EpsFetchDataList *list, int id)
-{
-	EpsFetchDataList * node = list;
-	EpsFetchData * data = NULL;
+	slab = (char *) eps_malloc((size_t) stride * size);
+	if (slab == NULL) {
+		debuglog(("FETCHPOOL MEMALLOC ERROR %d lines of %d bytes", size, stride));
+		return 1;
+	}
 
-	while (node) {
-		if (node->did_fetch == 0 && node->id == id) {
-			node->did_fetch = 1;
-			data = node->data;
-			break;
+	/* the copies are in entry order */
+	line = 0;
+	for (i = 0; i < pool->entry_count; i++) {
+		entry = &pool->entries[(pool->entry_head + i) % pool->entry_size];
+		if (entry->data.duplicate) {
+			memcpy(slab + (size_t) stride * line, entry->data.raster_p, entry->data.raster_bytes);
+			entry->data.raster_p = slab + (size_t) stride * line;
+			line++;
 		}
-
-		node = node->next;
 	}
+	if (pool->slab) {
+		eps_free(pool->slab);
+	}
+	pool->slab = slab;
+	pool->line_size = size;
+	pool->line_stride = stride;
+	pool->line_head = 0;
 
-	return data;
+	return 0;
 }
 
 FETCHPOOL
@@ -145,24 +141,47 @@ fetchpool_create_instance(int data_count)
 		pool->required_count = data_count;
 		pool->retained_count = 0;
 		pool->fetched_count = 0;
-		pool->serial_number = 0;
-		pool->list = NULL;
+
+		/* a page holds at most all of its lines */
+		pool->entry_size = (data_count > 0) ? data_count : 1;
+		pool->entries = (EpsFetchEntry *) eps_malloc(sizeof(EpsFetchEntry) * pool->entry_size);
+		if (pool->entries == NULL) {
+			eps_free(pool);
+			pool = NULL;
+		}
 	}
 
 	return (FETCHPOOL) pool;
 }
 
+/* drops every retained line; the entries and the slab are kept for the
+   next page */
+void
+fetchpool_reset(FETCHPOOL instance)
+{
+	EpsFetchDataPool *pool = (EpsFetchDataPool *) instance;
+
+	if (pool) {
+		pool->entry_head = 0;
+		pool->entry_count = 0;
+		pool->line_head = 0;
+		pool->line_count = 0;
+
+		pool->retained_count = 0;
+		pool->fetched_count = 0;
+	}
+}
+
 void
 fetchpool_destroy_instance(FETCHPOOL instance)
 {
 	EpsFetchDataPool *pool = (EpsFetchDataPool *) instance;
-	EpsFetchDataList * node = NULL;
 	if (pool) {
-		while (pool->list) {
-			node = pool->list;
-			release_fetch_data(node->data);
-			pool->list = node->next;
-			eps_free(node);
+		if (pool->entries) {
+			eps_free(pool->entries);
+		}
+		if (pool->slab) {
+			eps_free(pool->slab);
 		}
 
 		eps_free(pool);
@@ -174,7 +193,9 @@ int
 fetchpool_add_data(FETCHPOOL instance, EpsFetchData *data_p)
 {
 	EpsFetchDataPool *pool = (EpsFetchDataPool *) instance;
-	EpsFetchDataList *list = NULL;
+	EpsFetchEntry *entry = NULL;
+	char *line = NULL;
+	int repeat;
 	int error = 1;
 
 	do {
@@ -182,17 +203,34 @@ fetchpool_add_data(FETCHPOOL instance, EpsFetchData *data_p)
 			break;
 		}
 
-		list = datalist_add(pool->list, data_p, pool->serial_number);
-		if (list == NULL) {
+		if (data_p == NULL || data_p->raster_p == NULL) { /* the flush */
+			error = 0;
 			break;
-		} 
+		}
 
-		if (data_p && data_p->raster_p) {
-			pool->serial_number++;	
-			pool->retained_count++;
+		if (fetchpool_reserve_entry(pool)) {
+			break;
 		}
 
-		pool->list = list;
+		if (data_p->duplicate) {
+			if (fetchpool_reserve_line(pool, data_p->raster_bytes)) {
+				break;
+			}
+			line = pool->slab + (size_t) pool->line_stride * ((pool->line_head + pool->line_count) % pool->line_size);
+			memcpy(line, data_p->raster_p, data_p->raster_bytes);
+			pool->line_count++;
+		}
+
+		repeat = (data_p->repeat > 0) ? data_p->repeat : 1;
+		entry = &pool->entries[(pool->entry_head + pool->entry_count) % pool->entry_size];
+		entry->data = *data_p;
+		entry->data.duplicate = (line != NULL);
+		entry->data.raster_p = (line) ? line : data_p->raster_p; /* just assigned */
+		entry->data.repeat = 1;
+		entry->repeat = repeat;
+		pool->entry_count++;
+
+		pool->retained_count += repeat;
 
 		error = 0;
 		
@@ -201,21 +239,28 @@ fetchpool_add_data(FETCHPOOL instance, EpsFetchData *data_p)
 	return error;
 }
 
+/* the data stays valid until the next line is added */
 EpsFetchData *
 fetchpool_fetch_data(FETCHPOOL instance)
 {
 	EpsFetchDataPool *pool = (EpsFetchDataPool *) instance;
+	EpsFetchEntry *entry = NULL;
 	EpsFetchData *data_p = NULL;
-	int id;
 
 	do {
-		if (pool == NULL) {
+		if (pool == NULL || pool->entry_count == 0) {
 			break;
 		}
 
-		data_p = datalist_fetch(pool->list, pool->fetched_count);
-		if (data_p == NULL) {
-			break;
+		entry = &pool->entries[pool->entry_head];
+		data_p = &entry->data;
+		if (--entry->repeat == 0) {
+			pool->entry_head = (pool->entry_head + 1) % pool->entry_size;
+			pool->entry_count--;
+			if (entry->data.duplicate) {
+				pool->line_head = (pool->line_head + 1) % pool->line_size;
+				pool->line_count--;
+			}
 		}
 		
 		pool->fetched_count++;
@@ -263,7 +308,7 @@ fetchpool_get_status(FETCHPOOL instance, EpsRasterFetchStatus *status)
 
 #if DEBUG_VERBOSE
 	if (pool) {
-		debuglog(("%s : required(%d), retained(%d), fetched(%d), serial(%d)", message, pool->required_count, pool->retained_count, pool->fetched_count, pool->serial_number));
+		debuglog(("%s : required(%d), retained(%d), fetched(%d), entries(%d)", message, pool->required_count, pool->retained_count, pool->fetched_count, pool->entry_count));
 	}
 #endif
 
@@ -34,6 +34,7 @@ typedef struct EpsFetchData {
 	char * raster_p;
 	int raster_bytes;
 	int pixel_num;
+	int repeat;		/* identical lines it stands for, 0 for 1 */
 } EpsFetchData;
 
 typedef void * FETCHPOOL;
@@ -42,6 +43,7 @@ FETCHPOOL fetchpool_create_instance(int data_count);
 int fetchpool_add_data(FETCHPOOL instance, EpsFetchData *data_p);
 EpsFetchData * fetchpool_fetch_data(FETCHPOOL instance);
 void fetchpool_get_status(FETCHPOOL instance, EpsRasterFetchStatus *status);
+void fetchpool_reset(FETCHPOOL instance);
 void fetchpool_destroy_instance(FETCHPOOL instance);
 
 #ifdef __cplusplus
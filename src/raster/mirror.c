@@ -24,11 +24,328 @@
 #include <string.h>
 #include "memory.h"
 #include "mirror.h"
+#include "span.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 typedef struct EpsMirror {
 	EpsMirrorOpt * init_data;
+	char * scratch;		/* used only when the input line is not writable */
+	int scratch_bytes;
+	EpsRasterExtent * extents;
+	int num_extent;
+	EpsRasterSpan * spans;
+	int span_size;
+	int raster_index;
 } EpsMirror;
 
+// Pixels are reversed in place from both ends of the line at once, whole
+// registers at a time where the compiler targets SSE2 (SSSE3, AVX2), and
+// a pixel at a time for what is left in the middle.
+#if defined(__SSE2__)
+/* the 16 bytes of v in reverse order */
+static __m128i
+mirror_bytes_16(__m128i v)
+{
+#if defined(__SSSE3__)
+	return _mm_shuffle_epi8(v, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+#else
+	v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+#endif
+}
+#endif
+
+static void
+mirror_inplace_1(char * left, char * right)
+{
+	char tmp;
+#if defined(__SSE2__)
+	__m128i x, y;
+#endif
+#if defined(__AVX2__)
+	const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+		15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i a, b;
+
+	for (; right - left >= 64; left += 32, right -= 32) {
+		a = _mm256_loadu_si256((const __m256i *) left);
+		b = _mm256_loadu_si256((const __m256i *) (right - 32));
+		a = _mm256_shuffle_epi8(a, rev);
+		b = _mm256_shuffle_epi8(b, rev);
+		_mm256_storeu_si256((__m256i *) left, _mm256_permute2x128_si256(b, b, 0x01));
+		_mm256_storeu_si256((__m256i *) (right - 32), _mm256_permute2x128_si256(a, a, 0x01));
+	}
+#endif
+#if defined(__SSE2__)
+	for (; right - left >= 32; left += 16, right -= 16) {
+		x = _mm_loadu_si128((const __m128i *) left);
+		y = _mm_loadu_si128((const __m128i *) (right - 16));
+		_mm_storeu_si128((__m128i *) left, mirror_bytes_16(y));
+		_mm_storeu_si128((__m128i *) (right - 16), mirror_bytes_16(x));
+	}
+#endif
+
+	for (right--; left < right; left++, right--) {
+		tmp = *left;
+		*left = *right;
+		*right = tmp;
+	}
+}
+
+#if defined(__SSSE3__)
+/* the 16 pixels of three registers in reverse order */
+static void
+mirror_pixels_48(__m128i * v)
+{
+	const __m128i m01 = _mm_setr_epi8(-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 14);
+	const __m128i m02 = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -128);
+	const __m128i m10 = _mm_setr_epi8(-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 15, -128);
+	const __m128i m11 = _mm_setr_epi8(15, -128, 11, 12, 13, 8, 9, 10, 5, 6, 7, 2, 3, 4, -128, 0);
+	const __m128i m12 = _mm_setr_epi8(-128, 0, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128);
+	const __m128i m20 = _mm_setr_epi8(-128, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+	const __m128i m21 = _mm_setr_epi8(1, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128);
+	__m128i a = v[0], b = v[1], c = v[2];
+
+	v[0] = _mm_or_si128(_mm_shuffle_epi8(b, m01), _mm_shuffle_epi8(c, m02));
+	v[1] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m10), _mm_shuffle_epi8(b, m11)), _mm_shuffle_epi8(c, m12));
+	v[2] = _mm_or_si128(_mm_shuffle_epi8(a, m20), _mm_shuffle_epi8(b, m21));
+}
+#endif
+
+static void
+mirror_inplace_3(char * left, char * right)
+{
+	char t0, t1, t2;
+
+#if defined(__SSSE3__)
+	__m128i x[3], y[3];
+	int k;
+
+	for (; right - left >= 96; left += 48, right -= 48) {
+		for (k = 0; k < 3; k++) {
+			x[k] = _mm_loadu_si128((const __m128i *) (left + k * 16));
+			y[k] = _mm_loadu_si128((const __m128i *) (right - 48 + k * 16));
+		}
+		mirror_pixels_48(x);
+		mirror_pixels_48(y);
+		for (k = 0; k < 3; k++) {
+			_mm_storeu_si128((__m128i *) (left + k * 16), y[k]);
+			_mm_storeu_si128((__m128i *) (right - 48 + k * 16), x[k]);
+		}
+	}
+#endif
+
+	for (right -= 3; left < right; left += 3, right -= 3) {
+		t0 = left[0];
+		t1 = left[1];
+		t2 = left[2];
+		left[0] = right[0];
+		left[1] = right[1];
+		left[2] = right[2];
+		right[0] = t0;
+		right[1] = t1;
+		right[2] = t2;
+	}
+}
+
+static void
+mirror_inplace_4(char * left, char * right)
+{
+	unsigned int a, b;
+#if defined(__SSE2__)
+	__m128i x, y;
+#endif
+#if defined(__AVX2__)
+	const __m256i rev = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i u, v;
+
+	for (; right - left >= 64; left += 32, right -= 32) {
+		u = _mm256_loadu_si256((const __m256i *) left);
+		v = _mm256_loadu_si256((const __m256i *) (right - 32));
+		_mm256_storeu_si256((__m256i *) left, _mm256_permutevar8x32_epi32(v, rev));
+		_mm256_storeu_si256((__m256i *) (right - 32), _mm256_permutevar8x32_epi32(u, rev));
+	}
+#endif
+#if defined(__SSE2__)
+	for (; right - left >= 32; left += 16, right -= 16) {
+		x = _mm_loadu_si128((const __m128i *) left);
+		y = _mm_loadu_si128((const __m128i *) (right - 16));
+		_mm_storeu_si128((__m128i *) left, _mm_shuffle_epi32(y, _MM_SHUFFLE(0, 1, 2, 3)));
+		_mm_storeu_si128((__m128i *) (right - 16), _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3)));
+	}
+#endif
+
+	for (right -= 4; left < right; left += 4, right -= 4) {
+		memcpy(&a, left, 4);
+		memcpy(&b, right, 4);
+		memcpy(left, &b, 4);
+		memcpy(right, &a, 4);
+	}
+}
+
+void
+eps_mirror_pixels_inplace(char * raster_p, int pixel_num, int bpp)
+{
+	char * left = raster_p;
+	char * right = raster_p + ((pixel_num - 1) * bpp);
+	char tmp;
+	int k;
+
+	if (pixel_num < 2) {
+		return;
+	}
+
+	switch (bpp) {
+	case 1:
+		mirror_inplace_1(raster_p, raster_p + pixel_num);
+		return;
+	case 3:
+		mirror_inplace_3(raster_p, raster_p + pixel_num * 3);
+		return;
+	case 4:
+		mirror_inplace_4(raster_p, raster_p + pixel_num * 4);
+		return;
+	default:
+		break;
+	}
+
+	while (left < right) {
+		for (k = 0; k < bpp; k++) {
+			tmp = left[k];
+			left[k] = right[k];
+			right[k] = tmp;
+		}
+		left  += bpp;
+		right -= bpp;
+	}
+}
+
+/* copied, then mirrored in place by the same kernels */
+void
+eps_mirror_pixels(char * dst, const char * src, int pixel_num, int bpp)
+{
+	memcpy(dst, src, pixel_num * bpp);
+	eps_mirror_pixels_inplace(dst, pixel_num, bpp);
+}
+
+/* mirrors a line, in place when dst == src. the white margins are left
+   out as far as they are on both sides, extent is mirrored along. */
+void
+eps_mirror_line(char * dst, const char * src, int raster_bytes, int pixel_num, int bpp, EpsRasterExtent * extent)
+{
+	int pixel_bytes = pixel_num * bpp;
+	int margin;
+
+	if (EPS_RASTER_EXTENT_BLANK(extent)) {
+		margin = pixel_num / 2;
+	} else {
+		margin = (extent->left < pixel_num - extent->right) ? extent->left : pixel_num - extent->right;
+	}
+
+	if (dst == src) {
+		if (!EPS_RASTER_EXTENT_BLANK(extent)) {
+			eps_mirror_pixels_inplace(dst + margin * bpp, pixel_num - 2 * margin, bpp);
+		}
+	} else if (EPS_RASTER_EXTENT_BLANK(extent)) {
+		memset(dst, 0xFF, pixel_bytes);
+	} else {
+		memset(dst, 0xFF, margin * bpp);
+		eps_mirror_pixels(dst + margin * bpp, src + margin * bpp, pixel_num - 2 * margin, bpp);
+		memset(dst + pixel_bytes - margin * bpp, 0xFF, margin * bpp);
+	}
+	if (raster_bytes > pixel_bytes) {
+		memset(dst + pixel_bytes, 0xFF, raster_bytes - pixel_bytes);
+	}
+
+	if (!EPS_RASTER_EXTENT_BLANK(extent)) {
+		margin = extent->left;
+		extent->left = pixel_num - extent->right;
+		extent->right = pixel_num - margin;
+	}
+}
+
+/* extents of the lines handed in, mirrored along with the lines */
+static EpsRasterExtent *
+mirror_extents(EpsMirror * lp_mirror, int lines, int pixel_num)
+{
+	int i;
+
+	if (lp_mirror->num_extent < lines) {
+		if (lp_mirror->extents) {
+			eps_free(lp_mirror->extents);
+		}
+		lp_mirror->extents = (EpsRasterExtent *) eps_malloc(sizeof(EpsRasterExtent) * lines);
+		lp_mirror->num_extent = (lp_mirror->extents) ? lines : 0;
+	}
+
+	for (i = 0; i < lp_mirror->num_extent && i < lines; i++) {
+		eps_raster_pipe_extent(lp_mirror->init_data->pipe, i, pixel_num, &lp_mirror->extents[i]);
+	}
+
+	return lp_mirror->extents;
+}
+
+/* mirrors the lines of a band in place, or into scratch when the input is
+   read-only. each line stands for repeat input lines. returns the mirrored
+   band (packed if it is the scratch) */
+static char *
+mirror_band(EpsMirror * lp_mirror, char * band, int stride, int lines, int repeat, int raster_bytes, int pixel_num, EpsRasterExtent * extents)
+{
+	EpsMirrorOpt * lp_data = lp_mirror->init_data;
+	int bpp = lp_data->bytes_per_pixel;
+	int out_stride = stride;
+	char * out = band;
+	char * p;
+	int i;
+
+	if (lp_data->pipe->input_ownership != EPS_RASTER_LINE_WRITABLE) {
+		if (lp_mirror->scratch_bytes < raster_bytes * lines) {
+			eps_free(lp_mirror->scratch);
+			lp_mirror->scratch = (char *)eps_malloc(raster_bytes * lines);
+			lp_mirror->scratch_bytes = (lp_mirror->scratch) ? raster_bytes * lines : 0;
+		}
+		out = lp_mirror->scratch;
+		out_stride = raster_bytes;
+	}
+
+	if (out) {
+		for (i = 0; i < lines; i++) {
+			if (eps_raster_run_dropped(lp_data->pipe, lp_mirror->raster_index + i * repeat, repeat)) {
+				continue;
+			}
+			p = out + i * out_stride;
+			eps_mirror_line(p, band + i * stride, raster_bytes, pixel_num, bpp, &extents[i]);
+		}
+		lp_mirror->raster_index += lines * repeat;
+	}
+
+	return out;
+}
+
+/* line kernel, mirrors in place */
+static int
+mirror_kernel(PIPEOBJ mirror, int index, char * src, char * dst, int raster_bytes, int pixel_num, EpsRasterExtent * extent)
+{
+	EpsMirror * lp_mirror = (EpsMirror *) mirror;
+	int bpp = lp_mirror->init_data->bytes_per_pixel;
+
+	if (EPS_RASTER_LINE_DROPPED(lp_mirror->init_data->pipe, index)) {
+		return 0;
+	}
+
+	eps_mirror_line(dst, dst, raster_bytes, pixel_num, bpp, extent);
+
+	return 0;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -44,6 +361,17 @@ eps_init_mirror (RASTERPIPE * mirror_p, PIPEOPT init_p)
 	p = (EpsMirror *) eps_malloc(sizeof(EpsMirror));
 	if (p && init_p) {
 		p->init_data = (EpsMirrorOpt *) init_p;
+		p->scratch = NULL;
+		p->scratch_bytes = 0;
+		p->extents = NULL;
+		p->num_extent = 0;
+		p->spans = NULL;
+		p->span_size = 0;
+		p->raster_index = 0;
+
+		/* mirrored in place, or into scratch when the input is read-only */
+		p->init_data->pipe->output_ownership = EPS_RASTER_LINE_WRITABLE;
+		p->init_data->pipe->pipe_kernel = mirror_kernel;
 
 		debuglog(("bytes per pixel : %d", p->init_data->bytes_per_pixel));
 
@@ -60,30 +388,22 @@ eps_process_mirror (RASTERPIPE mirror, char* raster_p, int raster_bytes, int pix
 {
 	EpsMirror * lp_mirror = (EpsMirror *) mirror;
 	EpsMirrorOpt * lp_data = (EpsMirrorOpt *) lp_mirror->init_data;
+	EpsRasterExtent extent;
 	int error = 0;
 	int nraster = 0;
 
 	*outraster = 0;
 	if (raster_p) {
-		int bpp = lp_data->bytes_per_pixel;
-		char * p = (char *)eps_malloc(raster_bytes);
-		if (p) {
-			memset(p, 0xFF, raster_bytes);
-			char * left = raster_p;
-			char * right = p + ((pixel_num - 1) *  bpp);
-
-			int i;
-			for (i = 0; i < pixel_num; i++) {
-				memcpy(right, left, bpp);
-				left  += bpp;
-				right -= bpp;
-			}
+		char * p;
 
+		eps_raster_pipe_extent(lp_data->pipe, 0, pixel_num, &extent);
+		p = mirror_band(lp_mirror, raster_p, raster_bytes, 1, 1, raster_bytes, pixel_num, &extent);
+		if (p) {
+			EPS_RASTER_PASS_EXTENT(lp_data->pipe, &extent);
 			error = lp_data->pipe->output(lp_data->pipe->output_h, p, raster_bytes, pixel_num, &nraster);
 			if (error == 0) {
 				*outraster = 1;
 			}
-			eps_free(p);
 		} else {
 			debuglog(("MIRROR MEMALLOC ERROR %d bytes", raster_bytes));
 			error = 1;
@@ -96,12 +416,113 @@ eps_process_mirror (RASTERPIPE mirror, char* raster_p, int raster_bytes, int pix
 	return error;
 }
 
+int
+eps_process_mirror_band (RASTERPIPE mirror, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	EpsMirror * lp_mirror = (EpsMirror *) mirror;
+	EpsMirrorOpt * lp_data = (EpsMirrorOpt *) lp_mirror->init_data;
+	int error = 0;
+	int nraster = 0;
+	EpsRasterExtent * extents;
+	char * p = NULL;
+
+	*outraster = 0;
+	extents = mirror_extents(lp_mirror, lines, pixel_num);
+	if (extents) {
+		p = mirror_band(lp_mirror, band, stride, lines, 1, raster_bytes, pixel_num, extents);
+	}
+	if (p) {
+		if (p != band) {
+			stride = raster_bytes;
+		}
+		EPS_RASTER_PASS_EXTENT(lp_data->pipe, extents);
+		error = lp_data->pipe->output_band(lp_data->pipe->output_band_h, p, stride, lines, raster_bytes, pixel_num, &nraster);
+		if (error == 0) {
+			*outraster = lines;
+		}
+	} else {
+		debuglog(("MIRROR MEMALLOC ERROR %d bytes", raster_bytes * lines));
+		error = 1;
+	}
+
+	return error;
+}
+
+/* the line is mirrored once and handed on with its repeat count */
+int
+eps_process_mirror_repeat (RASTERPIPE mirror, char * raster_p, int raster_bytes, int pixel_num, int repeat, int * outraster)
+{
+	EpsMirror * lp_mirror = (EpsMirror *) mirror;
+	EpsMirrorOpt * lp_data = (EpsMirrorOpt *) lp_mirror->init_data;
+	int error = 0;
+	int nraster = 0;
+	EpsRasterExtent extent;
+	char * p;
+
+	*outraster = 0;
+	eps_raster_pipe_extent(lp_data->pipe, 0, pixel_num, &extent);
+	p = mirror_band(lp_mirror, raster_p, raster_bytes, 1, repeat, raster_bytes, pixel_num, &extent);
+	if (p) {
+		EPS_RASTER_PASS_EXTENT(lp_data->pipe, &extent);
+		error = lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, p, raster_bytes, pixel_num, repeat, &nraster);
+		if (error == 0) {
+			*outraster = repeat;
+		}
+	} else {
+		debuglog(("MIRROR MEMALLOC ERROR %d bytes", raster_bytes));
+		error = 1;
+	}
+
+	return error;
+}
+
+/* only the order of the spans changes */
+int
+eps_process_mirror_span (RASTERPIPE mirror, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsMirror * lp_mirror = (EpsMirror *) mirror;
+	EpsMirrorOpt * lp_data = (EpsMirrorOpt *) lp_mirror->init_data;
+	EpsRasterSpanLine mirrored = *line;
+
+	*outraster = 0;
+	if (eps_span_reserve(&lp_mirror->spans, &lp_mirror->span_size, line->num_span)) {
+		debuglog(("MIRROR MEMALLOC ERROR %d spans", line->num_span));
+		return 1;
+	}
+
+	memcpy(lp_mirror->spans, line->spans, sizeof(EpsRasterSpan) * line->num_span);
+	eps_span_mirror(lp_mirror->spans, line->num_span);
+	mirrored.spans = lp_mirror->spans;
+	lp_mirror->raster_index += line->repeat;
+
+	return lp_data->pipe->output_span(lp_data->pipe->output_span_h, &mirrored, outraster);
+}
+
+int
+eps_reset_mirror (RASTERPIPE mirror)
+{
+	EpsMirror * lp_mirror = (EpsMirror *) mirror;
+
+	lp_mirror->raster_index = 0;
+
+	return 0;
+}
+
 int
 eps_free_mirror (RASTERPIPE mirror)
 {
 	EpsMirror * lp_mirror = (EpsMirror *) mirror;
 
 	if (lp_mirror) {
+		if (lp_mirror->scratch) {
+			eps_free(lp_mirror->scratch);
+		}
+		if (lp_mirror->extents) {
+			eps_free(lp_mirror->extents);
+		}
+		if (lp_mirror->spans) {
+			eps_free(lp_mirror->spans);
+		}
 		if (lp_mirror->init_data) {
 			eps_free(lp_mirror->init_data);
 		}
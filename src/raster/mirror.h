@@ -38,8 +38,17 @@ typedef struct EpsMirrorOpt {
 
 int eps_init_mirror (RASTERPIPE *, PIPEOPT);
 int eps_process_mirror (RASTERPIPE, char *, int, int, int *);
+int eps_process_mirror_band (RASTERPIPE, char *, int, int, int, int, int *);
+int eps_process_mirror_repeat (RASTERPIPE, char *, int, int, int, int *);
+int eps_process_mirror_span (RASTERPIPE, const EpsRasterSpanLine *, int *);
+int eps_reset_mirror (RASTERPIPE);
 int eps_free_mirror (RASTERPIPE);
 
+/* also used by the pipes mirror is fused into */
+void eps_mirror_pixels (char *, const char *, int, int);
+void eps_mirror_pixels_inplace (char *, int, int);
+void eps_mirror_line (char *, const char *, int, int, int, EpsRasterExtent *);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,522 @@
+/*
+   Copyright (C) Seiko Epson Corporation 2009.
+ 
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free  Software Foundation, Inc., 
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "parallel.h"
+#include "worker-pool.h"
+
+/*
+ * Input lines are gathered into bands of EPS_RASTER_BAND_LINES lines and
+ * each band is handed to the worker pool as one job. The bands form a
+ * ring used as reorder buffer: they are emitted downstream strictly in
+ * the order they were queued, whichever worker finishes first.
+ */
+typedef struct ParallelBand {
+	EpsWorkerJob job;
+	struct EpsParallel * parallel;
+	char * in;
+	int in_size;
+	int lines;
+	int bytes;
+	int pixels;
+	int index[EPS_RASTER_BAND_LINES];	/* input line number of each line of in */
+	int first_out;		/* output line number of out */
+	int repeats[EPS_RASTER_BAND_LINES];
+	EpsRasterExtent in_extent[EPS_RASTER_BAND_LINES];
+	EpsRasterExtent * out_extent;	/* one per line kept in result */
+	int out_extent_size;
+	char * out;		/* used only when stages[0] resizes */
+	int out_size;
+	char * result;		/* in or out, a repeated line is kept once */
+	int out_lines;		/* lines kept in result */
+	int out_bytes;
+	int out_pixels;
+	int error;
+} ParallelBand;
+
+typedef struct EpsParallel {
+	EpsParallelOpt * init_data;
+	WORKERPOOL pool;
+	ParallelBand * bands;
+	int num_band;
+	int submitted;
+	int delivered;
+	int in_index;
+	int out_index;
+	int expand;	/* a later stage needs each copy of a repeated line */
+} EpsParallel;
+
+static int
+parallel_reserve(char ** buf, int * size, int need)
+{
+	if (*size < need) {
+		if (*buf) {
+			eps_free(*buf);
+		}
+		*buf = (char *) eps_malloc(need);
+		*size = (*buf) ? need : 0;
+	}
+
+	return (*buf) ? 0 : 1;
+}
+
+/* worker thread */
+static void
+parallel_run_band(void * arg)
+{
+	ParallelBand * band = (ParallelBand *) arg;
+	EpsParallelOpt * lp_data = band->parallel->init_data;
+	EpsRasterPipe ** stages = lp_data->stages;
+	EpsRasterPipe * s;
+	int expand = band->parallel->expand;
+	char * dst;
+	int first = 0;
+	int error = 0;
+	int index;
+	int copies;
+	int i, j, k, n;
+
+	if (stages[0]->pipe_lines) {
+		dst = band->out;
+		for (i = 0, j = 0; i < band->lines && error == 0; i++) {
+			if (band->repeats[i] <= 0) {
+				continue;
+			}
+			s = stages[0];
+			band->out_extent[j] = band->in_extent[i];
+			error = s->pipe_kernel(s->obj, band->index[i], band->in + i * band->bytes, dst, band->bytes, band->pixels, &band->out_extent[j]);
+			dst += band->out_bytes;
+			j++;
+			for (n = 1; expand && n < band->repeats[i]; n++) {
+				memcpy(dst, dst - band->out_bytes, band->out_bytes);
+				band->out_extent[j] = band->out_extent[j - 1];
+				dst += band->out_bytes;
+				j++;
+			}
+		}
+		first = 1;
+	} else {
+		for (i = 0, j = 0; i < band->lines; i++) {
+			if (band->repeats[i] > 0) {
+				band->out_extent[j++] = band->in_extent[i];
+			}
+		}
+	}
+
+	dst = band->result;
+	j = 0;
+	index = band->first_out;
+
+	for (i = 0; i < band->lines && error == 0; i++) {
+		if (band->repeats[i] <= 0) {
+			continue;
+		}
+		copies = (expand) ? band->repeats[i] : 1;
+		for (n = 0; n < copies && error == 0; n++) {
+			for (k = first; k < lp_data->numstage && error == 0; k++) {
+				s = stages[k];
+				error = s->pipe_kernel(s->obj, index, dst, dst, band->out_bytes, band->out_pixels, &band->out_extent[j]);
+			}
+			dst += band->out_bytes;
+			j++;
+			index += band->repeats[i] / copies;
+		}
+	}
+
+	band->error = error;
+}
+
+static int
+parallel_submit(EpsParallel * lp_parallel)
+{
+	EpsRasterPipe * head = lp_parallel->init_data->stages[0];
+	ParallelBand * band = &lp_parallel->bands[lp_parallel->submitted % lp_parallel->num_band];
+
+	if (band->lines == 0) {
+		return 0;
+	}
+
+	if (head->pipe_lines) {
+		band->out_bytes = head->kernel_bytes;
+		band->out_pixels = head->kernel_pixels;
+		if (parallel_reserve(&band->out, &band->out_size, band->out_lines * band->out_bytes)) {
+			debuglog(("PARALLEL MEMALLOC ERROR %d bytes", band->out_lines * band->out_bytes));
+			return 1;
+		}
+		band->result = band->out;
+	} else {
+		band->out_bytes = band->bytes;
+		band->out_pixels = band->pixels;
+		band->result = band->in;
+	}
+
+	if (band->out_extent_size < band->out_lines) {
+		if (band->out_extent) {
+			eps_free(band->out_extent);
+		}
+		band->out_extent = (EpsRasterExtent *) eps_malloc(band->out_lines * sizeof(EpsRasterExtent));
+		if (band->out_extent == NULL) {
+			band->out_extent_size = 0;
+			debuglog(("PARALLEL MEMALLOC ERROR %d extents", band->out_lines));
+			return 1;
+		}
+		band->out_extent_size = band->out_lines;
+	}
+
+	band->error = 0;
+	band->job.func = parallel_run_band;
+	band->job.arg = band;
+	if (workerpool_submit(lp_parallel->pool, &band->job)) {
+		return 1;
+	}
+	lp_parallel->submitted++;
+
+	return 0;
+}
+
+/* runs of single lines go out as bands, a repeated line on its own */
+static int
+parallel_output(EpsRasterPipe * pipe, ParallelBand * band, int * outraster)
+{
+	char * p = band->result;
+	char * run = p;
+	int run_lines = 0;
+	int error = 0;
+	int nraster = 0;
+	int run_first = 0;
+	int i, j;
+
+	if (band->parallel->expand) {
+		EPS_RASTER_PASS_EXTENT(pipe, band->out_extent);
+		error = pipe->output_band(pipe->output_band_h, band->result, band->out_bytes, band->out_lines, band->out_bytes, band->out_pixels, &nraster);
+		*outraster += nraster;
+		return error;
+	}
+
+	for (i = 0, j = 0; i < band->lines && error == 0; i++) {
+		if (band->repeats[i] == 1) {
+			run_lines++;
+		} else if (band->repeats[i] > 1) {
+			if (run_lines > 0) {
+				EPS_RASTER_PASS_EXTENT(pipe, &band->out_extent[run_first]);
+				error = pipe->output_band(pipe->output_band_h, run, band->out_bytes, run_lines, band->out_bytes, band->out_pixels, &nraster);
+				*outraster += nraster;
+				run_lines = 0;
+			}
+			if (error == 0) {
+				EPS_RASTER_PASS_EXTENT(pipe, &band->out_extent[j]);
+				error = pipe->output_repeat(pipe->output_repeat_h, p, band->out_bytes, band->out_pixels, band->repeats[i], &nraster);
+				*outraster += nraster;
+			}
+		} else {
+			continue;
+		}
+		p += band->out_bytes;
+		j++;
+		if (run_lines == 0) {
+			run = p;
+			run_first = j;
+		}
+	}
+
+	if (error == 0 && run_lines > 0) {
+		EPS_RASTER_PASS_EXTENT(pipe, &band->out_extent[run_first]);
+		error = pipe->output_band(pipe->output_band_h, run, band->out_bytes, run_lines, band->out_bytes, band->out_pixels, &nraster);
+		*outraster += nraster;
+	}
+
+	return error;
+}
+
+/* emits finished bands in order; waits until at least min_count of them
+   went out */
+static int
+parallel_deliver(EpsParallel * lp_parallel, int min_count, int * outraster)
+{
+	EpsRasterPipe * pipe = lp_parallel->init_data->pipe;
+	ParallelBand * band;
+	int error = 0;
+
+	while (lp_parallel->delivered < lp_parallel->submitted && error == 0) {
+		band = &lp_parallel->bands[lp_parallel->delivered % lp_parallel->num_band];
+		if (min_count > 0) {
+			workerpool_wait(lp_parallel->pool, &band->job);
+			min_count--;
+		} else if (workerpool_is_done(lp_parallel->pool, &band->job) == 0) {
+			break;
+		}
+
+		error = band->error;
+		if (error == 0 && band->out_lines > 0) {
+			error = parallel_output(pipe, band, outraster);
+		}
+
+		band->lines = 0;
+		lp_parallel->delivered++;
+	}
+
+	return error;
+}
+
+static int
+parallel_queue_line(EpsParallel * lp_parallel, char * raster_p, int raster_bytes, int pixel_num, int index, int repeat, int * outraster)
+{
+	EpsRasterPipe * head = lp_parallel->init_data->stages[0];
+	ParallelBand * band;
+	int error = 0;
+	int i;
+
+	band = &lp_parallel->bands[lp_parallel->submitted % lp_parallel->num_band];
+	if (band->lines > 0 && (band->bytes != raster_bytes || band->pixels != pixel_num)) {
+		error = parallel_submit(lp_parallel);
+	}
+
+	if (error == 0 && lp_parallel->submitted - lp_parallel->delivered == lp_parallel->num_band) {
+		error = parallel_deliver(lp_parallel, 1, outraster);
+	}
+
+	if (error) {
+		return error;
+	}
+
+	band = &lp_parallel->bands[lp_parallel->submitted % lp_parallel->num_band];
+	if (band->lines == 0) {
+		band->bytes = raster_bytes;
+		band->pixels = pixel_num;
+		band->first_out = lp_parallel->out_index;
+		band->out_lines = 0;
+		if (parallel_reserve(&band->in, &band->in_size, raster_bytes * EPS_RASTER_BAND_LINES)) {
+			debuglog(("PARALLEL MEMALLOC ERROR %d bytes", raster_bytes * EPS_RASTER_BAND_LINES));
+			return 1;
+		}
+	}
+
+	memcpy(band->in + band->lines * raster_bytes, raster_p, raster_bytes);
+	eps_raster_pipe_extent(lp_parallel->init_data->pipe, index, pixel_num, &band->in_extent[band->lines]);
+	band->index[band->lines] = lp_parallel->in_index;
+	band->repeats[band->lines] = 0;
+	for (i = 0; i < repeat; i++) {
+		band->repeats[band->lines] += (head->pipe_lines) ? head->pipe_lines(head->obj) : 1;
+	}
+	if (lp_parallel->expand) {
+		band->out_lines += band->repeats[band->lines];
+	} else {
+		band->out_lines += (band->repeats[band->lines] > 0) ? 1 : 0;
+	}
+	lp_parallel->out_index += band->repeats[band->lines];
+	lp_parallel->in_index += repeat;
+	band->lines++;
+
+	if (band->lines == EPS_RASTER_BAND_LINES) {
+		error = parallel_submit(lp_parallel);
+		if (error == 0) {
+			error = parallel_deliver(lp_parallel, 0, outraster);
+		}
+	}
+
+	return error;
+}
+
+static int
+parallel_flush(EpsParallel * lp_parallel, int * outraster)
+{
+	int error = parallel_submit(lp_parallel);
+
+	if (error == 0) {
+		error = parallel_deliver(lp_parallel, lp_parallel->submitted - lp_parallel->delivered, outraster);
+	}
+
+	return error;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// * A P I for parallel (extern functions)
+//
+///////////////////////////////////////////////////////////////////////////////
+int
+eps_init_parallel (RASTERPIPE * parallel_p, PIPEOPT init_p)
+{
+	EpsParallel * p = NULL;
+	EpsParallelOpt * lp_data = (EpsParallelOpt *) init_p;
+	int eps_error = 1;
+	int i;
+
+	do {
+		if (lp_data == NULL || lp_data->numstage < 1) {
+			break;
+		}
+
+		p = (EpsParallel *) eps_malloc(sizeof(EpsParallel));
+		if (p == NULL) {
+			break;
+		}
+		p->init_data = lp_data;
+
+		/* other stages give the same line for every copy */
+		p->expand = 0;
+		for (i = 1; i < lp_data->numstage; i++) {
+			if (lp_data->stages[i]->caps & EPS_RASTER_PIPE_PER_ROW) {
+				p->expand = 1;
+			}
+		}
+
+		p->num_band = lp_data->threads * 2;
+		p->bands = (ParallelBand *) eps_malloc(sizeof(ParallelBand) * p->num_band);
+		if (p->bands == NULL) {
+			break;
+		}
+		for (i = 0; i < p->num_band; i++) {
+			p->bands[i].parallel = p;
+		}
+
+		p->pool = workerpool_create_instance(lp_data->threads);
+		if (p->pool == NULL) {
+			break;
+		}
+
+		/* bands are rebuilt for every job */
+		lp_data->pipe->output_ownership = EPS_RASTER_LINE_WRITABLE;
+
+		debuglog(("parallel : %d stages on %d threads", lp_data->numstage, lp_data->threads));
+
+		eps_error = 0;
+
+	} while (0);
+
+	if (p) {
+		*parallel_p = (PARALLEL) p;
+	}
+
+	return eps_error;
+}
+
+int
+eps_process_parallel (RASTERPIPE parallel, char * raster_p, int raster_bytes, int pixel_num, int * outraster)
+{
+	EpsParallel * lp_parallel = (EpsParallel *) parallel;
+	EpsParallelOpt * lp_data = lp_parallel->init_data;
+	int error = 0;
+	int nraster = 0;
+
+	*outraster = 0;
+	if (raster_p) {
+		error = parallel_queue_line(lp_parallel, raster_p, raster_bytes, pixel_num, 0, 1, outraster);
+	} else {
+		debuglog(("PARALLEL FLUSHING HERE ..."));
+		error = parallel_flush(lp_parallel, outraster);
+		lp_data->pipe->output(lp_data->pipe->output_h, NULL, 0, 0, &nraster);
+	}
+
+	return error;
+}
+
+int
+eps_process_parallel_band (RASTERPIPE parallel, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	EpsParallel * lp_parallel = (EpsParallel *) parallel;
+	int error = 0;
+	int i;
+
+	*outraster = 0;
+	for (i = 0; i < lines && error == 0; i++) {
+		error = parallel_queue_line(lp_parallel, band + i * stride, raster_bytes, pixel_num, i, 1, outraster);
+	}
+
+	return error;
+}
+
+/* a resizing first stage turns the run into one line, else every line of
+   it is worked on by the kernels */
+int
+eps_process_parallel_repeat (RASTERPIPE parallel, char * raster_p, int raster_bytes, int pixel_num, int repeat, int * outraster)
+{
+	EpsParallel * lp_parallel = (EpsParallel *) parallel;
+	EpsRasterPipe * head = lp_parallel->init_data->stages[0];
+	int error = 0;
+	int i;
+
+	*outraster = 0;
+	if (head->pipe_lines) {
+		error = parallel_queue_line(lp_parallel, raster_p, raster_bytes, pixel_num, 0, repeat, outraster);
+	} else {
+		for (i = 0; i < repeat && error == 0; i++) {
+			error = parallel_queue_line(lp_parallel, raster_p, raster_bytes, pixel_num, 0, 1, outraster);
+		}
+	}
+
+	return error;
+}
+
+int
+eps_reset_parallel (RASTERPIPE parallel)
+{
+	EpsParallel * lp_parallel = (EpsParallel *) parallel;
+	int i;
+
+	/* every band went out when the page was flushed */
+	for (i = 0; i < lp_parallel->num_band; i++) {
+		lp_parallel->bands[i].lines = 0;
+	}
+	lp_parallel->submitted = 0;
+	lp_parallel->delivered = 0;
+	lp_parallel->in_index = 0;
+	lp_parallel->out_index = 0;
+
+	return 0;
+}
+
+int
+eps_free_parallel (RASTERPIPE parallel)
+{
+	EpsParallel * lp_parallel = (EpsParallel *) parallel;
+	int i;
+
+	if (lp_parallel) {
+		/* joins the workers, so no band is in use any more */
+		workerpool_destroy_instance(lp_parallel->pool);
+
+		if (lp_parallel->bands) {
+			for (i = 0; i < lp_parallel->num_band; i++) {
+				if (lp_parallel->bands[i].in) {
+					eps_free(lp_parallel->bands[i].in);
+				}
+				if (lp_parallel->bands[i].out) {
+					eps_free(lp_parallel->bands[i].out);
+				}
+				if (lp_parallel->bands[i].out_extent) {
+					eps_free(lp_parallel->bands[i].out_extent);
+				}
+			}
+			eps_free(lp_parallel->bands);
+		}
+
+		if (lp_parallel->init_data) {
+			eps_free(lp_parallel->init_data);
+		}
+		eps_free(lp_parallel);
+	}
+
+	return 0;
+}
@@ -37,10 +37,10 @@
 	}                               \
 }
 
-static EpsRasterPipeline * pipeline_append_scale(EpsRasterPipeline * pipeline);
-static EpsRasterPipeline * pipeline_append_watermark(EpsRasterPipeline * pipeline);
+static EpsRasterPipeline * pipeline_append_scale(EpsRasterPipeline * pipeline, int mirror, int fit);
+static EpsRasterPipeline * pipeline_append_watermark(EpsRasterPipeline * pipeline, int mirror);
 static EpsRasterPipeline * pipeline_append_mirror(EpsRasterPipeline * pipeline);
-static EpsRasterPipeline * pipeline_append_reverse(EpsRasterPipeline * pipeline);
+static EpsRasterPipeline * pipeline_append_reverse(EpsRasterPipeline * pipeline, int mirror);
 
 static EpsRasterPipeline * 
 pipeline_append_pipe(EpsRasterPipeline * pipeline, EpsRasterPipe * pipe)
@@ -69,56 +69,125 @@ pipeline_append_pipe(EpsRasterPipeline * pipeline, EpsRasterPipe * pipe)
 	return pipeline;
 }
 
+/* the pipeline of page would have no pipe, lines are as they come */
+int
+raster_helper_passthrough (const EpsPageInfo * page)
+{
+	return (!page->scale && !page->mirror && !page->reverse && page->watermark.use != 1);
+}
+
+/* the pipes of page go after those already in pipeline, which they are
+   configured for while they are appended */
+static EpsRasterPipeline *
+pipeline_append_page(EpsRasterPipeline * pipeline, EpsPageInfo * page)
+{
+	int mirror_reverse = 0;
+	int mirror_scale = 0;
+	int mirror_watermark = 0;
+	int fit = 0;
+
+	debuglog(("bytes_per_pixel : %d", page->bytes_per_pixel));
+	debuglog(("src_print_area_x : %d", page->src_print_area_x));
+	debuglog(("src_print_area_y : %d", page->src_print_area_y));
+	debuglog(("prt_print_area_x : %d", page->prt_print_area_x));
+	debuglog(("prt_print_area_y : %d", page->prt_print_area_y));
+	debuglog(("scale : %d", page->scale));
+	debuglog(("scale_tolerance : %d", page->scale_tolerance));
+	debuglog(("mirror : %d", page->mirror));
+	debuglog(("reverse : %d", page->reverse));
+	debuglog(("reverse_memory : %d", page->reverse_memory));
+	debuglog(("watermark.use : %d", page->watermark.use));
+
+	memcpy(&pipeline->page, page, sizeof(EpsPageInfo));
+
+	// A page off the printable area by a few pixels is cropped or
+	// padded to it rather than scaled.
+	if (page->scale && abs(page->src_print_area_x - page->prt_print_area_x) <= page->scale_tolerance
+			&& abs(page->src_print_area_y - page->prt_print_area_y) <= page->scale_tolerance) {
+		fit = 1;
+	}
+
+	// Mirror is fused into a pipe which writes every pixel anyway:
+	// the reverse store, the scaler when no watermark is blended
+	// after it, or the watermark blend.
+	if (page->mirror) {
+		if (page->reverse) {
+			mirror_reverse = 1;
+		} else if (page->scale && !fit && page->watermark.use != 1) {
+			mirror_scale = 1;
+		} else if (page->watermark.use == 1) {
+			mirror_watermark = 1;
+		}
+	}
+	
+	// Scale
+	if (page->scale) {
+		debuglog(("Pipeline Scale on%s%s", (fit) ? " (fit)" : "", (mirror_scale) ? " (mirror)" : ""));
+		pipeline = pipeline_append_scale(pipeline, mirror_scale, fit);
+	}
+
+	// Watermark
+	if (page->watermark.use == 1) {
+		debuglog(("Pipeline Watermark on%s", (mirror_watermark) ? " (mirror)" : ""));
+		pipeline = pipeline_append_watermark(pipeline, mirror_watermark);
+	}
+	
+	// Mirror 
+	if (page->mirror && !(mirror_reverse || mirror_scale || mirror_watermark)) {
+		debuglog(("Pipeline Mirror on"));
+		pipeline = pipeline_append_mirror(pipeline);
+	}
+
+	// Reverse
+	if (page->reverse) {
+		debuglog(("Pipeline Reverse on%s", (mirror_reverse) ? " (mirror)" : ""));
+		pipeline = pipeline_append_reverse(pipeline, mirror_reverse);
+	}
+
+	return pipeline;
+}
 
 EpsRasterPipeline *
 raster_helper_create_pipeline (EpsPageInfo * page, EpsRasterProcessMode process_mode)
+{
+	return raster_helper_create_chain(NULL, page, process_mode);
+}
+
+/*
+ * One pipeline running the pipes of prepare on the source page and then
+ * those of page on the result. prepare keeps the page size (src equals
+ * prt), page starts from it. prepare may be NULL.
+ */
+EpsRasterPipeline *
+raster_helper_create_chain (EpsPageInfo * prepare, EpsPageInfo * page, EpsRasterProcessMode process_mode)
 {
 	EpsRasterPipeline * pipeline = NULL;
 
+	if (prepare && (prepare->src_print_area_x != prepare->prt_print_area_x
+			|| prepare->src_print_area_y != prepare->prt_print_area_y
+			|| prepare->prt_print_area_x != page->src_print_area_x
+			|| prepare->prt_print_area_y != page->src_print_area_y
+			|| prepare->bytes_per_pixel != page->bytes_per_pixel)) {
+		return NULL;
+	}
+
 	pipeline = (EpsRasterPipeline *)eps_malloc(sizeof(EpsRasterPipeline));
 	if (pipeline) {
 		debuglog(("Pipeline Processing Mode : %s", (process_mode == EPS_RASTER_PROCESS_MODE_PRINTING) ? "PRINTING" : "FETCHING"));
-		debuglog(("bytes_per_pixel : %d", page->bytes_per_pixel));
-		debuglog(("src_print_area_x : %d", page->src_print_area_x));
-		debuglog(("src_print_area_y : %d", page->src_print_area_y));
-		debuglog(("prt_print_area_x : %d", page->prt_print_area_x));
-		debuglog(("prt_print_area_y : %d", page->prt_print_area_y));
-		debuglog(("scale : %d", page->scale));
-		debuglog(("mirror : %d", page->mirror));
-		debuglog(("reverse : %d", page->reverse));
-		debuglog(("watermark.use : %d", page->watermark.use));
-
-		memcpy(&pipeline->page, page, sizeof(EpsPageInfo));
 
 		pipeline->process_mode = process_mode;
-		pipeline->mode.duplecate = 1;
+		pipeline->mode.duplecate = 1; /* resolved by eps_raster_init */
 		pipeline->pipeline = NULL;
 		pipeline->numpipe = 0;
-		
-		// Scale
-		if (page->scale) {
-			debuglog(("Pipeline Scale on"));
-			pipeline = pipeline_append_scale(pipeline);
-		}
-
-		// Watermark
-		if (page->watermark.use == 1) {
-			debuglog(("Pipeline Watermark on"));
-			pipeline = pipeline_append_watermark(pipeline);
-		}
-		
-		// Mirror 
-		if (page->mirror) {
-			debuglog(("Pipeline Mirror on"));
-			pipeline = pipeline_append_mirror(pipeline);
-		}
+		pipeline->drop = NULL;
+		pipeline->num_prepare = 0;
 
-		// Reverse
-		if (page->reverse) {
-			debuglog(("Pipeline Reverse on"));
-			pipeline = pipeline_append_reverse(pipeline);
-			pipeline->mode.duplecate = 0;
+		if (prepare) {
+			debuglog(("Pipeline Prepare"));
+			pipeline = pipeline_append_page(pipeline, prepare);
+			pipeline->num_prepare = pipeline->numpipe;
 		}
+		pipeline = pipeline_append_page(pipeline, page);
 	}
 
 	return pipeline;
@@ -131,10 +200,269 @@ raster_helper_destroy_pipeline (EpsRasterPipeline * pipeline)
 		if (pipeline->pipeline) {
 			eps_free(pipeline->pipeline);
 		}
+		if (pipeline->drop) {
+			eps_free(pipeline->drop);
+		}
 		eps_free(pipeline);
 	}
 }
 
+static int
+page_info_equal(const EpsPageInfo * a, const EpsPageInfo * b)
+{
+	if (a->bytes_per_pixel != b->bytes_per_pixel
+		|| a->src_print_area_x != b->src_print_area_x
+		|| a->src_print_area_y != b->src_print_area_y
+		|| a->prt_print_area_x != b->prt_print_area_x
+		|| a->prt_print_area_y != b->prt_print_area_y
+		|| a->scale != b->scale
+		|| a->scale_filter != b->scale_filter
+		|| a->scale_tolerance != b->scale_tolerance
+		|| a->mirror != b->mirror
+		|| a->reverse != b->reverse
+		|| a->reverse_memory != b->reverse_memory
+		|| a->watermark.use != b->watermark.use) {
+		return 0;
+	}
+
+	if (a->watermark.use == 1) {
+		if (a->watermark.size_ratio != b->watermark.size_ratio
+			|| a->watermark.position != b->watermark.position
+			|| a->watermark.density != b->watermark.density
+			|| a->watermark.color != b->watermark.color) {
+			return 0;
+		}
+		if (a->watermark.filepath == NULL || b->watermark.filepath == NULL
+			|| strcmp(a->watermark.filepath, b->watermark.filepath) != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+RASTER
+raster_helper_cache_get (EpsRasterCache * cache, EpsPageInfo * page, EpsRasterProcessMode process_mode, EpsRasterOpt * opt)
+{
+	return raster_helper_cache_get_chain(cache, NULL, page, process_mode, opt);
+}
+
+static int
+cache_copy_page(EpsPageInfo * dst, char ** path, const EpsPageInfo * src)
+{
+	memcpy(dst, src, sizeof(EpsPageInfo));
+	if (src->watermark.filepath) {
+		*path = (char *) eps_malloc(strlen(src->watermark.filepath) + 1);
+		if (*path == NULL) {
+			return 1;
+		}
+		strcpy(*path, src->watermark.filepath);
+	}
+	dst->watermark.filepath = *path;
+	return 0;
+}
+
+RASTER
+raster_helper_cache_get_chain (EpsRasterCache * cache, EpsPageInfo * prepare, EpsPageInfo * page, EpsRasterProcessMode process_mode, EpsRasterOpt * opt)
+{
+	RASTER raster_h = NULL;
+	int error = 1;
+
+	if (cache->raster_h && cache->process_mode == process_mode && cache->threads == opt->threads
+		&& page_info_equal(&cache->page, page) && cache->chained == (prepare != NULL)
+		&& (prepare == NULL || page_info_equal(&cache->prepare, prepare))) {
+		if (eps_raster_reset(cache->raster_h) == 0) {
+			debuglog(("raster cache : reused"));
+			return cache->raster_h;
+		}
+	}
+
+	raster_helper_cache_clear(cache);
+
+	do {
+		cache->pipeline = raster_helper_create_chain(prepare, page, process_mode);
+		if (cache->pipeline == NULL) {
+			break;
+		}
+
+		if (eps_raster_init(&raster_h, opt, cache->pipeline)) {
+			break;
+		}
+		cache->raster_h = raster_h;
+
+		cache->process_mode = process_mode;
+		cache->threads = opt->threads;
+		if (cache_copy_page(&cache->page, &cache->watermark_path, page)) {
+			break;
+		}
+		cache->chained = (prepare != NULL);
+		if (prepare && cache_copy_page(&cache->prepare, &cache->prepare_watermark_path, prepare)) {
+			break;
+		}
+
+		debuglog(("raster cache : built"));
+
+		error = 0;
+
+	} while (0);
+
+	if (error) {
+		raster_helper_cache_clear(cache);
+	}
+
+	return cache->raster_h;
+}
+
+void
+raster_helper_cache_clear (EpsRasterCache * cache)
+{
+	if (cache->raster_h) {
+		eps_raster_free(cache->raster_h);
+		cache->raster_h = NULL;
+	}
+
+	if (cache->pipeline) {
+		raster_helper_destroy_pipeline(cache->pipeline);
+		cache->pipeline = NULL;
+	}
+
+	if (cache->watermark_path) {
+		eps_free(cache->watermark_path);
+		cache->watermark_path = NULL;
+	}
+
+	if (cache->prepare_watermark_path) {
+		eps_free(cache->prepare_watermark_path);
+		cache->prepare_watermark_path = NULL;
+	}
+	cache->chained = 0;
+}
+
+/*
+ * Lines the printing pipeline's scaler throws away are marked in
+ * fetching->drop, and the fetching pipes up to and including the
+ * full-page pipe leave them untouched. Both pipelines must be
+ * initialized (eps_raster_init) and the fetched page must be fed
+ * to the printing pipeline as it is. Returns the number of lines
+ * dropped per page.
+ */
+int
+raster_helper_plan (EpsRasterPipeline * fetching, EpsRasterPipeline * printing)
+{
+	EpsRasterPipe * resize = NULL;
+	EpsRasterPipe * pipe;
+	int full_page = -1;
+	int lines, dropped;
+	int i;
+	char c;
+
+	for (i = 0; i < fetching->numpipe; i++) {
+		fetching->pipeline[i]->drop = NULL;
+		fetching->pipeline[i]->num_drop = 0;
+	}
+
+	for (i = 0; i < printing->numpipe; i++) {
+		pipe = printing->pipeline[i];
+		if (pipe->caps & EPS_RASTER_PIPE_RESIZES) {
+			resize = pipe;
+			break;
+		}
+		if ((pipe->caps & EPS_RASTER_PIPE_LINE_LOCAL) == 0) {
+			break;
+		}
+	}
+	if (resize == NULL || resize->pipe_drops == NULL) {
+		return 0;
+	}
+
+	lines = fetching->page.prt_print_area_y;
+	if (lines <= 0 || printing->page.src_print_area_y != lines) {
+		return 0;
+	}
+
+	for (i = 0; i < fetching->numpipe; i++) {
+		pipe = fetching->pipeline[i];
+		if (pipe->caps & EPS_RASTER_PIPE_RESIZES) {
+			return 0;
+		}
+		if (pipe->caps & EPS_RASTER_PIPE_FULL_PAGE) {
+			if (full_page >= 0) {
+				return 0;
+			}
+			full_page = i;
+		}
+	}
+
+	if (fetching->drop == NULL) {
+		fetching->drop = (char *) eps_malloc(lines);
+		if (fetching->drop == NULL) {
+			return 0;
+		}
+	}
+	if (resize->pipe_drops(resize->obj, fetching->drop, lines)) {
+		return 0;
+	}
+
+	/* the printing side sees the page bottom up after the full-page pipe */
+	if (full_page >= 0) {
+		for (i = 0; i < lines / 2; i++) {
+			c = fetching->drop[i];
+			fetching->drop[i] = fetching->drop[lines - 1 - i];
+			fetching->drop[lines - 1 - i] = c;
+		}
+	}
+
+	dropped = 0;
+	for (i = 0; i < lines; i++) {
+		if (fetching->drop[i]) {
+			dropped++;
+		}
+	}
+	if (dropped == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < fetching->numpipe; i++) {
+		fetching->pipeline[i]->drop = fetching->drop;
+		fetching->pipeline[i]->num_drop = lines;
+		if (i == full_page) {
+			break;
+		}
+	}
+	debuglog(("raster plan : %d of %d lines dropped before %d pipes", dropped, lines, (full_page >= 0) ? full_page + 1 : fetching->numpipe));
+
+	return dropped;
+}
+
+/*
+ * raster_helper_plan within a pipeline from raster_helper_create_chain:
+ * the prepare pipes skip the lines the scaler after them drops.
+ */
+int
+raster_helper_plan_chain (EpsRasterPipeline * pipeline)
+{
+	EpsRasterPipeline fetching;
+	EpsRasterPipeline printing;
+	int dropped;
+
+	if (pipeline->num_prepare <= 0) {
+		return 0;
+	}
+
+	memcpy(&fetching, pipeline, sizeof(EpsRasterPipeline));
+	fetching.numpipe = pipeline->num_prepare;
+	fetching.page.prt_print_area_y = pipeline->page.src_print_area_y;
+
+	memcpy(&printing, pipeline, sizeof(EpsRasterPipeline));
+	printing.pipeline = pipeline->pipeline + pipeline->num_prepare;
+	printing.numpipe = pipeline->numpipe - pipeline->num_prepare;
+
+	dropped = raster_helper_plan(&fetching, &printing);
+	pipeline->drop = fetching.drop;
+
+	return dropped;
+}
+
 /* Static function to create each pipe */
 #define PIPE_INIT(pipe, init_p, func) {		 		\
 	pipe->self = pipe;					\
@@ -142,13 +470,36 @@ raster_helper_destroy_pipeline (EpsRasterPipeline * pipeline)
 	pipe->obj = NULL;					\
 	pipe->output = NULL;					\
 	pipe->output_h = NULL;					\
+	pipe->input_ownership = EPS_RASTER_LINE_BORROWED;	\
+	pipe->output_ownership = EPS_RASTER_LINE_BORROWED;	\
+	pipe->shared = NULL;					\
+	pipe->output_band = NULL;				\
+	pipe->output_band_h = NULL;				\
+	pipe->output_repeat = NULL;				\
+	pipe->output_repeat_h = NULL;				\
+	pipe->output_span = NULL;				\
+	pipe->output_span_h = NULL;				\
 	pipe->pipe_init = eps_init_ ## func;			\
 	pipe->pipe_process = eps_process_ ## func;		\
+	pipe->pipe_process_band = eps_process_ ## func ## _band;	\
+	pipe->pipe_process_repeat = NULL;			\
+	pipe->pipe_process_span = NULL;				\
 	pipe->pipe_free = eps_free_ ## func;			\
+	pipe->pipe_reset = eps_reset_ ## func;			\
+	pipe->pipe_kernel = NULL;				\
+	pipe->pipe_lines = NULL;				\
+	pipe->kernel_bytes = 0;					\
+	pipe->kernel_pixels = 0;				\
+	pipe->caps = 0;						\
+	pipe->pipe_drops = NULL;				\
+	pipe->drop = NULL;					\
+	pipe->num_drop = 0;					\
+	pipe->next = NULL;					\
+	pipe->extent = NULL;					\
 }
 
 static EpsRasterPipeline * 
-pipeline_append_scale(EpsRasterPipeline * pipeline)
+pipeline_append_scale(EpsRasterPipeline * pipeline, int mirror, int fit)
 {
 	EpsRasterPipe * pipe = (EpsRasterPipe *) eps_malloc(sizeof(EpsRasterPipe));
 	if (pipe) {
@@ -160,8 +511,14 @@ pipeline_append_scale(EpsRasterPipeline * pipeline)
 			init_p->src_print_area_y = pipeline->page.src_print_area_y;
 			init_p->prt_print_area_x = pipeline->page.prt_print_area_x;
 			init_p->prt_print_area_y = pipeline->page.prt_print_area_y;
+			init_p->mirror = mirror;
+			init_p->filter = pipeline->page.scale_filter;
+			init_p->fit = fit;
 			init_p->pipe = pipe;
 			PIPE_INIT(pipe, init_p, scale);
+			pipe->pipe_process_repeat = eps_process_scale_repeat;
+			pipe->pipe_process_span = eps_process_scale_span;
+			pipe->caps = EPS_RASTER_PIPE_LINE_LOCAL | EPS_RASTER_PIPE_RESIZES;
 		} else {
 			eps_free(pipe);
 			pipe = NULL;
@@ -172,7 +529,7 @@ pipeline_append_scale(EpsRasterPipeline * pipeline)
 }
 
 static EpsRasterPipeline * 
-pipeline_append_watermark(EpsRasterPipeline * pipeline)
+pipeline_append_watermark(EpsRasterPipeline * pipeline, int mirror)
 {
 	const float watermarkDensitys [] = {
 		0.95, /* Level 1 Light */
@@ -271,8 +628,12 @@ pipeline_append_watermark(EpsRasterPipeline * pipeline)
 
 			init_p->frame = frame;
 			init_p->bounds = bounds;
+			init_p->mirror = mirror;
 			init_p->pipe = pipe;
 			PIPE_INIT(pipe, init_p, blend);
+			pipe->pipe_process_repeat = eps_process_blend_repeat;
+			pipe->pipe_process_span = eps_process_blend_span;
+			pipe->caps = EPS_RASTER_PIPE_LINE_LOCAL | EPS_RASTER_PIPE_IN_PLACE | EPS_RASTER_PIPE_PER_ROW;
 
 			debuglog(("source_path : %s", init_p->source_path));
 			debuglog(("source_type : %d", init_p->source_type));
@@ -298,6 +659,9 @@ pipeline_append_mirror(EpsRasterPipeline * pipeline)
 			init_p->bytes_per_pixel = pipeline->page.bytes_per_pixel;
 			init_p->pipe = pipe;
 			PIPE_INIT(pipe, init_p, mirror);
+			pipe->pipe_process_repeat = eps_process_mirror_repeat;
+			pipe->pipe_process_span = eps_process_mirror_span;
+			pipe->caps = EPS_RASTER_PIPE_LINE_LOCAL | EPS_RASTER_PIPE_IN_PLACE;
 		} else {
 			eps_free(pipe);
 			pipe = NULL;
@@ -307,7 +671,7 @@ pipeline_append_mirror(EpsRasterPipeline * pipeline)
 }
 
 static EpsRasterPipeline * 
-pipeline_append_reverse(EpsRasterPipeline * pipeline)
+pipeline_append_reverse(EpsRasterPipeline * pipeline, int mirror)
 {
 	EpsRasterPipe * pipe= (EpsRasterPipe *) eps_malloc(sizeof(EpsRasterPipe));
 	if (pipe) {
@@ -317,8 +681,16 @@ pipeline_append_reverse(EpsRasterPipeline * pipeline)
 			init_p->bytes_per_raster = pipeline->page.prt_print_area_x * pipeline->page.bytes_per_pixel;
 			init_p->top_margin = pipeline->page.src_print_area_y - pipeline->page.prt_print_area_y;
 			init_p->num_raster = pipeline->page.prt_print_area_y;
+			init_p->mirror = mirror;
+			init_p->memory_budget = (size_t) pipeline->page.reverse_memory << 20;
+			/* lines going to the printer are used once, so they are coded.
+			   fetched lines are held by the pool as they are stored. */
+			init_p->compress = (pipeline->process_mode == EPS_RASTER_PROCESS_MODE_PRINTING);
 			init_p->pipe = pipe;
 			PIPE_INIT(pipe, init_p, reverse);
+			pipe->pipe_process_repeat = eps_process_reverse_repeat;
+			pipe->pipe_process_span = eps_process_reverse_span;
+			pipe->caps = EPS_RASTER_PIPE_FULL_PAGE;
 
 			debuglog(("top_margin (%d)", init_p->top_margin));
 			debuglog(("num_raster (%d)", init_p->num_raster));
@@ -330,4 +702,3 @@ pipeline_append_reverse(EpsRasterPipeline * pipeline)
 	}
 	return pipeline_append_pipe(pipeline, pipe);
 }
-
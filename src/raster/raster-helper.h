@@ -29,9 +29,37 @@ extern "C"
 {
 #endif /* __cplusplus */
 
+int raster_helper_passthrough (const EpsPageInfo *);
 EpsRasterPipeline * raster_helper_create_pipeline (EpsPageInfo *, EpsRasterProcessMode);
+EpsRasterPipeline * raster_helper_create_chain (EpsPageInfo *, EpsPageInfo *, EpsRasterProcessMode);
 void raster_helper_destroy_pipeline (EpsRasterPipeline *);
 
+/*
+ * Job-scoped raster: pages with the same EpsPageInfo reuse the pipeline
+ * built for the first of them after a cheap eps_raster_reset, anything
+ * else rebuilds it. Zero-fill the cache before the first use and clear
+ * it at the end of the job.
+ */
+typedef struct EpsRasterCache {
+	EpsRasterProcessMode process_mode;
+	EpsPageInfo page;
+	char * watermark_path;	/* own copy, page.watermark.filepath */
+	int chained;		/* built by raster_helper_cache_get_chain with prepare */
+	EpsPageInfo prepare;
+	char * prepare_watermark_path;
+	int threads;
+	EpsRasterPipeline * pipeline;
+	RASTER raster_h;
+} EpsRasterCache;
+
+RASTER raster_helper_cache_get (EpsRasterCache *, EpsPageInfo *, EpsRasterProcessMode, EpsRasterOpt *);
+RASTER raster_helper_cache_get_chain (EpsRasterCache *, EpsPageInfo *, EpsPageInfo *, EpsRasterProcessMode, EpsRasterOpt *);
+void raster_helper_cache_clear (EpsRasterCache *);
+
+/* marks the lines the printing pipeline drops so the fetching one skips them */
+int raster_helper_plan (EpsRasterPipeline *, EpsRasterPipeline *);
+int raster_helper_plan_chain (EpsRasterPipeline *);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -24,19 +24,125 @@
 #include <string.h>
 #include "raster.h"
 #include "fetch-pool.h"
+#include "parallel.h"
+#include "span.h"
 
 typedef struct EpsRaster {
 	HANDLE drv_handle;
 	RASTEROUT_FUNC output;
 	PIPEOUT_FUNC pipeout;
+	PIPEOUT_BAND_FUNC pipeout_band;
 	EpsRasterPipeline * pipeline;
 	char * input_raster;
 	int input_raster_index;
+	int input_raster_dirty;
 	char * output_raster;
 	int output_raster_index;
+	int output_raster_dirty;
 	FETCHPOOL fetchpool;
+	EpsRasterBuffer * shared;
+	EpsRasterPipe * parallel;	/* runs the leading line kernels, or NULL */
+	EpsRasterExtent * extents;	/* of the band given to eps_raster_print_band */
+	int num_extent;
+	char * held;		/* last input line, not sent down the pipeline yet */
+	int held_repeat;	/* times it was seen in a row, 0 if none */
+	EpsRasterExtent held_extent;
+	EpsRasterSpan * spans;	/* of the line sent, NULL unless the first pipe takes spans */
+	int max_span;
+	char * span_raster;	/* span line given to the fetch pool */
+	int span_raster_bytes;
+	EpsRasterStats stats;
 } EpsRaster;
 
+/* the line is scanned a word at a time from both ends */
+void
+eps_raster_line_extent (const char * line, int pixels, int bpp, EpsRasterExtent * extent)
+{
+	const unsigned char * p = (const unsigned char *) line;
+	int bytes = pixels * bpp;
+	int left = 0;
+	int right = bytes;
+	unsigned long w;
+
+	while (left + (int) sizeof(w) <= bytes) {
+		memcpy(&w, p + left, sizeof(w));
+		if (w != ~0UL) {
+			break;
+		}
+		left += sizeof(w);
+	}
+	while (left < bytes && p[left] == 0xFF) {
+		left++;
+	}
+
+	if (left == bytes) { /* blank */
+		extent->left = 0;
+		extent->right = 0;
+		return;
+	}
+
+	while (right - (int) sizeof(w) >= left) {
+		memcpy(&w, p + right - sizeof(w), sizeof(w));
+		if (w != ~0UL) {
+			break;
+		}
+		right -= sizeof(w);
+	}
+	while (right > left && p[right - 1] == 0xFF) {
+		right--;
+	}
+
+	extent->left = left / bpp;
+	extent->right = (right + bpp - 1) / bpp;
+}
+
+/* extent of line index of those handed to the pipe, the whole line when
+   the sender did not tell */
+void
+eps_raster_pipe_extent (const EpsRasterPipe * pipe, int index, int pixels, EpsRasterExtent * extent)
+{
+	extent->left = 0;
+	extent->right = pixels;
+
+	if (pipe->extent) {
+		*extent = pipe->extent[index];
+		if (extent->left < 0) {
+			extent->left = 0;
+		}
+		if (extent->right > pixels) {
+			extent->right = pixels;
+		}
+	}
+}
+
+int
+eps_raster_run_dropped (const EpsRasterPipe * pipe, int index, int repeat)
+{
+	int i;
+
+	for (i = 0; i < repeat; i++) {
+		if (!EPS_RASTER_LINE_DROPPED(pipe, index + i)) {
+			return 0;
+		}
+	}
+
+	return (repeat > 0) ? 1 : 0;
+}
+
+/* Pads a short line into a buffer whose bytes past *dirty are kept 0xFF,
+   so only the stale part of the previous line has to be cleared. */
+static char *
+pad_raster(char * buf, int * dirty, const char * raster_p, int raster_bytes)
+{
+	memcpy(buf, raster_p, raster_bytes);
+	if (*dirty > raster_bytes) {
+		memset(buf + raster_bytes, 0xFF, *dirty - raster_bytes);
+	}
+	*dirty = raster_bytes;
+
+	return buf;
+}
+
 static int
 output_to_printer(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, int pixel_num, int * outraster)
 {
@@ -57,9 +163,7 @@ output_to_printer(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, int
 			if (raster_bytes >= r_bytes) { 
 				r_ptr = raster_p;
 			} else {
-				memset(raster->output_raster, 0xFF, r_bytes);
-				memcpy(raster->output_raster, raster_p, raster_bytes);
-				r_ptr = raster->output_raster;
+				r_ptr = pad_raster(raster->output_raster, &raster->output_raster_dirty, raster_p, raster_bytes);
 			}
 
 #ifdef DEBUG_VERBOSE
@@ -78,8 +182,9 @@ output_to_printer(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, int
 	return error;
 }
 
+/* a run of identical lines is added once, and fetched repeat times */
 static int
-output_to_fetchpool(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, int pixel_num, int * outraster)
+output_to_fetchpool_repeat(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, int pixel_num, int repeat, int * outraster)
 {
 	EpsRaster * raster = (EpsRaster *) handle;
 	EpsFetchData data = { 0 } ;
@@ -97,17 +202,23 @@ output_to_fetchpool(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, in
 			break;
 		}
 
+		if (repeat <= 0) {
+			error = 0;
+			break;
+		}
+
 		data.duplicate = raster->pipeline->mode.duplecate;
 		data.raster_p = raster_p;
 		data.raster_bytes = raster_bytes;
 		data.pixel_num = pixel_num;
+		data.repeat = repeat;
 
 		error = fetchpool_add_data(pool, &data);
 		if (error) {
 			break;
 		}
 
-		*outraster = 1;
+		*outraster = repeat;
 
 		error = 0;
 
@@ -117,21 +228,389 @@ output_to_fetchpool(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, in
 }
 
 static int
-pipeline_init_all(EpsRasterPipeline * pipeline, PIPEOUT_FUNC output, PIPEOUT_HANDLE output_h)
+output_to_fetchpool(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, int pixel_num, int * outraster)
+{
+	return output_to_fetchpool_repeat(handle, raster_p, raster_bytes, pixel_num, 1, outraster);
+}
+
+static int
+output_to_printer_band(PIPEOUT_HANDLE handle, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	int error = 0;
+	int nraster = 0;
+	int i;
+
+	*outraster = 0;
+	for (i = 0; i < lines && error == 0; i++) {
+		error = output_to_printer(handle, band + i * stride, raster_bytes, pixel_num, &nraster);
+		*outraster += nraster;
+	}
+
+	return error;
+}
+
+static int
+output_to_fetchpool_band(PIPEOUT_HANDLE handle, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	int error = 0;
+	int nraster = 0;
+	int i;
+
+	*outraster = 0;
+	for (i = 0; i < lines && error == 0; i++) {
+		error = output_to_fetchpool(handle, band + i * stride, raster_bytes, pixel_num, &nraster);
+		*outraster += nraster;
+	}
+
+	return error;
+}
+
+/* a repeated line reaches the printer line by line */
+static int
+output_to_printer_repeat(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, int pixel_num, int repeat, int * outraster)
+{
+	int error = 0;
+	int nraster = 0;
+	int i;
+
+	*outraster = 0;
+	for (i = 0; i < repeat && error == 0; i++) {
+		error = output_to_printer(handle, raster_p, raster_bytes, pixel_num, &nraster);
+		*outraster += nraster;
+	}
+
+	return error;
+}
+
+/* spans reaching the end of the pipeline are written out as bytes */
+static int
+output_to_printer_span(PIPEOUT_HANDLE handle, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsRaster * raster = (EpsRaster *) handle;
+	int r_pixels = raster->pipeline->page.prt_print_area_x;
+	int r_bytes = r_pixels * raster->pipeline->page.bytes_per_pixel;
+
+	eps_span_expand(raster->output_raster, line, 0, r_pixels, 0);
+	raster->output_raster_dirty = r_bytes;
+
+	return output_to_printer_repeat(handle, raster->output_raster, r_bytes, r_pixels, line->repeat, outraster);
+}
+
+/* the fetch pool keeps a copy, the buffer is used again for the next line */
+static int
+output_to_fetchpool_span(PIPEOUT_HANDLE handle, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsRaster * raster = (EpsRaster *) handle;
+	EpsFetchData data = { 0 } ;
+	int bytes = line->pixels * line->bytes_per_pixel;
+	int error = 0;
+
+	*outraster = 0;
+	if (line->repeat <= 0) {
+		return 0;
+	}
+	if (raster->span_raster_bytes < bytes) {
+		if (raster->span_raster) {
+			eps_free(raster->span_raster);
+		}
+		raster->span_raster = (char *) eps_malloc(bytes);
+		raster->span_raster_bytes = (raster->span_raster) ? bytes : 0;
+		if (raster->span_raster == NULL) {
+			debuglog(("RASTER MEMALLOC ERROR %d bytes", bytes));
+			return 1;
+		}
+	}
+	eps_span_expand(raster->span_raster, line, 0, line->pixels, 0);
+
+	data.duplicate = 1;
+	data.raster_p = raster->span_raster;
+	data.raster_bytes = bytes;
+	data.pixel_num = line->pixels;
+	data.repeat = line->repeat;
+
+	error = fetchpool_add_data(raster->fetchpool, &data);
+	if (error == 0) {
+		*outraster = line->repeat;
+	}
+
+	return error;
+}
+
+/* band entry of a pipe which only implements pipe_process */
+static int
+pipe_process_band_shim(PIPEOUT_HANDLE handle, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	EpsRasterPipe * p = (EpsRasterPipe *) handle;
+	const EpsRasterExtent * extent = p->extent;
+	int error = 0;
+	int nraster = 0;
+	int i;
+
+	*outraster = 0;
+	for (i = 0; i < lines && error == 0; i++) {
+		p->extent = (extent) ? extent + i : NULL;
+		error = p->pipe_process(p->obj, band + i * stride, raster_bytes, pixel_num, &nraster);
+		*outraster += nraster;
+	}
+
+	return error;
+}
+
+/* repeat entry of a pipe which only implements pipe_process */
+static int
+pipe_process_repeat_shim(PIPEOUT_HANDLE handle, char * raster_p, int raster_bytes, int pixel_num, int repeat, int * outraster)
+{
+	EpsRasterPipe * p = (EpsRasterPipe *) handle;
+	int error = 0;
+	int nraster = 0;
+	int i;
+
+	*outraster = 0;
+	for (i = 0; i < repeat && error == 0; i++) {
+		error = p->pipe_process(p->obj, raster_p, raster_bytes, pixel_num, &nraster);
+		*outraster += nraster;
+	}
+
+	return error;
+}
+
+/* lines equal when their extents do, and so do the bytes within them */
+static int
+raster_same_line(const char * a, const EpsRasterExtent * ea, const char * b, const EpsRasterExtent * eb, int bpp)
+{
+	if (EPS_RASTER_EXTENT_BLANK(ea) || EPS_RASTER_EXTENT_BLANK(eb)) {
+		return (EPS_RASTER_EXTENT_BLANK(ea) && EPS_RASTER_EXTENT_BLANK(eb)) ? 1 : 0;
+	}
+
+	if (ea->left != eb->left || ea->right != eb->right) {
+		return 0;
+	}
+
+	return (memcmp(a + ea->left * bpp, b + ea->left * bpp, (ea->right - ea->left) * bpp) == 0) ? 1 : 0;
+}
+
+/* lines of a band, as bytes */
+static int
+raster_send_bytes(EpsRasterPipe * first_pipe, char * band, int stride, int lines, int raster_bytes, int pixel_num, const EpsRasterExtent * extents, int * outraster)
+{
+	int error = 0;
+	int nraster = 0;
+
+	first_pipe->extent = extents;
+	if (lines == 1) {
+		error = first_pipe->pipe_process(first_pipe->obj, band, raster_bytes, pixel_num, &nraster);
+	} else if (lines > 1 && first_pipe->pipe_process_band) {
+		error = first_pipe->pipe_process_band(first_pipe->obj, band, stride, lines, raster_bytes, pixel_num, &nraster);
+	} else if (lines > 1) {
+		error = pipe_process_band_shim(first_pipe, band, stride, lines, raster_bytes, pixel_num, &nraster);
+	}
+	*outraster += nraster;
+
+	return error;
+}
+
+/* the line as spans, when the first pipe takes them and the line has few
+   enough runs for it */
+static int
+raster_span_line(EpsRaster * raster, const char * raster_p, const EpsRasterExtent * extent, int repeat, EpsRasterSpanLine * line)
+{
+	EpsRasterPipeline * pipeline = raster->pipeline;
+
+	if (raster->spans == NULL) {
+		return 0;
+	}
+
+	line->num_span = eps_span_encode(raster_p, pipeline->page.src_print_area_x, pipeline->page.bytes_per_pixel, extent, raster->spans, raster->max_span);
+	if (line->num_span < 0) {
+		return 0;
+	}
+
+	line->spans = raster->spans;
+	line->pixels = pipeline->page.src_print_area_x;
+	line->bytes_per_pixel = pipeline->page.bytes_per_pixel;
+	line->repeat = repeat;
+
+	return 1;
+}
+
+/* lines of a band, each differing from the next. the lines which make
+   few spans go as spans, the others as bytes in the bands between them. */
+static int
+raster_send_band(EpsRaster * raster, EpsRasterPipe * first_pipe, char * band, int stride, int lines, const EpsRasterExtent * extents, int * outraster)
+{
+	EpsRasterPipeline * pipeline = raster->pipeline;
+	EpsRasterSpanLine line;
+	int r_pixels = pipeline->page.src_print_area_x;
+	int r_bytes = r_pixels * pipeline->page.bytes_per_pixel;
+	int first = 0;
+	int error = 0;
+	int nraster = 0;
+	int i;
+
+	for (i = 0; i < lines && error == 0 && raster->spans; i++) {
+		if (!raster_span_line(raster, band + i * stride, &extents[i], 1, &line)) {
+			continue;
+		}
+		error = raster_send_bytes(first_pipe, band + first * stride, stride, i - first, r_bytes, r_pixels, extents + first, outraster);
+		if (error == 0) {
+			error = first_pipe->pipe_process_span(first_pipe->obj, &line, &nraster);
+			*outraster += nraster;
+		}
+		first = i + 1;
+	}
+
+	if (error == 0) {
+		error = raster_send_bytes(first_pipe, band + first * stride, stride, lines - first, r_bytes, r_pixels, extents + first, outraster);
+	}
+
+	return error;
+}
+
+static int
+raster_send_repeat(EpsRaster * raster, EpsRasterPipe * first_pipe, char * raster_p, int raster_bytes, int pixel_num, int repeat, const EpsRasterExtent * extent, int * outraster)
+{
+	EpsRasterSpanLine line;
+	int error = 0;
+	int nraster = 0;
+
+	if (raster_span_line(raster, raster_p, extent, repeat, &line)) {
+		error = first_pipe->pipe_process_span(first_pipe->obj, &line, &nraster);
+		*outraster += nraster;
+		return error;
+	}
+
+	if (repeat == 1) {
+		return raster_send_bytes(first_pipe, raster_p, raster_bytes, 1, raster_bytes, pixel_num, extent, outraster);
+	}
+
+	first_pipe->extent = extent;
+	if (first_pipe->pipe_process_repeat) {
+		error = first_pipe->pipe_process_repeat(first_pipe->obj, raster_p, raster_bytes, pixel_num, repeat, &nraster);
+	} else {
+		error = pipe_process_repeat_shim(first_pipe, raster_p, raster_bytes, pixel_num, repeat, &nraster);
+	}
+	*outraster += nraster;
+
+	return error;
+}
+
+/* the held line goes down the pipeline with the number of times it was
+   seen; the pipes may change it in place. */
+static int
+raster_send_held(EpsRaster * raster, EpsRasterPipe * first_pipe, int * outraster)
+{
+	EpsRasterPipeline * pipeline = raster->pipeline;
+	int repeat = raster->held_repeat;
+
+	raster->held_repeat = 0;
+	if (repeat == 0) {
+		return 0;
+	}
+
+	return raster_send_repeat(raster, first_pipe, raster->held, pipeline->page.src_print_area_x * pipeline->page.bytes_per_pixel,
+		pipeline->page.src_print_area_x, repeat, &raster->held_extent, outraster);
+}
+
+/* Sends full width lines down the pipeline. A line equal to the one
+   before is not sent on its own: the last run of equal lines is held
+   back until a different line (or the flush) comes, so that a run goes
+   through every pipe once, as a repeated line. */
+static int
+raster_send_lines(EpsRaster * raster, EpsRasterPipe * first_pipe, char * band, int stride, int lines, const EpsRasterExtent * extents, int * outraster)
+{
+	EpsRasterPipeline * pipeline = raster->pipeline;
+	int bpp = pipeline->page.bytes_per_pixel;
+	int r_pixels = pipeline->page.src_print_area_x;
+	int r_bytes = r_pixels * bpp;
+	int run;		/* first line of the current run */
+	int first;		/* first line not sent yet */
+	int error = 0;
+	int i = 0;
+
+	raster->stats.lines += lines;
+
+	while (i < lines && raster->held_repeat > 0
+			&& raster_same_line(raster->held, &raster->held_extent, band + i * stride, &extents[i], bpp)) {
+		raster->held_repeat++;
+		raster->stats.repeated++;
+		i++;
+	}
+	if (i == lines) {
+		return 0;
+	}
+
+	error = raster_send_held(raster, first_pipe, outraster);
+
+	run = i;
+	first = i;
+	for (i++; i < lines && error == 0; i++) {
+		if (raster_same_line(band + (i - 1) * stride, &extents[i - 1], band + i * stride, &extents[i], bpp)) {
+			raster->stats.repeated++;
+			continue;
+		}
+		if (i - run > 1) {
+			error = raster_send_band(raster, first_pipe, band + first * stride, stride, run - first, extents + first, outraster);
+			if (error == 0) {
+				error = raster_send_repeat(raster, first_pipe, band + run * stride, r_bytes, r_pixels, i - run, &extents[run], outraster);
+			}
+			first = i;
+		}
+		run = i;
+	}
+
+	if (error == 0) {
+		memcpy(raster->held, band + run * stride, r_bytes);
+		raster->held_extent = extents[run];
+		raster->held_repeat = lines - run;
+		error = raster_send_band(raster, first_pipe, band + first * stride, stride, run - first, extents + first, outraster);
+	}
+
+	return error;
+}
+
+static void
+pipe_link_band(EpsRasterPipe * p, EpsRasterPipe * next)
+{
+	if (next->pipe_process_band) {
+		p->output_band = next->pipe_process_band;
+		p->output_band_h = next->obj;
+	} else {
+		p->output_band = pipe_process_band_shim;
+		p->output_band_h = next;
+	}
+
+	if (next->pipe_process_repeat) {
+		p->output_repeat = next->pipe_process_repeat;
+		p->output_repeat_h = next->obj;
+	} else {
+		p->output_repeat = pipe_process_repeat_shim;
+		p->output_repeat_h = next;
+	}
+}
+
+static int
+pipeline_init_all(EpsRasterPipeline * pipeline, PIPEOUT_FUNC output, PIPEOUT_BAND_FUNC output_band, PIPEOUT_REPEAT_FUNC output_repeat, PIPEOUT_SPAN_FUNC output_span, PIPEOUT_HANDLE output_h, EpsRasterLineOwnership * ownership)
 {
 	int error = 0;
 	int i;
 	EpsRasterPipe * p;
+	PIPEOUT_SPAN_FUNC span = output_span;
+	PIPEOUT_HANDLE span_h = output_h;
 
 	debuglog((" number pipe : %d", pipeline->numpipe));
 	debuglog((" pipeline output = %#x, output_h = %#x", output, output_h));
 
+	*ownership = EPS_RASTER_LINE_WRITABLE; /* line given to eps_raster_print */
 	for (i = 0; i < pipeline->numpipe; i++) {
 		p = pipeline->pipeline[i];
+		p->input_ownership = *ownership;
+		p->output_ownership = *ownership;
 		error = p->pipe_init(&p->obj, p->opt);
 		if (error) {
 			break;
 		}
+		*ownership = p->output_ownership;
+		debuglog((" pipe %d ownership in(%d) out(%d)", i + 1, p->input_ownership, p->output_ownership));
 	}
 
 	if (error == 0) {
@@ -140,26 +619,139 @@ pipeline_init_all(EpsRasterPipeline * pipeline, PIPEOUT_FUNC output, PIPEOUT_HAN
 
 			if (i < pipeline->numpipe - 1) {
 				EpsRasterPipe * next = pipeline->pipeline[i + 1];
+				p->next = next;
 				p->output = next->pipe_process;
 				p->output_h = next->obj;
+				pipe_link_band(p, next);
 			} else {
+				p->next = NULL;
 				p->output = output;
 				p->output_h = output_h;
+				p->output_band = output_band;
+				p->output_band_h = output_h;
+				p->output_repeat = output_repeat;
+				p->output_repeat_h = output_h;
 			}
 
 			debuglog((" p->output = %#x, p->output_h = %#x", p->output, p->output_h));
 			debuglog((" pipe %d init = %s", i + 1, (error) ? "failed" : "succeed"));
 		}
+
+		/* spans go from the end up to the first pipe which needs bytes */
+		for (i = pipeline->numpipe - 1; i >= 0; i--) {
+			p = pipeline->pipeline[i];
+			p->output_span = span;
+			p->output_span_h = span_h;
+			span = (span) ? p->pipe_process_span : NULL;
+			span_h = p->obj;
+		}
 	}
 
 	return error;
 }
 
+/* number of leading pipes whose line kernels can run in parallel */
+static int
+pipeline_kernel_count(EpsRasterPipeline * pipeline)
+{
+	EpsRasterPipe * p;
+	int i;
+
+	for (i = 0; i < pipeline->numpipe; i++) {
+		p = pipeline->pipeline[i];
+		if (p->pipe_kernel == NULL || (i > 0 && p->pipe_lines)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/* puts a parallel pipe in front of the leading line-local pipes. on any
+   failure the pipeline is left as it is and runs on the filter thread. */
+static void
+parallel_init(EpsRaster * raster, int threads, PIPEOUT_FUNC output, PIPEOUT_BAND_FUNC output_band, PIPEOUT_REPEAT_FUNC output_repeat, EpsRasterLineOwnership * ownership)
+{
+	EpsRasterPipeline * pipeline = raster->pipeline;
+	EpsParallelOpt * opt = NULL;
+	EpsRasterPipe * pipe = NULL;
+	EpsRasterPipe * next = NULL;
+	int count = pipeline_kernel_count(pipeline);
+
+	do {
+		if (count == 0) {
+			break;
+		}
+
+		pipe = (EpsRasterPipe *) eps_malloc(sizeof(EpsRasterPipe));
+		opt = (EpsParallelOpt *) eps_malloc(sizeof(EpsParallelOpt));
+		if (pipe == NULL || opt == NULL) {
+			break;
+		}
+
+		opt->pipe = pipe;
+		opt->stages = pipeline->pipeline;
+		opt->numstage = count;
+		opt->threads = threads;
+
+		pipe->self = pipe;
+		pipe->opt = (PIPEOPT) opt;
+		pipe->input_ownership = EPS_RASTER_LINE_WRITABLE;
+		pipe->pipe_init = eps_init_parallel;
+		pipe->pipe_process = eps_process_parallel;
+		pipe->pipe_process_band = eps_process_parallel_band;
+		pipe->pipe_process_repeat = eps_process_parallel_repeat;
+		pipe->pipe_free = eps_free_parallel;
+		pipe->pipe_reset = eps_reset_parallel;
+		if (pipe->pipe_init(&pipe->obj, pipe->opt)) {
+			break;
+		}
+
+		if (count < pipeline->numpipe) {
+			next = pipeline->pipeline[count];
+			next->input_ownership = pipe->output_ownership;
+			pipe->next = next;
+			pipe->output = next->pipe_process;
+			pipe->output_h = next->obj;
+			pipe_link_band(pipe, next);
+		} else {
+			pipe->output = output;
+			pipe->output_h = raster;
+			pipe->output_band = output_band;
+			pipe->output_band_h = raster;
+			pipe->output_repeat = output_repeat;
+			pipe->output_repeat_h = raster;
+			*ownership = pipe->output_ownership;
+		}
+
+		raster->parallel = pipe;
+		pipe = NULL;
+		opt = NULL;
+
+	} while (0);
+
+	if (pipe) {
+		if (pipe->obj) {
+			pipe->pipe_free(pipe->obj); /* frees opt as well */
+			opt = NULL;
+		}
+		eps_free(pipe);
+		debuglog(("parallel pipe not available, running on the filter thread"));
+	}
+	if (opt) {
+		eps_free(opt);
+	}
+}
+
 int
 eps_raster_init (RASTER * handle, EpsRasterOpt * data, EpsRasterPipeline * pipeline)
 {
 	EpsRaster * p = NULL;
 	PIPEOUT_FUNC pipeout_func = NULL;
+	PIPEOUT_BAND_FUNC pipeout_band_func = NULL;
+	PIPEOUT_REPEAT_FUNC pipeout_repeat_func = NULL;
+	PIPEOUT_SPAN_FUNC pipeout_span_func = NULL;
+	EpsRasterLineOwnership ownership;
 	int error = 1;
 
 	do {
@@ -182,30 +774,65 @@ eps_raster_init (RASTER * handle, EpsRasterOpt * data, EpsRasterPipeline * pipel
 
 		if (p->pipeline->process_mode == EPS_RASTER_PROCESS_MODE_FETCHING) {
 			pipeout_func = output_to_fetchpool;
+			pipeout_band_func = output_to_fetchpool_band;
+			pipeout_repeat_func = output_to_fetchpool_repeat;
+			pipeout_span_func = output_to_fetchpool_span;
 			p->fetchpool = fetchpool_create_instance(pipeline->page.prt_print_area_y);
 			if (p->fetchpool == NULL) {
 				break;
 			}
 		} else { /* PRINTING */
 			pipeout_func = output_to_printer;
+			pipeout_band_func = output_to_printer_band;
+			pipeout_repeat_func = output_to_printer_repeat;
+			pipeout_span_func = output_to_printer_span;
 			p->fetchpool = NULL;
 		}
-		error = pipeline_init_all(p->pipeline, pipeout_func, p);
+		error = pipeline_init_all(p->pipeline, pipeout_func, pipeout_band_func, pipeout_repeat_func, pipeout_span_func, p, &ownership);
 		if (error) {
 			break;
 		}
 		p->pipeout = pipeout_func;
+		p->pipeout_band = pipeout_band_func;
 
+		if (data->threads > 1) {
+			parallel_init(p, data->threads, pipeout_func, pipeout_band_func, pipeout_repeat_func, &ownership);
+		}
+
+		/* SHARED lines are retained by the fetch pool without copying */
+		p->pipeline->mode.duplecate = (ownership == EPS_RASTER_LINE_SHARED) ? 0 : 1;
+		if (ownership == EPS_RASTER_LINE_SHARED) {
+			p->shared = eps_raster_buffer_retain(p->pipeline->pipeline[p->pipeline->numpipe - 1]->shared);
+		}
+
+		error = 1;
 		p->input_raster_index = 0;
-		p->input_raster = (char *)eps_malloc(pipeline->page.src_print_area_x * pipeline->page.bytes_per_pixel);
+		p->input_raster_dirty = pipeline->page.src_print_area_x * pipeline->page.bytes_per_pixel;
+		p->input_raster = (char *)eps_malloc(p->input_raster_dirty);
 		if (p->input_raster == NULL) {
 			break;
 		}
 		p->output_raster_index = 0;
-		p->output_raster = (char *)eps_malloc(pipeline->page.prt_print_area_x * pipeline->page.bytes_per_pixel);
+		p->output_raster_dirty = pipeline->page.prt_print_area_x * pipeline->page.bytes_per_pixel;
+		p->output_raster = (char *)eps_malloc(p->output_raster_dirty);
 		if (p->output_raster == NULL) {
 			break;
 		}
+		p->held_repeat = 0;
+		p->held = (char *)eps_malloc(pipeline->page.src_print_area_x * pipeline->page.bytes_per_pixel);
+		if (p->held == NULL) {
+			break;
+		}
+
+		/* the parallel pipe runs its kernels on bytes */
+		if (p->parallel == NULL && pipeline->numpipe
+				&& pipeline->pipeline[0]->pipe_process_span && pipeline->pipeline[0]->output_span) {
+			p->max_span = EPS_SPAN_MAX(pipeline->page.src_print_area_x);
+			p->spans = (EpsRasterSpan *) eps_malloc(sizeof(EpsRasterSpan) * p->max_span);
+			if (p->spans == NULL) {
+				break;
+			}
+		}
 
 		*handle = (RASTER) p;
 
@@ -223,6 +850,7 @@ eps_raster_print (RASTER handle, char * raster_p, int raster_bytes, int pixel_nu
 	EpsRaster * raster = (EpsRaster *) handle;
 	EpsRasterPipeline * pipeline = NULL;
 	EpsRasterPipe * first_pipe = NULL;
+	EpsRasterExtent extent;
 	char * r_ptr = NULL;
 	int r_bytes = 0;
 	int r_pixels = 0;
@@ -240,9 +868,7 @@ eps_raster_print (RASTER handle, char * raster_p, int raster_bytes, int pixel_nu
 			if (raster_bytes >= r_bytes) { 
 				r_ptr = raster_p;
 			} else {
-				memset(raster->input_raster, 0xFF, r_bytes);
-				memcpy(raster->input_raster, raster_p, raster_bytes);
-				r_ptr = raster->input_raster;
+				r_ptr = pad_raster(raster->input_raster, &raster->input_raster_dirty, raster_p, raster_bytes);
 			}
 		} else { // flushing
 			r_ptr = NULL;
@@ -251,10 +877,19 @@ eps_raster_print (RASTER handle, char * raster_p, int raster_bytes, int pixel_nu
 		}
 
 		if (pipeline && pipeline->numpipe) {
-			first_pipe = pipeline->pipeline[0]; // first pipe
-			error = first_pipe->pipe_process(first_pipe->obj, r_ptr, r_bytes, r_pixels, &nraster);
+			first_pipe = (raster->parallel) ? raster->parallel : pipeline->pipeline[0]; // first pipe
+			if (r_ptr) {
+				eps_raster_line_extent(r_ptr, r_pixels, pipeline->page.bytes_per_pixel, &extent);
+				error = raster_send_lines(raster, first_pipe, r_ptr, r_bytes, 1, &extent, &nraster);
+			} else {
+				error = raster_send_held(raster, first_pipe, outraster);
+				first_pipe->extent = NULL;
+				if (error == 0) {
+					error = first_pipe->pipe_process(first_pipe->obj, NULL, 0, 0, &nraster);
+				}
+			}
 			if (error == 0) {
-				*outraster = nraster;
+				*outraster += nraster;
 			}
 		} else {
 			error = raster->pipeout(raster, r_ptr, r_bytes, r_pixels, &nraster);
@@ -267,6 +902,62 @@ eps_raster_print (RASTER handle, char * raster_p, int raster_bytes, int pixel_nu
 	return error;
 }
 
+/* prints lines of a band; the lines are handed over WRITABLE as well. */
+int
+eps_raster_print_band (RASTER handle, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	EpsRaster * raster = (EpsRaster *) handle;
+	EpsRasterPipeline * pipeline = NULL;
+	EpsRasterPipe * first_pipe = NULL;
+	int r_bytes = 0;
+	int r_pixels = 0;
+	int nraster = 0;
+	int error = 0;
+	int i;
+
+	*outraster = 0;
+
+	if (raster && band) {
+		pipeline = raster->pipeline;
+		r_bytes = pipeline->page.src_print_area_x * pipeline->page.bytes_per_pixel;
+		r_pixels = pipeline->page.src_print_area_x;
+
+		if (raster_bytes < r_bytes) { /* each line needs padding */
+			for (i = 0; i < lines && error == 0; i++) {
+				error = eps_raster_print(raster, band + i * stride, raster_bytes, pixel_num, &nraster);
+				*outraster += nraster;
+			}
+		} else if (pipeline->numpipe) {
+			first_pipe = (raster->parallel) ? raster->parallel : pipeline->pipeline[0];
+			if (raster->num_extent < lines) {
+				if (raster->extents) {
+					eps_free(raster->extents);
+				}
+				raster->extents = (EpsRasterExtent *) eps_malloc(sizeof(EpsRasterExtent) * lines);
+				raster->num_extent = (raster->extents) ? lines : 0;
+			}
+			if (raster->num_extent < lines) {
+				debuglog(("RASTER MEMALLOC ERROR %d extents", lines));
+				return 1;
+			}
+			for (i = 0; i < lines; i++) {
+				eps_raster_line_extent(band + i * stride, r_pixels, pipeline->page.bytes_per_pixel, &raster->extents[i]);
+			}
+			error = raster_send_lines(raster, first_pipe, band, stride, lines, raster->extents, &nraster);
+			if (error == 0) {
+				*outraster = nraster;
+			}
+		} else {
+			error = raster->pipeout_band(raster, band, stride, lines, r_bytes, r_pixels, &nraster);
+			if (error == 0) {
+				*outraster = nraster;
+			}
+		}
+	}
+
+	return error;
+}
+
 /* if fetched_p equals NULL means that check fetching status. */
 int
 eps_raster_fetch (RASTER handle, char * fetch_p, int fetch_bytes, int fetch_pixels, EpsRasterFetchStatus * current_status)
@@ -303,7 +994,6 @@ eps_raster_fetch (RASTER handle, char * fetch_p, int fetch_bytes, int fetch_pixe
 			fetch_bytes = data->raster_bytes;
 		}
 
-		memset(fetch_p, 0xFF, fetch_bytes);
 		memcpy(fetch_p, data->raster_p, fetch_bytes);
 
 		error = 0;
@@ -313,6 +1003,46 @@ eps_raster_fetch (RASTER handle, char * fetch_p, int fetch_bytes, int fetch_pixe
 	return error;
 }
 
+/* rewinds a flushed raster for the next page of the same geometry, keeping
+   every pipe and buffer (and the decoded watermark) */
+int
+eps_raster_reset (RASTER handle)
+{
+	EpsRaster * raster = (EpsRaster *) handle;
+	EpsRasterPipeline * pipeline = NULL;
+	EpsRasterPipe * p = NULL;
+	int error = 1;
+	int i;
+
+	do {
+		if (raster == NULL) {
+			break;
+		}
+
+		raster->input_raster_index = 0;
+		raster->output_raster_index = 0;
+		raster->held_repeat = 0;
+
+		if (raster->fetchpool) {
+			fetchpool_reset(raster->fetchpool);
+		}
+
+		error = 0;
+		if (raster->parallel) {
+			error = raster->parallel->pipe_reset(raster->parallel->obj);
+		}
+
+		pipeline = raster->pipeline;
+		for (i = 0; i < pipeline->numpipe && error == 0; i++) {
+			p = pipeline->pipeline[i];
+			error = p->pipe_reset(p->obj);
+		}
+
+	} while (0);
+
+	return error;
+}
+
 int eps_raster_free (RASTER handle)
 {
 	EpsRaster * raster = (EpsRaster *) handle;
@@ -322,6 +1052,11 @@ int eps_raster_free (RASTER handle)
 	int i;
 
 	if (raster) {
+		if (raster->parallel) {
+			raster->parallel->pipe_free(raster->parallel->obj);
+			eps_free(raster->parallel);
+		}
+
 		pipeline = raster->pipeline;
 		if (pipeline) {
 			for (i = 0; i < pipeline->numpipe; i++) {
@@ -341,12 +1076,80 @@ int eps_raster_free (RASTER handle)
 			eps_free(raster->output_raster);
 		}
 
+		if (raster->extents) {
+			eps_free(raster->extents);
+		}
+
+		if (raster->held) {
+			eps_free(raster->held);
+		}
+
+		if (raster->spans) {
+			eps_free(raster->spans);
+		}
+
+		if (raster->span_raster) {
+			eps_free(raster->span_raster);
+		}
+
+		debuglog(("RASTER %lu lines, %lu repeated", raster->stats.lines, raster->stats.repeated));
+
 		if (raster->fetchpool) {
 			fetchpool_destroy_instance(raster->fetchpool);
 		}
 
+		eps_raster_buffer_release(raster->shared);
+
 		eps_free(raster);
 	}
 
 	return error;
 }
+
+int
+eps_raster_stats (RASTER handle, EpsRasterStats * stats)
+{
+	EpsRaster * raster = (EpsRaster *) handle;
+
+	if (raster == NULL || stats == NULL) {
+		return 1;
+	}
+
+	*stats = raster->stats;
+
+	return 0;
+}
+
+EpsRasterBuffer *
+eps_raster_buffer_create (void * data, RASTERBUFFER_FREE_FUNC data_free)
+{
+	EpsRasterBuffer * buffer = (EpsRasterBuffer *) eps_malloc(sizeof(EpsRasterBuffer));
+	if (buffer) {
+		buffer->refcount = 1;
+		buffer->data = data;
+		buffer->data_free = data_free;
+	}
+
+	return buffer;
+}
+
+EpsRasterBuffer *
+eps_raster_buffer_retain (EpsRasterBuffer * buffer)
+{
+	if (buffer) {
+		buffer->refcount++;
+	}
+
+	return buffer;
+}
+
+void
+eps_raster_buffer_release (EpsRasterBuffer * buffer)
+{
+	if (buffer && --buffer->refcount == 0) {
+		if (buffer->data_free) {
+			buffer->data_free(buffer->data);
+		}
+		eps_free(buffer);
+	}
+}
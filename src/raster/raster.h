@@ -90,6 +90,14 @@ typedef struct EpsPageWatermarkOption {
 	EpsPageWatermarkColor color;
 } EpsPageWatermarkOption;
 
+typedef enum {
+	EPS_SCALE_FILTER_AUTO = 0,	/* box when reducing, nearest otherwise */
+	EPS_SCALE_FILTER_NEAREST,
+	EPS_SCALE_FILTER_BOX,		/* averages the area a pixel covers */
+	EPS_SCALE_FILTER_BILINEAR,
+	EPS_SCALE_FILTER_BICUBIC
+} EpsScaleFilter;
+
 typedef struct EpsPageInfo {
 	int bytes_per_pixel;
 	int src_print_area_x;
@@ -97,29 +105,184 @@ typedef struct EpsPageInfo {
 	int prt_print_area_x;
 	int prt_print_area_y;
 	int scale;
+	EpsScaleFilter scale_filter;
+	int scale_tolerance;	/* pixels off the printable area cropped or padded, not scaled */
 	int mirror;
 	int reverse;
+	int reverse_memory;	/* megabytes of a reversed page kept in memory, 0 for no limit */
 	EpsPageWatermarkOption watermark;
 } EpsPageInfo;
 
 typedef struct EpsRasterInit {
 	HANDLE drv_handle;
 	RASTEROUT_FUNC raster_output;
+	int threads;		/* > 1 runs the line kernels on worker threads */
 } EpsRasterOpt;
 
 typedef int (*PIPEOUT_FUNC) (PIPEOUT_HANDLE, char *, int, int, int *);
 
+/*
+ * A band is a run of lines sharing the same bytes and pixels per line,
+ * line n starting at band + n * stride:
+ *   (handle, band, stride, lines, bytes, pixels, outraster)
+ */
+typedef int (*PIPEOUT_BAND_FUNC) (PIPEOUT_HANDLE, char *, int, int, int, int, int *);
+
+/*
+ * One line standing for repeat identical lines in a row, as an enlarging
+ * scaler or the duplicate line check of eps_raster_print emits them. A
+ * pipe without pipe_process_repeat gets the line repeat times through
+ * pipe_process.
+ *   (handle, raster, bytes, pixels, repeat, outraster)
+ */
+typedef int (*PIPEOUT_REPEAT_FUNC) (PIPEOUT_HANDLE, char *, int, int, int, int *);
+
+/*
+ * A span line stands for a line made of runs, as most input lines are.
+ * A span covers length pixels: a flat one repeats the pixel at data (step
+ * 0), any other reads its pixels from data on, step bytes apart (step is
+ * -bytes_per_pixel for mirrored pixels). The spans cover the line from
+ * left to right. data belong to the sender and stay valid until the call
+ * returns, like a BORROWED line.
+ *   (handle, line, outraster)
+ */
+typedef struct EpsRasterSpan {
+	const char * data;
+	int length;
+	int step;
+} EpsRasterSpan;
+
+typedef struct EpsRasterSpanLine {
+	const EpsRasterSpan * spans;
+	int num_span;
+	int pixels;
+	int bytes_per_pixel;
+	int repeat;		/* identical lines it stands for */
+} EpsRasterSpanLine;
+
+typedef int (*PIPEOUT_SPAN_FUNC) (PIPEOUT_HANDLE, const EpsRasterSpanLine *, int *);
+
+#define EPS_RASTER_BAND_LINES	32
+
+/*
+ * Buffer ownership of a line handed to the next pipe.
+ *
+ * BORROWED : read-only, valid only until the call returns.
+ * WRITABLE : the receiver may transform the line in place. The sender
+ *            rebuilds the buffer before it emits it again.
+ * SHARED   : the line lives in a refcounted EpsRasterBuffer and is left
+ *            unchanged while a reference is held, so the receiver may
+ *            keep the pointer instead of copying the line.
+ *
+ * eps_raster_print hands its line over WRITABLE. Each pipe reads its
+ * input_ownership and declares output_ownership in pipe_init; a pipe
+ * that never touches output_ownership passes its input through as is.
+ */
+typedef enum {
+	EPS_RASTER_LINE_BORROWED,
+	EPS_RASTER_LINE_WRITABLE,
+	EPS_RASTER_LINE_SHARED,
+} EpsRasterLineOwnership;
+
+typedef void (*RASTERBUFFER_FREE_FUNC) (void *);
+
+typedef struct EpsRasterBuffer {
+	int refcount;
+	void * data;
+	RASTERBUFFER_FREE_FUNC data_free;
+} EpsRasterBuffer;
+
+/*
+ * Pixels [left, right) of a line hold all of its non-white (not 0xFF)
+ * bytes, left >= right for a blank line. eps_raster_print works them out
+ * once per input line; each pipe hands the extents of the lines it emits
+ * to the next one (EPS_RASTER_PASS_EXTENT) before the output call, so
+ * blank lines and white margins can be skipped downstream.
+ */
+typedef struct EpsRasterExtent {
+	int left;
+	int right;
+} EpsRasterExtent;
+
+#define EPS_RASTER_EXTENT_BLANK(e)	((e)->left >= (e)->right)
+
+void eps_raster_line_extent (const char *, int, int, EpsRasterExtent *);
+
+/*
+ * Line kernels let eps_raster_init run the leading line-local pipes of a
+ * pipeline on worker threads (EpsRasterOpt.threads > 1).
+ *
+ * pipe_kernel : (obj, index, src, dst, bytes, pixels, extent) transforms
+ *               one line and must be thread safe. index is the line
+ *               number within the page as seen by this pipe, extent that
+ *               of src on entry and of dst on return.
+ * pipe_lines  : (obj) number of lines the next input line turns into,
+ *               called in line order on the filter thread. A pipe that
+ *               sets it writes the line once from src into dst, sized
+ *               kernel_bytes / kernel_pixels. Without it the kernel works
+ *               in place (src == dst) and keeps the line count.
+ */
+typedef int (*PIPEKERNEL_FUNC) (PIPEOBJ, int, char *, char *, int, int, EpsRasterExtent *);
+typedef int (*PIPELINES_FUNC) (PIPEOBJ);
+
+/* what the pipeline planner (raster_helper_plan) may assume of a pipe */
+typedef enum {
+	EPS_RASTER_PIPE_LINE_LOCAL	= 1 << 0,	/* a line depends on one input line */
+	EPS_RASTER_PIPE_FULL_PAGE	= 1 << 1,	/* holds the page, emits it bottom up */
+	EPS_RASTER_PIPE_IN_PLACE	= 1 << 2,	/* may work on the input line itself */
+	EPS_RASTER_PIPE_RESIZES		= 1 << 3,	/* changes the resolution */
+	EPS_RASTER_PIPE_PER_ROW		= 1 << 4,	/* a line depends on its line number too */
+} EpsRasterPipeCaps;
+
 typedef struct EpsRasterPipe {
 	RASTERPIPE self;	
 	PIPEOPT opt;
 	PIPEOBJ obj;
 	PIPEOUT_FUNC output;
 	PIPEOUT_HANDLE output_h;
+	EpsRasterLineOwnership input_ownership;
+	EpsRasterLineOwnership output_ownership;
+	EpsRasterBuffer * shared; /* backing store of SHARED output lines */
+	PIPEOUT_BAND_FUNC output_band;
+	PIPEOUT_HANDLE output_band_h;
+	PIPEOUT_REPEAT_FUNC output_repeat;
+	PIPEOUT_HANDLE output_repeat_h;
+	PIPEOUT_SPAN_FUNC output_span;	/* NULL unless every pipe after takes spans */
+	PIPEOUT_HANDLE output_span_h;
 	int (* pipe_init) (RASTERPIPE *, PIPEOPT);
 	int (* pipe_process) (RASTERPIPE, char *, int, int, int *);
+	int (* pipe_process_band) (RASTERPIPE, char *, int, int, int, int, int *); /* optional */
+	int (* pipe_process_repeat) (RASTERPIPE, char *, int, int, int, int *); /* optional */
+	int (* pipe_process_span) (RASTERPIPE, const EpsRasterSpanLine *, int *); /* optional */
 	int (* pipe_free) (RASTERPIPE);
+	int (* pipe_reset) (RASTERPIPE); /* rewinds the pipe for the next page */
+	PIPEKERNEL_FUNC pipe_kernel; /* optional, set in pipe_init */
+	PIPELINES_FUNC pipe_lines;
+	int kernel_bytes;
+	int kernel_pixels;
+	int caps;		/* EpsRasterPipeCaps */
+	int (* pipe_drops) (PIPEOBJ, char *, int); /* optional, RESIZES only */
+	const char * drop;	/* input lines whose content nobody will read, or NULL */
+	int num_drop;
+	struct EpsRasterPipe * next;	/* set by eps_raster_init, NULL for the last pipe */
+	const EpsRasterExtent * extent;	/* one per line handed in, NULL if unknown */
 } EpsRasterPipe;
 
+void eps_raster_pipe_extent (const EpsRasterPipe *, int, int, EpsRasterExtent *);
+
+#define EPS_RASTER_PASS_EXTENT(pipe, e) {	\
+	if ((pipe)->next) {			\
+		(pipe)->next->extent = (e);	\
+	}					\
+}
+
+/* the pipe may leave input line index as it is (see raster_helper_plan) */
+#define EPS_RASTER_LINE_DROPPED(pipe, index) \
+	((pipe)->drop && (index) >= 0 && (index) < (pipe)->num_drop && (pipe)->drop[index])
+
+/* a repeated line is left as it is only when all of its lines may be */
+int eps_raster_run_dropped (const EpsRasterPipe *, int, int);
+
 typedef enum {
 	EPS_RASTER_PROCESS_MODE_PRINTING,
 	EPS_RASTER_PROCESS_MODE_FETCHING,
@@ -130,11 +293,21 @@ typedef struct EpsRasterPipeline {
 	EpsPageInfo page;
 	EpsRasterPipe ** pipeline;
 	int numpipe;
+	char * drop;		/* set by raster_helper_plan */
+	int num_prepare;	/* leading pipes of a chained prepare page */
 	union {
 		int duplecate;
 	} mode;
 } EpsRasterPipeline;
 
+/* lines seen by eps_raster_print and eps_raster_print_band since
+   eps_raster_init; repeated ones equal the line before and went down the
+   pipeline with that line. */
+typedef struct EpsRasterStats {
+	unsigned long lines;
+	unsigned long repeated;
+} EpsRasterStats;
+
 typedef enum {
 	EPS_RASTER_FETCH_STATUS_HAS_RASTER,
 	EPS_RASTER_FETCH_STATUS_NEED_RASTER,
@@ -144,8 +317,15 @@ typedef enum {
 
 int eps_raster_init (RASTER *, EpsRasterOpt *, EpsRasterPipeline *);
 int eps_raster_print (RASTER, char *, int, int, int *);
+int eps_raster_print_band (RASTER, char *, int, int, int, int, int *);
 int eps_raster_fetch (RASTER, char *, int, int, EpsRasterFetchStatus *);
+int eps_raster_reset (RASTER);
 int eps_raster_free (RASTER);
+int eps_raster_stats (RASTER, EpsRasterStats *);
+
+EpsRasterBuffer * eps_raster_buffer_create (void *, RASTERBUFFER_FREE_FUNC);
+EpsRasterBuffer * eps_raster_buffer_retain (EpsRasterBuffer *);
+void eps_raster_buffer_release (EpsRasterBuffer *);
 
 
 #ifdef __cplusplus
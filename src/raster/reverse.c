@@ -22,15 +22,414 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "reverse.h"
+#include "mirror.h"
+#include "span.h"
+
+/* lines of the slab start on this */
+#define REVERSE_LINE_ALIGN	16
+
+/* the arena of coded lines grows by at least this */
+#define REVERSE_ARENA_MIN	(64 * 1024)
+
+typedef struct EpsReverseStore {
+	char ** rasters;
+	int num_raster;
+	char * slab;		/* the lines, then a white one */
+	size_t slab_bytes;
+	int mapped;		/* the slab is a temporary file mapped */
+} EpsReverseStore;
+
+/* bytes of the arena a stored line is coded at, none for a blank one */
+typedef struct EpsReverseCode {
+	size_t offset;
+	int length;
+} EpsReverseCode;
 
 typedef struct EpsReverse {
 	EpsReverseOpt * init_data;
-	char ** rasters;
+	EpsReverseStore * store;	/* owned by the shared buffer of the pipe */
+	char ** rasters;	/* all 0xFF but the extent of the stored lines */
+	char * white;		/* stands for the lines never written */
+	char * filled;		/* the line was made white before it was written */
+	char * line;		/* coded store: all 0xFF but while a line is coded or flushed */
+	unsigned char * arena;	/* coded store: the extents of the lines, one after another */
+	size_t arena_used;
+	size_t arena_size;
+	EpsReverseCode * codes;
+	EpsRasterExtent * extents;
+	int * repeats;		/* lines stored once for a run, 1 elsewhere */
+	EpsRasterSpan * spans;	/* mirrored spans */
+	int span_size;
 	int current;
 	int flushed;
+	int raster_index;
 } EpsReverse;
 
+static void
+reverse_store_free(void * data)
+{
+	EpsReverseStore * store = (EpsReverseStore *) data;
+
+	if (store) {
+		if (store->slab) {
+			if (store->mapped) {
+				munmap(store->slab, store->slab_bytes);
+			} else {
+				eps_free(store->slab);
+			}
+		}
+		if (store->rasters) {
+			eps_free(store->rasters);
+		}
+		eps_free(store);
+	}
+}
+
+/* a temporary file of bytes, mapped. it is gone from the directory at
+   once, and holes in it are never written out. */
+static char *
+reverse_store_map(size_t bytes)
+{
+	const char * dir = getenv("TMPDIR");
+	char path[1024];
+	void * p = MAP_FAILED;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/eps-reverse-XXXXXX", (dir && *dir) ? dir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0) {
+		debuglog(("failed to make : %s", path));
+		return NULL;
+	}
+	unlink(path);
+
+	if (ftruncate(fd, (off_t) bytes) == 0) {
+		p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+
+	return (p == MAP_FAILED) ? NULL : (char *) p;
+}
+
+/* Lines of a page go in one slab, which is in memory up to budget bytes
+   and a mapped temporary file past it. Only the white line is written
+   here, a line of the slab is made white the first time it is stored, so
+   the pages of lines never stored are not touched. */
+static EpsReverseStore *
+reverse_store_create(int num_raster, int bytes_per_raster, size_t budget)
+{
+	EpsReverseStore * store = NULL;
+	size_t stride;
+	int error = 1;
+	int i;
+
+	do {
+		store = (EpsReverseStore *) eps_malloc(sizeof(EpsReverseStore));
+		if (store == NULL) {
+			break;
+		}
+		store->num_raster = num_raster;
+
+		stride = (bytes_per_raster + REVERSE_LINE_ALIGN - 1) / REVERSE_LINE_ALIGN * REVERSE_LINE_ALIGN;
+		store->slab_bytes = stride * (num_raster + 1);
+		if (budget > 0 && store->slab_bytes > budget) {
+			store->slab = reverse_store_map(store->slab_bytes);
+			store->mapped = (store->slab) ? 1 : 0;
+			debuglog(("reverse store : %lu bytes %s", (unsigned long) store->slab_bytes, (store->slab) ? "mapped" : "not mapped"));
+		}
+		if (store->slab == NULL) {
+			store->slab = (char *) eps_malloc(store->slab_bytes);
+		}
+		if (store->slab == NULL) {
+			break;
+		}
+
+		store->rasters = (char **) eps_malloc(sizeof(char *) * (num_raster + 1));
+		if (store->rasters == NULL) {
+			break;
+		}
+		for (i = 0; i <= num_raster; i++) {
+			store->rasters[i] = store->slab + i * stride;
+		}
+		memset(store->rasters[num_raster], 0xFF, bytes_per_raster);
+
+		error = 0;
+	} while (0);
+
+	if (error) {
+		reverse_store_free(store);
+		store = NULL;
+	}
+
+	return store;
+}
+
+/* PackBits: a count byte n, then n + 1 bytes as they are for n of 0 to
+   127, or one byte repeated 257 - n times for n of 129 to 255 */
+static int
+reverse_pack(unsigned char * dst, const unsigned char * src, int bytes)
+{
+	unsigned char * d = dst;
+	int i = 0;
+	int run, lit;
+
+	while (i < bytes) {
+		for (run = 1; i + run < bytes && run < 128 && src[i + run] == src[i]; run++) {
+			;
+		}
+		if (run >= 3) {
+			*d++ = (unsigned char) (257 - run);
+			*d++ = src[i];
+			i += run;
+			continue;
+		}
+
+		/* as they are, up to the next run of 3 */
+		for (lit = 0; i + lit < bytes && lit < 128; lit++) {
+			if (i + lit + 2 < bytes && src[i + lit] == src[i + lit + 1] && src[i + lit] == src[i + lit + 2]) {
+				break;
+			}
+		}
+		*d++ = (unsigned char) (lit - 1);
+		memcpy(d, src + i, lit);
+		d += lit;
+		i += lit;
+	}
+
+	return d - dst;
+}
+
+static void
+reverse_unpack(unsigned char * dst, const unsigned char * src, int length)
+{
+	const unsigned char * end = src + length;
+	int n;
+
+	while (src < end) {
+		n = *src++;
+		if (n < 128) {
+			memcpy(dst, src, n + 1);
+			dst += n + 1;
+			src += n + 1;
+		} else if (n > 128) {
+			memset(dst, *src++, 257 - n);
+			dst += 257 - n;
+		}
+	}
+}
+
+/* room for bytes more in the arena */
+static int
+reverse_arena_reserve(EpsReverse * lp_reverse, size_t bytes)
+{
+	unsigned char * arena;
+	size_t size;
+
+	if (lp_reverse->arena_used + bytes <= lp_reverse->arena_size) {
+		return 0;
+	}
+
+	size = lp_reverse->arena_size * 2;
+	if (size < lp_reverse->arena_used + bytes) {
+		size = lp_reverse->arena_used + bytes;
+	}
+	if (size < REVERSE_ARENA_MIN) {
+		size = REVERSE_ARENA_MIN;
+	}
+
+	arena = (unsigned char *) eps_realloc(lp_reverse->arena, size);
+	if (arena == NULL) {
+		debuglog(("REVERSE MEMALLOC ERROR %lu bytes", (unsigned long) size));
+		return 1;
+	}
+	lp_reverse->arena = arena;
+	lp_reverse->arena_size = size;
+
+	return 0;
+}
+
+/* the line of slot, made white the first time. a coded store has the
+   lines written to its white line, and coded from it by
+   reverse_slot_stored. */
+static char *
+reverse_fill_slot(EpsReverse * lp_reverse, int slot)
+{
+	if (lp_reverse->line) {
+		return lp_reverse->line;
+	}
+
+	if (!lp_reverse->filled[slot]) {
+		memset(lp_reverse->rasters[slot], 0xFF, lp_reverse->init_data->bytes_per_raster);
+		lp_reverse->filled[slot] = 1;
+	}
+
+	return lp_reverse->rasters[slot];
+}
+
+/* codes the extent of the line written for slot, and makes the line
+   white again. returns 1 when the arena cannot hold the line. */
+static int
+reverse_slot_stored(EpsReverse * lp_reverse, int slot)
+{
+	EpsReverseOpt * lp_data = lp_reverse->init_data;
+	EpsRasterExtent * extent = &lp_reverse->extents[slot];
+	EpsReverseCode * code = &lp_reverse->codes[slot];
+	unsigned char * p;
+	int bytes;
+	int error = 0;
+
+	if (lp_reverse->line == NULL) {
+		return 0;
+	}
+
+	code->length = 0;
+	if (EPS_RASTER_EXTENT_BLANK(extent)) {
+		return 0;
+	}
+
+	p = (unsigned char *) lp_reverse->line + extent->left * lp_data->bytes_per_pixel;
+	bytes = extent->right * lp_data->bytes_per_pixel;
+	if (bytes > lp_data->bytes_per_raster) {
+		bytes = lp_data->bytes_per_raster;
+	}
+	bytes -= extent->left * lp_data->bytes_per_pixel;
+
+	if (reverse_arena_reserve(lp_reverse, bytes + bytes / 128 + 1) == 0) {
+		code->offset = lp_reverse->arena_used;
+		code->length = reverse_pack(lp_reverse->arena + code->offset, p, bytes);
+		lp_reverse->arena_used += code->length;
+	} else {
+		extent->left = 0;
+		extent->right = 0;
+		error = 1;
+	}
+	memset(p, 0xFF, bytes);
+
+	return error;
+}
+
+/* the line stored for slot, as it is flushed */
+static char *
+reverse_slot_line(EpsReverse * lp_reverse, int slot)
+{
+	EpsReverseOpt * lp_data = lp_reverse->init_data;
+	EpsReverseCode * code;
+
+	if (lp_reverse->line == NULL) {
+		return (lp_reverse->filled[slot]) ? lp_reverse->rasters[slot] : lp_reverse->white;
+	}
+
+	/* the line went out writable, so it is made white again */
+	memset(lp_reverse->line, 0xFF, lp_data->bytes_per_raster);
+	code = &lp_reverse->codes[slot];
+	if (code->length > 0) {
+		reverse_unpack((unsigned char *) lp_reverse->line + lp_reverse->extents[slot].left * lp_data->bytes_per_pixel,
+			lp_reverse->arena + code->offset, code->length);
+	}
+
+	return lp_reverse->line;
+}
+
+/* the mirrored copy keeps what a mirror pipe in front would have handed
+   over: the mirrored pixels followed by a 0xFF tail. only the extent of
+   the line is written, the rest of dst is white already. */
+static void
+reverse_store_mirrored(char * dst, const char * raster_p, int nbytes, int pixel_num, int bpp, EpsRasterExtent * extent)
+{
+	int npixels = nbytes / bpp;
+	int left, right;
+
+	if (npixels > pixel_num) {
+		npixels = pixel_num;
+	}
+
+	left = (pixel_num - extent->right > 0) ? pixel_num - extent->right : 0;
+	right = (pixel_num - extent->left < npixels) ? pixel_num - extent->left : npixels;
+	if (EPS_RASTER_EXTENT_BLANK(extent) || left >= right) {
+		extent->left = 0;
+		extent->right = 0;
+		return;
+	}
+
+	eps_mirror_pixels(dst + left * bpp, raster_p + (pixel_num - right) * bpp, right - left, bpp);
+	extent->left = left;
+	extent->right = right;
+}
+
+/* only the extent of the line is copied, the rest of dst is white */
+static void
+reverse_store_copy(char * dst, const char * raster_p, int nbytes, int pixel_num, int bpp, EpsRasterExtent * extent)
+{
+	int pixel_bytes = pixel_num * bpp;
+	int left = pixel_bytes;
+	int right = pixel_bytes;
+
+	if (!EPS_RASTER_EXTENT_BLANK(extent)) {
+		left = extent->left * bpp;
+		right = extent->right * bpp;
+	}
+	if (nbytes > pixel_bytes) { /* bytes past the pixels are not in extent */
+		right = nbytes;
+	}
+	if (right > nbytes) {
+		right = nbytes;
+	}
+
+	if (left < right) {
+		memcpy(dst + left, raster_p + left, right - left);
+		extent->left = left / bpp;
+		extent->right = (right + bpp - 1) / bpp;
+	} else {
+		extent->left = 0;
+		extent->right = 0;
+	}
+}
+
+/* a run of repeat identical lines is stored once, in the slot flushed
+   first, and flushed with its repeat count. returns that slot, or -1 when
+   the run is not stored. */
+static int
+reverse_take_slot(EpsReverse * lp_reverse, int repeat)
+{
+	int n = (repeat <= lp_reverse->current + 1) ? repeat : lp_reverse->current + 1;
+	int slot = -1;
+
+	if (n > 0 && !eps_raster_run_dropped(lp_reverse->init_data->pipe, lp_reverse->raster_index, repeat)) {
+		slot = lp_reverse->current - n + 1;
+		lp_reverse->repeats[slot] = n;
+	}
+	lp_reverse->current -= repeat;
+	lp_reverse->raster_index += repeat;
+
+	return slot;
+}
+
+static int
+reverse_store_raster(EpsReverse * lp_reverse, const char * raster_p, int raster_bytes, int pixel_num, int repeat, EpsRasterExtent * extent)
+{
+	EpsReverseOpt * lp_data = lp_reverse->init_data;
+	int slot = reverse_take_slot(lp_reverse, repeat);
+	int nbytes;
+
+	if (slot >= 0) {
+		nbytes = (raster_bytes >= lp_data->bytes_per_raster) ? lp_data->bytes_per_raster : raster_bytes;
+#ifdef DEBUG_VERBOSE
+		debuglog(("reverse copying : (current=%d)", lp_reverse->current));
+#endif
+		if (lp_data->mirror) {
+			reverse_store_mirrored(reverse_fill_slot(lp_reverse, slot), raster_p, nbytes, pixel_num, lp_data->bytes_per_pixel, extent);
+		} else {
+			reverse_store_copy(reverse_fill_slot(lp_reverse, slot), raster_p, nbytes, pixel_num, lp_data->bytes_per_pixel, extent);
+		}
+		lp_reverse->extents[slot] = *extent;
+		return reverse_slot_stored(lp_reverse, slot);
+	}
+
+	return 0;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -41,7 +440,6 @@ int
 eps_init_reverse (RASTERPIPE * reverse_p, PIPEOPT init_p)
 {
 	EpsReverse * p = NULL;
-	char **rasters =  NULL;
 	int eps_error = 0;
 	int i = 0;
 
@@ -49,21 +447,52 @@ eps_init_reverse (RASTERPIPE * reverse_p, PIPEOPT init_p)
 		p = (EpsReverse *) eps_malloc(sizeof(EpsReverse));
 		if (p) {
 			p->init_data = (EpsReverseOpt *) init_p;
-			p->rasters = (char **) eps_malloc(sizeof(char *) * p->init_data->num_raster);
-			if (p->rasters) {
-				rasters =  p->rasters;
+			if (p->init_data->compress) {
+				p->line = (char *) eps_malloc(p->init_data->bytes_per_raster);
+				p->codes = (EpsReverseCode *) eps_malloc(sizeof(EpsReverseCode) * p->init_data->num_raster);
+				if (p->line && p->codes) {
+					memset(p->line, 0xFF, p->init_data->bytes_per_raster);
+				} else {
+					eps_error = 1;
+				}
+			} else {
+				p->store = reverse_store_create(p->init_data->num_raster, p->init_data->bytes_per_raster, p->init_data->memory_budget);
+				if (p->store) {
+					p->rasters = p->store->rasters;
+					p->white = p->rasters[p->init_data->num_raster];
+				} else {
+					eps_error = 1;
+				}
+			}
+			p->filled = (char *) eps_malloc(p->init_data->num_raster + 1);
+			p->extents = (EpsRasterExtent *) eps_malloc(sizeof(EpsRasterExtent) * p->init_data->num_raster); /* blank */
+			p->repeats = (int *) eps_malloc(sizeof(int) * p->init_data->num_raster);
+			if (p->repeats && p->extents && p->filled) {
 				for (i = 0; i < p->init_data->num_raster; i++) {
-					rasters[i] = NULL;
+					p->repeats[i] = 1;
 				}
+			} else {
+				eps_error = 1;
+			}
 
-				for (i = 0; i < p->init_data->num_raster; i++) {
-					rasters[i] = (char *) eps_malloc(p->init_data->bytes_per_raster);
-					memset(rasters[i], 0xFF, p->init_data->bytes_per_raster);
+			/* stored lines stay untouched until the last reference is gone,
+			   coded ones are decoded to the one line for each output */
+			if (p->init_data->compress) {
+				p->init_data->pipe->output_ownership = EPS_RASTER_LINE_WRITABLE;
+			} else {
+				p->init_data->pipe->shared = eps_raster_buffer_create(p->store, reverse_store_free);
+				p->init_data->pipe->output_ownership = EPS_RASTER_LINE_SHARED;
+				if (p->init_data->pipe->shared == NULL) {
+					reverse_store_free(p->store);
+					p->store = NULL;
+					p->rasters = NULL;
+					eps_error = 1;
 				}
 			}
 
 			p->current = p->init_data->num_raster - 1; /* last */
 			p->flushed = 0;
+			p->raster_index = 0;
 
 			debuglog(("current pos. %d", p->current));
 
@@ -83,7 +512,7 @@ eps_process_reverse (RASTERPIPE reverse, char* raster_p, int raster_bytes, int p
 {
 	EpsReverse * lp_reverse = NULL;
 	EpsReverseOpt * lp_data = NULL;
-	char *blank_raster_buf = NULL;
+	char * raster = NULL;
 	int flush_raster = 0;
 	int nbytes = 0;
 	int npixels = 0;
@@ -91,6 +520,7 @@ eps_process_reverse (RASTERPIPE reverse, char* raster_p, int raster_bytes, int p
 	int nraster = 0;
 	int margin = 0;
 	int i = 0;
+	EpsRasterExtent extent;
 
 	do {
 		*outraster = 0;
@@ -107,14 +537,10 @@ eps_process_reverse (RASTERPIPE reverse, char* raster_p, int raster_bytes, int p
 		}
 
 		if (raster_p) { // reverse copying
-			if (lp_reverse->current >= 0) {
-				nbytes = (raster_bytes >= lp_data->bytes_per_raster) ? lp_data->bytes_per_raster : raster_bytes;
-#ifdef DEBUG_VERBOSE
-				debuglog(("reverse copying : (current=%d)", lp_reverse->current));
-#endif
-				memcpy(lp_reverse->rasters[lp_reverse->current], raster_p, nbytes);
+			eps_raster_pipe_extent(lp_data->pipe, 0, pixel_num, &extent);
+			if (reverse_store_raster(lp_reverse, raster_p, raster_bytes, pixel_num, 1, &extent)) {
+				break;
 			}
-			lp_reverse->current--;
 		} else { // printing (flushing)
 			if (lp_reverse->flushed == 0) {
 				lp_reverse->flushed = 1;
@@ -125,8 +551,19 @@ eps_process_reverse (RASTERPIPE reverse, char* raster_p, int raster_bytes, int p
 				flush_raster = lp_data->num_raster;
 				debuglog(("reverse printing start : (current=%d) %d rasters", lp_reverse->current, flush_raster));
 
-				for (i = margin; i < flush_raster; i++) {
-					error = lp_data->pipe->output(lp_data->pipe->output_h, lp_reverse->rasters[i], nbytes, npixels, &nraster);
+				/* the slab is read once, front to back */
+				if (lp_reverse->store && lp_reverse->store->mapped && margin < flush_raster) {
+					madvise(lp_reverse->rasters[margin], lp_reverse->rasters[flush_raster] - lp_reverse->rasters[margin], MADV_SEQUENTIAL);
+				}
+
+				for (i = margin; i < flush_raster; i += lp_reverse->repeats[i]) {
+					raster = reverse_slot_line(lp_reverse, i);
+					EPS_RASTER_PASS_EXTENT(lp_data->pipe, &lp_reverse->extents[i]);
+					if (lp_reverse->repeats[i] > 1) {
+						error = lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, raster, nbytes, npixels, lp_reverse->repeats[i], &nraster);
+					} else {
+						error = lp_data->pipe->output(lp_data->pipe->output_h, raster, nbytes, npixels, &nraster);
+					}
 					if (error == 0) {
 						*outraster += nraster;
 					} else {
@@ -145,26 +582,163 @@ eps_process_reverse (RASTERPIPE reverse, char* raster_p, int raster_bytes, int p
 	return error;
 }
 
+int
+eps_process_reverse_band (RASTERPIPE reverse, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	EpsReverse * lp_reverse = (EpsReverse *) reverse;
+	EpsRasterExtent extent;
+	int i;
+
+	*outraster = 0;
+	if (lp_reverse == NULL || lp_reverse->init_data == NULL) {
+		return 1;
+	}
+
+	for (i = 0; i < lines; i++) {
+		eps_raster_pipe_extent(lp_reverse->init_data->pipe, i, pixel_num, &extent);
+		if (reverse_store_raster(lp_reverse, band + i * stride, raster_bytes, pixel_num, 1, &extent)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int
+eps_process_reverse_repeat (RASTERPIPE reverse, char * raster_p, int raster_bytes, int pixel_num, int repeat, int * outraster)
+{
+	EpsReverse * lp_reverse = (EpsReverse *) reverse;
+	EpsRasterExtent extent;
+
+	*outraster = 0;
+	if (lp_reverse == NULL || lp_reverse->init_data == NULL) {
+		return 1;
+	}
+
+	eps_raster_pipe_extent(lp_reverse->init_data->pipe, 0, pixel_num, &extent);
+
+	return reverse_store_raster(lp_reverse, raster_p, raster_bytes, pixel_num, repeat, &extent);
+}
+
+/* the spans are written straight into the slot, but for the white runs */
+int
+eps_process_reverse_span (RASTERPIPE reverse, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsReverse * lp_reverse = (EpsReverse *) reverse;
+	EpsReverseOpt * lp_data = NULL;
+	EpsRasterSpanLine stored = *line;
+	EpsRasterExtent * extent;
+	int npixels;
+	int slot;
+
+	*outraster = 0;
+	if (lp_reverse == NULL || (lp_data = lp_reverse->init_data) == NULL) {
+		return 1;
+	}
+
+	if (lp_data->mirror) {
+		if (eps_span_reserve(&lp_reverse->spans, &lp_reverse->span_size, line->num_span)) {
+			debuglog(("REVERSE MEMALLOC ERROR %d spans", line->num_span));
+			return 1;
+		}
+		memcpy(lp_reverse->spans, line->spans, sizeof(EpsRasterSpan) * line->num_span);
+		eps_span_mirror(lp_reverse->spans, line->num_span);
+		stored.spans = lp_reverse->spans;
+	}
+
+	slot = reverse_take_slot(lp_reverse, line->repeat);
+	if (slot >= 0) {
+		npixels = lp_data->bytes_per_raster / lp_data->bytes_per_pixel;
+		if (npixels > line->pixels) {
+			npixels = line->pixels;
+		}
+		eps_span_expand(reverse_fill_slot(lp_reverse, slot), &stored, 0, npixels, 1);
+
+		extent = &lp_reverse->extents[slot];
+		eps_span_extent(&stored, extent);
+		if (extent->right > npixels) {
+			extent->right = npixels;
+		}
+		if (EPS_RASTER_EXTENT_BLANK(extent)) {
+			extent->left = 0;
+			extent->right = 0;
+		}
+		return reverse_slot_stored(lp_reverse, slot);
+	}
+
+	return 0;
+}
+
+/* lines which were not stored have to stay blank, so only the extents
+   of the stored ones are cleared */
+int
+eps_reset_reverse (RASTERPIPE reverse)
+{
+	EpsReverse * lp_reverse = (EpsReverse *) reverse;
+	EpsReverseOpt * lp_data = lp_reverse->init_data;
+	int i, n;
+
+	if (lp_reverse->rasters == NULL && lp_reverse->line == NULL) {
+		return 1;
+	}
+
+	/* slots inside a run were never written */
+	for (i = (lp_reverse->current < 0) ? 0 : lp_reverse->current + 1; i < lp_data->num_raster; i += n) {
+		if (!EPS_RASTER_EXTENT_BLANK(&lp_reverse->extents[i])) {
+			if (lp_reverse->rasters) {
+				memset(lp_reverse->rasters[i] + lp_reverse->extents[i].left * lp_data->bytes_per_pixel, 0xFF,
+					(lp_reverse->extents[i].right - lp_reverse->extents[i].left) * lp_data->bytes_per_pixel);
+			} else {
+				lp_reverse->codes[i].length = 0;
+			}
+			lp_reverse->extents[i].left = 0;
+			lp_reverse->extents[i].right = 0;
+		}
+		n = lp_reverse->repeats[i];
+		lp_reverse->repeats[i] = 1;
+	}
+
+	lp_reverse->current = lp_data->num_raster - 1;
+	lp_reverse->flushed = 0;
+	lp_reverse->raster_index = 0;
+	lp_reverse->arena_used = 0;
+
+	return 0;
+}
+
 int
 eps_free_reverse (RASTERPIPE reverse)
 {
 	EpsReverse * lp_reverse = (EpsReverse *) reverse;
-	char ** rasters =  NULL;
 
 	if (lp_reverse) {
 		if (lp_reverse->init_data) {
-			rasters =  lp_reverse->rasters;
-			if (rasters) {
-				int i;
-				for (i = 0; i < lp_reverse->init_data->num_raster; i++) {
-					if (rasters[i]) {
-						eps_free(rasters[i]);
-					}
-				}
-				eps_free(lp_reverse->rasters);
-			}
+			/* the fetch pool may still hold the stored lines */
+			eps_raster_buffer_release(lp_reverse->init_data->pipe->shared);
+			lp_reverse->init_data->pipe->shared = NULL;
 			eps_free(lp_reverse->init_data);
 		}
+		if (lp_reverse->repeats) {
+			eps_free(lp_reverse->repeats);
+		}
+		if (lp_reverse->extents) {
+			eps_free(lp_reverse->extents);
+		}
+		if (lp_reverse->filled) {
+			eps_free(lp_reverse->filled);
+		}
+		if (lp_reverse->spans) {
+			eps_free(lp_reverse->spans);
+		}
+		if (lp_reverse->line) {
+			eps_free(lp_reverse->line);
+		}
+		if (lp_reverse->arena) {
+			eps_free(lp_reverse->arena);
+		}
+		if (lp_reverse->codes) {
+			eps_free(lp_reverse->codes);
+		}
 		eps_free(lp_reverse);
 	}
 
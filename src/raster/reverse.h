@@ -37,10 +37,17 @@ typedef struct EpsReverseOpt {
 	int bytes_per_raster;
 	int top_margin;
 	int num_raster;
+	int mirror;		/* lines are stored mirrored */
+	size_t memory_budget;	/* bytes of lines kept in memory, a larger page goes to a file. 0 for no limit */
+	int compress;		/* lines are kept PackBits coded, and decoded as they are flushed */
 } EpsReverseOpt;
 
 int eps_init_reverse (RASTERPIPE *, PIPEOPT);
 int eps_process_reverse (RASTERPIPE, char *, int, int, int *);
+int eps_process_reverse_band (RASTERPIPE, char *, int, int, int, int, int *);
+int eps_process_reverse_repeat (RASTERPIPE, char *, int, int, int, int *);
+int eps_process_reverse_span (RASTERPIPE, const EpsRasterSpanLine *, int *);
+int eps_reset_reverse (RASTERPIPE);
 int eps_free_reverse (RASTERPIPE);
 
 
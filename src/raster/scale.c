@@ -22,11 +22,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "memory.h"
 #include "scale.h"
+#include "mirror.h"
+#include "span.h"
 
 typedef int (* ScaleMethodStart) (SCALE);
 typedef int (* ScaleMethodRasterOut) (SCALE, char*, int, int, int*);
+typedef int (* ScaleMethodBandOut) (SCALE, char*, int, int, int, int, int*);
+typedef int (* ScaleMethodRepeatOut) (SCALE, char*, int, int, int, int*);
+typedef int (* ScaleMethodSpanOut) (SCALE, const EpsRasterSpanLine *, int*);
+typedef int (* ScaleMethodFlush) (SCALE, int*);
+typedef int (* ScaleMethodReset) (SCALE);
 typedef int (* ScaleMethodEnd) (SCALE);
 
 typedef struct EpsScale {
@@ -38,126 +46,1561 @@ typedef struct EpsScale {
 	void * method_data;
 	ScaleMethodStart start;
 	ScaleMethodRasterOut rasterout;
+	ScaleMethodBandOut bandout;
+	ScaleMethodRepeatOut repeatout;
+	ScaleMethodSpanOut spanout;
+	ScaleMethodFlush flush;
+	ScaleMethodReset reset;
 	ScaleMethodEnd end;
 } EpsScale;
 
 //  Scaling not effected just as original pixels returned.
+static int scale_kernel_unchanged (PIPEOBJ, int, char *, char *, int, int, EpsRasterExtent *);
+
+static int
+scale_start_unchanged (SCALE scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+
+	lp_scale->init_data->pipe->pipe_kernel = scale_kernel_unchanged;
+
+	return 0;
+}
+
+static int
+scale_rasterout_unchanged (SCALE scale, char * raster, int bytes, int pixels, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+
+	int nraster = 0;
+	int error;
+
+	EPS_RASTER_PASS_EXTENT(lp_data->pipe, lp_data->pipe->extent);
+	error = lp_data->pipe->output(lp_data->pipe->output_h, raster, bytes, pixels, &nraster);
+	if (error == 0) {
+		*outraster = nraster;
+	}
+
+	return error;
+}
+
+static int
+scale_bandout_unchanged (SCALE scale, char * band, int stride, int lines, int bytes, int pixels, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+
+	EPS_RASTER_PASS_EXTENT(lp_data->pipe, lp_data->pipe->extent);
+	return lp_data->pipe->output_band(lp_data->pipe->output_band_h, band, stride, lines, bytes, pixels, outraster);
+}
+
+static int
+scale_repeatout_unchanged (SCALE scale, char * raster, int bytes, int pixels, int repeat, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+
+	EPS_RASTER_PASS_EXTENT(lp_data->pipe, lp_data->pipe->extent);
+	return lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, raster, bytes, pixels, repeat, outraster);
+}
+
+static int
+scale_spanout_unchanged (SCALE scale, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+
+	return lp_data->pipe->output_span(lp_data->pipe->output_span_h, line, outraster);
+}
+
+static int
+scale_flush_unchanged (SCALE scale, int * outraster)
+{
+	*outraster = 0;
+
+	return 0;
+}
+
+static int
+scale_kernel_unchanged (PIPEOBJ scale, int index, char * src, char * dst, int bytes, int pixels, EpsRasterExtent * extent)
+{
+	return 0;
+}
+
+static int
+scale_reset_unchanged (SCALE scale)
+{
+	return 0;
+}
+
+static int
+scale_end_unchanged (SCALE scale)
+{
+	return 0;
+}
+
+// Crop or pad to the printable area when the source is off by a few
+// pixels only. A wide enough line goes on as it is, cut to the printable
+// width; a narrow one is copied and padded white. Lines past the
+// printable height are dropped, a short page is left short as a scaled
+// one is.
+typedef struct _MethodFit {
+	int pixels;		/* printable width */
+	int bytes;
+	int lines;		/* printable height */
+	int y_index;		/* next source line */
+	char * band_p;		/* EPS_RASTER_BAND_LINES padded lines */
+	EpsRasterSpan * spans;
+	int span_size;
+} MethodFit;
+
+static int scale_lines_fit (PIPEOBJ);
+static int scale_drops_fit (PIPEOBJ, char *, int);
+static int scale_kernel_fit (PIPEOBJ, int, char *, char *, int, int, EpsRasterExtent *);
+
+static int
+scale_start_fit (SCALE scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodFit * p = (MethodFit *) eps_malloc(sizeof(MethodFit));
+
+	if (p == NULL) {
+		return 1;
+	}
+	lp_scale->method_data = (void *) p;
+
+	p->pixels = lp_data->prt_print_area_x;
+	p->bytes = p->pixels * lp_data->bytes_per_pixel;
+	p->lines = lp_data->prt_print_area_y;
+	p->y_index = 0;
+	p->spans = NULL;
+	p->span_size = 0;
+	p->band_p = (char *) eps_malloc(p->bytes * EPS_RASTER_BAND_LINES);
+	if (p->band_p == NULL) {
+		return 1;
+	}
+
+	/* a narrow page is always padded into band_p, a wide one is passed
+	   through as it came */
+	if (lp_data->src_print_area_x < lp_data->prt_print_area_x) {
+		lp_data->pipe->output_ownership = EPS_RASTER_LINE_WRITABLE;
+	}
+
+	lp_data->pipe->pipe_lines = scale_lines_fit;
+	lp_data->pipe->pipe_drops = scale_drops_fit;
+	lp_data->pipe->pipe_kernel = scale_kernel_fit;
+	lp_data->pipe->kernel_bytes = p->bytes;
+	lp_data->pipe->kernel_pixels = p->pixels;
+
+	debuglog(("scale fit : %d x %d -> %d x %d", lp_data->src_print_area_x, lp_data->src_print_area_y, p->pixels, p->lines));
+
+	return 0;
+}
+
+/* lines of repeat source lines from the next one on left on the page */
+static int
+scale_fit_lines (MethodFit * lp_method, int repeat)
+{
+	int room = lp_method->lines - lp_method->y_index;
+
+	lp_method->y_index += repeat;
+
+	return (room <= 0) ? 0 : (repeat < room) ? repeat : room;
+}
+
+/* the line cut or padded to the printable width, raster itself when it
+   is wide enough */
+static char *
+scale_fit_line (MethodFit * lp_method, char * dst, char * raster, int pixels, int bpp)
+{
+	if (pixels >= lp_method->pixels) {
+		return raster;
+	}
+
+	memcpy(dst, raster, pixels * bpp);
+	memset(dst + pixels * bpp, 0xff, lp_method->bytes - pixels * bpp);
+
+	return dst;
+}
+
+static int
+scale_lines_fit (PIPEOBJ scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+
+	return scale_fit_lines((MethodFit *) lp_scale->method_data, 1);
+}
+
+static int
+scale_drops_fit (PIPEOBJ scale, char * drop, int lines)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodFit * lp_method = (MethodFit *) lp_scale->method_data;
+	int i;
+
+	for (i = 0; i < lines; i++) {
+		drop[i] = (i >= lp_method->lines) ? 1 : 0;
+	}
+
+	return 0;
+}
+
+static int
+scale_kernel_fit (PIPEOBJ scale, int index, char * src, char * dst, int bytes, int pixels, EpsRasterExtent * extent)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodFit * lp_method = (MethodFit *) lp_scale->method_data;
+	int bpp = lp_scale->init_data->bytes_per_pixel;
+
+	if (pixels > lp_method->pixels) {
+		pixels = lp_method->pixels;
+	}
+	memcpy(dst, src, pixels * bpp);
+	memset(dst + pixels * bpp, 0xff, lp_method->bytes - pixels * bpp);
+	if (extent->right > pixels) {
+		extent->right = pixels;
+	}
+
+	return 0;
+}
+
+static int
+scale_rasterout_fit (SCALE scale, char * raster, int bytes, int pixels, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodFit * lp_method = (MethodFit *) lp_scale->method_data;
+
+	*outraster = 0;
+	if (scale_fit_lines(lp_method, 1) == 0) {
+		return 0;
+	}
+
+	raster = scale_fit_line(lp_method, lp_method->band_p, raster, pixels, lp_data->bytes_per_pixel);
+	EPS_RASTER_PASS_EXTENT(lp_data->pipe, lp_data->pipe->extent);
+
+	return lp_data->pipe->output(lp_data->pipe->output_h, raster, lp_method->bytes, lp_method->pixels, outraster);
+}
+
+static int
+scale_bandout_fit (SCALE scale, char * band, int stride, int lines, int bytes, int pixels, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodFit * lp_method = (MethodFit *) lp_scale->method_data;
+	int bpp = lp_data->bytes_per_pixel;
+	int i;
+
+	*outraster = 0;
+	lines = scale_fit_lines(lp_method, lines);
+	if (lines == 0) {
+		return 0;
+	}
+
+	if (pixels < lp_method->pixels) {
+		for (i = 0; i < lines; i++) {
+			scale_fit_line(lp_method, lp_method->band_p + i * lp_method->bytes, band + i * stride, pixels, bpp);
+		}
+		band = lp_method->band_p;
+		stride = lp_method->bytes;
+	}
+	EPS_RASTER_PASS_EXTENT(lp_data->pipe, lp_data->pipe->extent);
+
+	return lp_data->pipe->output_band(lp_data->pipe->output_band_h, band, stride, lines, lp_method->bytes, lp_method->pixels, outraster);
+}
+
+static int
+scale_repeatout_fit (SCALE scale, char * raster, int bytes, int pixels, int repeat, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodFit * lp_method = (MethodFit *) lp_scale->method_data;
+
+	*outraster = 0;
+	repeat = scale_fit_lines(lp_method, repeat);
+	if (repeat == 0) {
+		return 0;
+	}
+
+	raster = scale_fit_line(lp_method, lp_method->band_p, raster, pixels, lp_data->bytes_per_pixel);
+	EPS_RASTER_PASS_EXTENT(lp_data->pipe, lp_data->pipe->extent);
+
+	return lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, raster, lp_method->bytes, lp_method->pixels, repeat, outraster);
+}
+
+/* the spans are cut at the printable width, or a white one is added */
+static int
+scale_spanout_fit (SCALE scale, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodFit * lp_method = (MethodFit *) lp_scale->method_data;
+	EpsRasterSpanLine fitted = *line;
+
+	*outraster = 0;
+	fitted.repeat = scale_fit_lines(lp_method, line->repeat);
+	if (fitted.repeat == 0) {
+		return 0;
+	}
+
+	if (line->pixels != lp_method->pixels) {
+		if (eps_span_reserve(&lp_method->spans, &lp_method->span_size, line->num_span + 1)) {
+			debuglog(("SCALE MEMALLOC ERROR %d spans", line->num_span + 1));
+			return 1;
+		}
+		fitted.spans = lp_method->spans;
+		fitted.num_span = eps_span_clip(lp_method->spans, line->spans, line->num_span, 0, lp_method->pixels);
+		if (line->pixels < lp_method->pixels) {
+			eps_span_white(&lp_method->spans[fitted.num_span++], lp_method->pixels - line->pixels);
+		}
+		fitted.pixels = lp_method->pixels;
+	}
+
+	return lp_data->pipe->output_span(lp_data->pipe->output_span_h, &fitted, outraster);
+}
+
+static int
+scale_flush_fit (SCALE scale, int * outraster)
+{
+	*outraster = 0;
+
+	return 0;
+}
+
+static int
+scale_reset_fit (SCALE scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodFit * lp_method = (MethodFit *) lp_scale->method_data;
+
+	lp_method->y_index = 0;
+
+	return 0;
+}
+
+static int
+scale_end_fit (SCALE scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodFit * lp_method = (MethodFit *) lp_scale->method_data;
+
+	if (lp_method == NULL) {
+		return 0;
+	}
+
+	if (lp_method->band_p) {
+		eps_free(lp_method->band_p);
+	}
+
+	if (lp_method->spans) {
+		eps_free(lp_method->spans);
+	}
+
+	eps_free(lp_method);
+
+	return 0;
+}
+
+/* scale is num / den, the smaller of the x and y ones */
+static void
+scale_ratio (EpsScaleOpt * lp_data, int * num, int * den)
+{
+	if ((long long) lp_data->prt_print_area_x * lp_data->src_print_area_y
+			< (long long) lp_data->prt_print_area_y * lp_data->src_print_area_x) {
+		*num = lp_data->prt_print_area_x;
+		*den = lp_data->src_print_area_x;
+	} else {
+		*num = lp_data->prt_print_area_y;
+		*den = lp_data->src_print_area_y;
+	}
+}
+
+// Kernels for exact ratios, made for each common pixel size so that the
+// pixel copies are unrolled. They take count groups of pixels: a source
+// pixel to n scaled pixels when enlarging, n source pixels to a scaled
+// pixel when reducing.
+typedef void (* ScaleRatioKernel) (char *, const char *, int, int);
+
+enum {
+	SCALE_RATIO_SAME = 0,
+	SCALE_RATIO_DOUBLE,
+	SCALE_RATIO_ENLARGE,
+	SCALE_RATIO_HALVE,
+	SCALE_RATIO_REDUCE,
+	SCALE_RATIO_AVERAGE2,
+	SCALE_RATIO_AVERAGE,
+	SCALE_RATIO_KINDS
+};
+
+#define SCALE_COPY_1(d, s)	((d)[0] = (s)[0])
+#define SCALE_COPY_3(d, s)	((d)[0] = (s)[0], (d)[1] = (s)[1], (d)[2] = (s)[2])
+#define SCALE_COPY_4(d, s)	memcpy((d), (s), 4)
+
+/* reducing by nearest takes the last source pixel of a group, as the
+   scaled pixel positions do */
+#define SCALE_RATIO_KERNELS(bpp)						\
+static void								\
+scale_same_ ## bpp (char * d, const char * s, int count, int n)		\
+{									\
+	memcpy(d, s, count * bpp);					\
+}									\
+static void								\
+scale_double_ ## bpp (char * d, const char * s, int count, int n)	\
+{									\
+	for (; count > 0; count--, s += bpp, d += 2 * bpp) {		\
+		SCALE_COPY_ ## bpp(d, s);				\
+		SCALE_COPY_ ## bpp(d + bpp, s);				\
+	}								\
+}									\
+static void								\
+scale_enlarge_ ## bpp (char * d, const char * s, int count, int n)	\
+{									\
+	int k;								\
+	for (; count > 0; count--, s += bpp) {				\
+		for (k = 0; k < n; k++, d += bpp) {			\
+			SCALE_COPY_ ## bpp(d, s);			\
+		}							\
+	}								\
+}									\
+static void								\
+scale_halve_ ## bpp (char * d, const char * s, int count, int n)	\
+{									\
+	for (s += bpp; count > 0; count--, s += 2 * bpp, d += bpp) {	\
+		SCALE_COPY_ ## bpp(d, s);				\
+	}								\
+}									\
+static void								\
+scale_reduce_ ## bpp (char * d, const char * s, int count, int n)	\
+{									\
+	for (s += (n - 1) * bpp; count > 0; count--, s += n * bpp, d += bpp) { \
+		SCALE_COPY_ ## bpp(d, s);				\
+	}								\
+}									\
+static void								\
+scale_average2_ ## bpp (char * d, const char * s, int count, int n)	\
+{									\
+	const unsigned char * u = (const unsigned char *) s;		\
+	unsigned char * v = (unsigned char *) d;			\
+	int c;								\
+	for (; count > 0; count--, u += 2 * bpp, v += bpp) {		\
+		for (c = 0; c < bpp; c++) {				\
+			v[c] = (unsigned char) ((u[c] + u[bpp + c] + 1) >> 1); \
+		}							\
+	}								\
+}									\
+static void								\
+scale_average_ ## bpp (char * d, const char * s, int count, int n)	\
+{									\
+	const unsigned char * u = (const unsigned char *) s;		\
+	unsigned char * v = (unsigned char *) d;			\
+	int c, k, sum;							\
+	for (; count > 0; count--, u += n * bpp, v += bpp) {		\
+		for (c = 0; c < bpp; c++) {				\
+			for (sum = n / 2, k = 0; k < n; k++) {		\
+				sum += u[k * bpp + c];			\
+			}						\
+			v[c] = (unsigned char) (sum / n);		\
+		}							\
+	}								\
+}
+
+SCALE_RATIO_KERNELS(1)
+SCALE_RATIO_KERNELS(3)
+SCALE_RATIO_KERNELS(4)
+
+#define SCALE_RATIO_TABLE(bpp) { scale_same_ ## bpp, scale_double_ ## bpp, scale_enlarge_ ## bpp, \
+	scale_halve_ ## bpp, scale_reduce_ ## bpp, scale_average2_ ## bpp, scale_average_ ## bpp }
+
+static const ScaleRatioKernel scale_ratio_table[3][SCALE_RATIO_KINDS] = {
+	SCALE_RATIO_TABLE(1),
+	SCALE_RATIO_TABLE(3),
+	SCALE_RATIO_TABLE(4),
+};
+
+/* kernel of kind for bpp, NULL for a pixel size without kernels */
+static ScaleRatioKernel
+scale_ratio_kernel (int bpp, int kind)
+{
+	switch (bpp) {
+	case 1:
+		return scale_ratio_table[0][kind];
+	case 3:
+		return scale_ratio_table[1][kind];
+	case 4:
+		return scale_ratio_table[2][kind];
+	default:
+		return NULL;
+	}
+}
+
+// Use nearest neighbour interpolation
+typedef struct _MethodNearest {
+	int num;		/* scale is num / den, the smaller of x and y */
+	int den;
+	char * scaled_p;
+	int scaled_bytes;
+	int scaled_pixels;
+	int mirror;
+	char * band_p;		/* EPS_RASTER_BAND_LINES scaled lines */
+	EpsRasterExtent band_extent[EPS_RASTER_BAND_LINES];
+	int band_lines;
+	int * x_start;		/* first scaled pixel of each source pixel */
+	int * x_src;		/* source pixel of each scaled pixel */
+	int up;			/* num / den when it is a whole number */
+	int down;		/* den / num when it is a whole number */
+	ScaleRatioKernel ratio_kernel;
+	int x_pixels;
+	int * y_lines;		/* lines each source line of the page is scaled to */
+	int y_pixels;
+	int y_index;		/* next source line */
+	EpsRasterSpan * spans;	/* scaled spans */
+	int span_size;
+	char * line_p;		/* span line of an unexpected width, as bytes */
+	int line_bytes;
+} MethodNearest;
+
+static int scale_nearest_pos (MethodNearest *, int);
+static int scale_lines_nearest (PIPEOBJ);
+static int scale_drops_nearest (PIPEOBJ, char *, int);
+static int scale_kernel_nearest (PIPEOBJ, int, char *, char *, int, int, EpsRasterExtent *);
+
+static int
+scale_start_nearest (SCALE scale)
+{
+	int eps_error = 0;
+
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodNearest * p = (MethodNearest *) eps_malloc(sizeof(MethodNearest));
+	int i, o;
+
+	if (p) {
+		scale_ratio(lp_data, &p->num, &p->den);
+		p->x_pixels = lp_data->src_print_area_x;
+		p->y_pixels = lp_data->src_print_area_y;
+		p->y_index = 0;
+		p->scaled_pixels = scale_nearest_pos(p, p->x_pixels);
+		p->scaled_bytes = p->scaled_pixels * lp_data->bytes_per_pixel;
+		p->mirror = lp_data->mirror;
+		p->scaled_p = (char *) eps_malloc(p->scaled_bytes);
+		if (p->scaled_p == NULL) {
+			eps_error = 1;
+		}
+		p->band_lines = 0;
+		p->spans = NULL;
+		p->span_size = 0;
+		p->line_p = NULL;
+		p->line_bytes = 0;
+		p->band_p = (char *) eps_malloc(p->scaled_bytes * EPS_RASTER_BAND_LINES);
+		if (p->band_p == NULL) {
+			eps_error = 1;
+		}
+
+		/* the steps of a line and of a page are worked out once */
+		p->x_start = (int *) eps_malloc(sizeof(int) * (p->x_pixels + 1));
+		p->x_src = (int *) eps_malloc(sizeof(int) * (p->scaled_pixels + 1));
+		p->y_lines = (int *) eps_malloc(sizeof(int) * (p->y_pixels + 1));
+		if (p->x_start && p->x_src && p->y_lines) {
+			for (i = 0; i <= p->x_pixels; i++) {
+				p->x_start[i] = scale_nearest_pos(p, i);
+			}
+			for (i = 0; i < p->x_pixels; i++) {
+				for (o = p->x_start[i]; o < p->x_start[i + 1]; o++) {
+					p->x_src[o] = i;
+				}
+			}
+			for (i = 0; i < p->y_pixels; i++) {
+				p->y_lines[i] = scale_nearest_pos(p, i + 1) - scale_nearest_pos(p, i);
+			}
+		} else {
+			eps_error = 1;
+		}
+
+		/* exact ratios go through kernels made for them */
+		p->up = (p->num % p->den == 0) ? p->num / p->den : 0;
+		p->down = (p->den % p->num == 0) ? p->den / p->num : 0;
+		if (p->up == 1) {
+			p->ratio_kernel = scale_ratio_kernel(lp_data->bytes_per_pixel, SCALE_RATIO_SAME);
+		} else if (p->up == 2) {
+			p->ratio_kernel = scale_ratio_kernel(lp_data->bytes_per_pixel, SCALE_RATIO_DOUBLE);
+		} else if (p->up) {
+			p->ratio_kernel = scale_ratio_kernel(lp_data->bytes_per_pixel, SCALE_RATIO_ENLARGE);
+		} else if (p->down == 2) {
+			p->ratio_kernel = scale_ratio_kernel(lp_data->bytes_per_pixel, SCALE_RATIO_HALVE);
+		} else if (p->down) {
+			p->ratio_kernel = scale_ratio_kernel(lp_data->bytes_per_pixel, SCALE_RATIO_REDUCE);
+		} else {
+			p->ratio_kernel = NULL;
+		}
+
+		/* an enlarged line is emitted several times from the same buffer */
+		lp_data->pipe->output_ownership = (p->num > p->den) ? EPS_RASTER_LINE_BORROWED : EPS_RASTER_LINE_WRITABLE;
+
+		lp_data->pipe->pipe_lines = scale_lines_nearest;
+		lp_data->pipe->pipe_drops = scale_drops_nearest;
+		lp_data->pipe->pipe_kernel = scale_kernel_nearest;
+		lp_data->pipe->kernel_bytes = p->scaled_bytes;
+		lp_data->pipe->kernel_pixels = p->scaled_pixels;
+
+		lp_scale->method_data = (void *) p;
+
+	} else {
+		eps_error = 1;
+	}
+
+	return eps_error;
+}
+
+/* scaled position of source position i, in integers so that long lines
+   do not drift */
+static int
+scale_nearest_pos (MethodNearest * lp_method, int i)
+{
+	return (int) (((long long) i * lp_method->num) / lp_method->den);
+}
+
+/* number of lines source line index is scaled to */
+static int
+scale_nearest_count (MethodNearest * lp_method, int index)
+{
+	if (index < lp_method->y_pixels) {
+		return lp_method->y_lines[index];
+	}
+
+	return scale_nearest_pos(lp_method, index + 1) - scale_nearest_pos(lp_method, index);
+}
+
+/* number of lines the next source line is scaled to */
+static int
+scale_nearest_lines (MethodNearest * lp_method)
+{
+	return scale_nearest_count(lp_method, lp_method->y_index++);
+}
+
+/* writes scaled pixels [left, right) from their source pixels, from the
+   right end when mirrored */
+static void
+scale_nearest_gather (MethodNearest * lp_method, char * scaled_p, const char * raster, int bpp, int left, int right)
+{
+	const int * x_src = lp_method->x_src;
+	int step = (lp_method->mirror) ? -bpp : bpp;
+	char * d = (lp_method->mirror) ? scaled_p + (lp_method->scaled_pixels - 1 - left) * bpp : scaled_p + left * bpp;
+	const char * s;
+	int o;
+
+	switch (bpp) {
+	case 1:
+		for (o = left; o < right; o++, d += step) {
+			*d = raster[x_src[o]];
+		}
+		break;
+	case 3:
+		for (o = left; o < right; o++, d += step) {
+			s = raster + x_src[o] * 3;
+			d[0] = s[0];
+			d[1] = s[1];
+			d[2] = s[2];
+		}
+		break;
+	case 4:
+		for (o = left; o < right; o++, d += step) {
+			memcpy(d, raster + x_src[o] * 4, 4);
+		}
+		break;
+	default:
+		for (o = left; o < right; o++, d += step) {
+			memcpy(d, raster + x_src[o] * bpp, bpp);
+		}
+		break;
+	}
+}
+
+/* writes from the right end when mirrored, so the line is scaled and
+   mirrored in one pass. only the extent of the source line is scaled, the
+   margins are filled white, and extent is updated to that of the scaled
+   line. pixels past the page width scale to nothing. */
+static void
+scale_nearest_raster (MethodNearest * lp_method, char * scaled_p, char * raster, int pixels, int bpp, EpsRasterExtent * extent)
+{
+	int room = lp_method->scaled_pixels;
+	int left, right;
+
+	if (pixels > lp_method->x_pixels) {
+		pixels = lp_method->x_pixels;
+	}
+	if (extent->right > pixels) {
+		extent->right = pixels;
+	}
+
+	if (EPS_RASTER_EXTENT_BLANK(extent)) {
+		memset(scaled_p, 0xff, lp_method->scaled_bytes);
+		extent->left = 0;
+		extent->right = 0;
+		return;
+	}
+
+	left = lp_method->x_start[extent->left];
+	right = lp_method->x_start[extent->right];
+	extent->left = (lp_method->mirror) ? room - right : left;
+	extent->right = (lp_method->mirror) ? room - left : right;
+
+	memset(scaled_p, 0xff, extent->left * bpp);
+	if (lp_method->ratio_kernel && !lp_method->mirror) {
+		/* left and right are whole groups of an exact ratio */
+		if (lp_method->up) {
+			lp_method->ratio_kernel(scaled_p + left * bpp, raster + (left / lp_method->up) * bpp, (right - left) / lp_method->up, lp_method->up);
+		} else {
+			lp_method->ratio_kernel(scaled_p + left * bpp, raster + left * lp_method->down * bpp, right - left, lp_method->down);
+		}
+	} else {
+		scale_nearest_gather(lp_method, scaled_p, raster, bpp, left, right);
+	}
+	memset(scaled_p + extent->right * bpp, 0xff, (room - extent->right) * bpp);
+}
+
+static int
+scale_lines_nearest (PIPEOBJ scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+
+	return scale_nearest_lines((MethodNearest *) lp_scale->method_data);
+}
+
+/* marks the source lines of a page which are scaled to no line at all */
+static int
+scale_drops_nearest (PIPEOBJ scale, char * drop, int lines)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+	int i;
+
+	for (i = 0; i < lines; i++) {
+		drop[i] = (scale_nearest_count(lp_method, i) == 0) ? 1 : 0;
+	}
+
+	return 0;
+}
+
+static int
+scale_kernel_nearest (PIPEOBJ scale, int index, char * src, char * dst, int bytes, int pixels, EpsRasterExtent * extent)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+
+	scale_nearest_raster((MethodNearest *) lp_scale->method_data, dst, src, pixels, lp_scale->init_data->bytes_per_pixel, extent);
+
+	return 0;
+}
+
+static int
+scale_rasterout_nearest (SCALE scale, char * raster, int bytes, int pixels, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+
+	char * scaled_p = lp_method->scaled_p;
+	int scaled_bytes = lp_method->scaled_bytes;
+	int scaled_pixels = lp_method->scaled_pixels;
+	int printable_lines = scale_nearest_lines(lp_method);
+	EpsRasterExtent extent;
+
+	if (printable_lines > 0) {
+		eps_raster_pipe_extent(lp_data->pipe, 0, pixels, &extent);
+		scale_nearest_raster(lp_method, scaled_p, raster, pixels, lp_data->bytes_per_pixel, &extent);
+		EPS_RASTER_PASS_EXTENT(lp_data->pipe, &extent);
+	}
+
+	int eps_error = 0;
+	int nraster = 0;
+	*outraster = 0;
+	if (printable_lines == 1) {
+		eps_error = lp_data->pipe->output(lp_data->pipe->output_h, scaled_p, scaled_bytes, scaled_pixels, &nraster);
+		*outraster = nraster;
+	} else if (printable_lines > 1) {
+		eps_error = lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, scaled_p, scaled_bytes, scaled_pixels, printable_lines, &nraster);
+		*outraster = nraster;
+	}
+
+	return eps_error;
+}
+
+static int
+scale_flush_band_nearest (EpsScale * lp_scale, int * outraster)
+{
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+	int eps_error = 0;
+	int nraster = 0;
+
+	if (lp_method->band_lines > 0) {
+		EPS_RASTER_PASS_EXTENT(lp_data->pipe, lp_method->band_extent);
+		eps_error = lp_data->pipe->output_band(lp_data->pipe->output_band_h, lp_method->band_p, lp_method->scaled_bytes,
+			lp_method->band_lines, lp_method->scaled_bytes, lp_method->scaled_pixels, &nraster);
+		lp_method->band_lines = 0;
+		*outraster += nraster;
+	}
+
+	return eps_error;
+}
+
+static int
+scale_bandout_nearest (SCALE scale, char * band, int stride, int lines, int bytes, int pixels, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+	int scaled_bytes = lp_method->scaled_bytes;
+	int printable_lines;
+	int eps_error = 0;
+	int nraster = 0;
+	EpsRasterExtent extent;
+	int i;
+
+	*outraster = 0;
+	for (i = 0; i < lines && eps_error == 0; i++) {
+		printable_lines = scale_nearest_lines(lp_method);
+		if (printable_lines == 1) {
+			if (lp_method->band_lines == EPS_RASTER_BAND_LINES) {
+				eps_error = scale_flush_band_nearest(lp_scale, outraster);
+			}
+			eps_raster_pipe_extent(lp_data->pipe, i, pixels, &lp_method->band_extent[lp_method->band_lines]);
+			scale_nearest_raster(lp_method, lp_method->band_p + lp_method->band_lines * scaled_bytes, band + i * stride, pixels, lp_data->bytes_per_pixel, &lp_method->band_extent[lp_method->band_lines]);
+			lp_method->band_lines++;
+		} else if (printable_lines > 1) {
+			/* the lines gathered so far go out first */
+			eps_error = scale_flush_band_nearest(lp_scale, outraster);
+			if (eps_error == 0) {
+				eps_raster_pipe_extent(lp_data->pipe, i, pixels, &extent);
+				scale_nearest_raster(lp_method, lp_method->scaled_p, band + i * stride, pixels, lp_data->bytes_per_pixel, &extent);
+				EPS_RASTER_PASS_EXTENT(lp_data->pipe, &extent);
+				eps_error = lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, lp_method->scaled_p, scaled_bytes, lp_method->scaled_pixels, printable_lines, &nraster);
+				*outraster += nraster;
+			}
+		}
+	}
+
+	if (eps_error == 0) {
+		eps_error = scale_flush_band_nearest(lp_scale, outraster);
+	}
+
+	return eps_error;
+}
+
+/* scales the line once and sends it as printable_lines lines */
+static int
+scale_send_nearest (EpsScale * lp_scale, char * raster, int pixels, int printable_lines, EpsRasterExtent * extent, int * outraster)
+{
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+	int eps_error = 0;
+	int nraster = 0;
+
+	*outraster = 0;
+	if (printable_lines > 0) {
+		scale_nearest_raster(lp_method, lp_method->scaled_p, raster, pixels, lp_data->bytes_per_pixel, extent);
+		EPS_RASTER_PASS_EXTENT(lp_data->pipe, extent);
+		if (printable_lines == 1) {
+			eps_error = lp_data->pipe->output(lp_data->pipe->output_h, lp_method->scaled_p, lp_method->scaled_bytes, lp_method->scaled_pixels, &nraster);
+		} else {
+			eps_error = lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, lp_method->scaled_p, lp_method->scaled_bytes, lp_method->scaled_pixels, printable_lines, &nraster);
+		}
+		*outraster = nraster;
+	}
+
+	return eps_error;
+}
+
+/* the line is scaled once, to the lines of all repeat source lines */
+static int
+scale_repeatout_nearest (SCALE scale, char * raster, int bytes, int pixels, int repeat, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+	int printable_lines = 0;
+	EpsRasterExtent extent;
+	int i;
+
+	for (i = 0; i < repeat; i++) {
+		printable_lines += scale_nearest_lines(lp_method);
+	}
+
+	eps_raster_pipe_extent(lp_data->pipe, 0, pixels, &extent);
+
+	return scale_send_nearest(lp_scale, raster, pixels, printable_lines, &extent, outraster);
+}
+
+/* Only the lengths of the spans are scaled: a flat span stays one span,
+   the pixels of a literal one are each made a flat span, unless it keeps
+   one scaled pixel each. A line of another width than the page is scaled
+   as bytes. */
+static int
+scale_spanout_nearest (SCALE scale, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+	const EpsRasterSpan * span = line->spans;
+	EpsRasterSpanLine scaled = *line;
+	EpsRasterSpan * out;
+	EpsRasterExtent extent;
+	int * x_start = lp_method->x_start;
+	int printable_lines = 0;
+	int num_span = 0;
+	int need = 1;
+	int x = 0;
+	int i, k, n;
+
+	*outraster = 0;
+	for (i = 0; i < line->repeat; i++) {
+		printable_lines += scale_nearest_lines(lp_method);
+	}
+	if (printable_lines == 0) {
+		return 0;
+	}
+
+	if (line->pixels != lp_method->x_pixels) {
+		if (lp_method->line_bytes < line->pixels * line->bytes_per_pixel) {
+			if (lp_method->line_p) {
+				eps_free(lp_method->line_p);
+			}
+			lp_method->line_p = (char *) eps_malloc(line->pixels * line->bytes_per_pixel);
+			lp_method->line_bytes = (lp_method->line_p) ? line->pixels * line->bytes_per_pixel : 0;
+			if (lp_method->line_p == NULL) {
+				debuglog(("SCALE MEMALLOC ERROR %d bytes", line->pixels * line->bytes_per_pixel));
+				return 1;
+			}
+		}
+		eps_span_expand(lp_method->line_p, line, 0, line->pixels, 0);
+		extent.left = 0;
+		extent.right = line->pixels;
+		return scale_send_nearest(lp_scale, lp_method->line_p, line->pixels, printable_lines, &extent, outraster);
+	}
+
+	for (i = 0; i < line->num_span; i++) {
+		need += (span[i].step == 0) ? 1 : span[i].length;
+	}
+	if (eps_span_reserve(&lp_method->spans, &lp_method->span_size, need)) {
+		debuglog(("SCALE MEMALLOC ERROR %d spans", need));
+		return 1;
+	}
+
+	out = lp_method->spans;
+	for (i = 0; i < line->num_span; x += span[i].length, i++) {
+		if (span[i].step == 0) {
+			n = x_start[x + span[i].length] - x_start[x];
+			if (n > 0) {
+				out[num_span].data = span[i].data;
+				out[num_span].length = n;
+				out[num_span].step = 0;
+				num_span++;
+			}
+			continue;
+		}
+
+		for (k = 0; k < span[i].length; k++) {
+			n = x_start[x + k + 1] - x_start[x + k];
+			if (n == 1 && k > 0 && x_start[x + k] - x_start[x + k - 1] == 1) {
+				out[num_span - 1].length++;
+			} else if (n > 0) {
+				out[num_span].data = span[i].data + k * span[i].step;
+				out[num_span].length = n;
+				out[num_span].step = (n == 1) ? span[i].step : 0;
+				num_span++;
+			}
+		}
+	}
+
+	if (x_start[x] < lp_method->scaled_pixels) {
+		eps_span_white(&out[num_span], lp_method->scaled_pixels - x_start[x]);
+		num_span++;
+	}
+
+	if (lp_method->mirror) {
+		eps_span_mirror(out, num_span);
+	}
+
+	scaled.spans = out;
+	scaled.num_span = num_span;
+	scaled.pixels = lp_method->scaled_pixels;
+	scaled.repeat = printable_lines;
+
+	return lp_data->pipe->output_span(lp_data->pipe->output_span_h, &scaled, outraster);
+}
+
+
+static int
+scale_flush_nearest (SCALE scale, int * outraster)
+{
+	*outraster = 0;
+
+	return 0;
+}
+
+static int
+scale_reset_nearest (SCALE scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+
+	lp_method->y_index = 0;
+	lp_method->band_lines = 0;
+
+	return 0;
+}
+
+static int
+scale_end_nearest (SCALE scale)
+{
+
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+
+	// cleaning up own method data
+	if (lp_method->scaled_p) {
+		eps_free(lp_method->scaled_p);
+	}
+
+	if (lp_method->band_p) {
+		eps_free(lp_method->band_p);
+	}
+
+	if (lp_method->x_start) {
+		eps_free(lp_method->x_start);
+	}
+
+	if (lp_method->x_src) {
+		eps_free(lp_method->x_src);
+	}
+
+	if (lp_method->y_lines) {
+		eps_free(lp_method->y_lines);
+	}
+
+	if (lp_method->spans) {
+		eps_free(lp_method->spans);
+	}
+
+	if (lp_method->line_p) {
+		eps_free(lp_method->line_p);
+	}
+
+	eps_free(lp_method);
+	
+	return 0;
+}
+
+
+// Use a separable filter: a line is resampled across as it comes in, and
+// the scaled lines are summed down from a ring of the lines resampled so far
+#define SCALE_FILTER_BITS	14
+#define SCALE_FILTER_ONE	(1 << SCALE_FILTER_BITS)
+#define SCALE_FILTER_CLAMP(v)	(((v) < 0) ? 0 : ((v) > 255) ? 255 : (v))
+
+typedef struct _ScaleTaps {
+	int taps;		/* source pixels summed for a scaled pixel */
+	int * start;		/* first of them, for each scaled pixel */
+	int * weight;		/* taps weights each, summing to SCALE_FILTER_ONE */
+	char * same;		/* same source pixels and weights as the one before */
+} ScaleTaps;
+
+typedef struct _MethodFilter {
+	EpsScaleFilter filter;
+	int num;		/* scale is num / den, the smaller of x and y */
+	int den;
+	int mirror;
+	int src_pixels;
+	int scaled_pixels;
+	int scaled_bytes;
+	int scaled_lines;
+	ScaleTaps x;
+	ScaleTaps y;
+	char * rows;		/* ring of y.taps lines resampled across */
+	EpsRasterExtent * row_extent;
+	int * row_id;		/* equal ids for equal lines */
+	int next_id;
+	int rows_in;		/* source lines taken */
+	int next_out;		/* next scaled line */
+	int * acc;
+	char * scaled_p;
+	char * line_p;		/* a short source line, padded */
+	int down;		/* den / num of an exact box reduction */
+	ScaleRatioKernel across;
+} MethodFilter;
+
+static double
+scale_filter_kernel (EpsScaleFilter filter, double x)
+{
+	if (x < 0.0) {
+		x = -x;
+	}
+
+	switch (filter) {
+	case EPS_SCALE_FILTER_BILINEAR:
+		return (x < 1.0) ? 1.0 - x : 0.0;
+	case EPS_SCALE_FILTER_BICUBIC: /* Catmull-Rom */
+		if (x < 1.0) {
+			return (1.5 * x - 2.5) * x * x + 1.0;
+		}
+		if (x < 2.0) {
+			return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+		}
+		return 0.0;
+	default:
+		return 0.0;
+	}
+}
+
+static void
+scale_taps_free (ScaleTaps * t)
+{
+	if (t->start) {
+		eps_free(t->start);
+	}
+	if (t->weight) {
+		eps_free(t->weight);
+	}
+	if (t->same) {
+		eps_free(t->same);
+	}
+}
+
+/* Works out the source pixels and the weights of each scaled pixel of an
+   axis. A box filter averages the source area a scaled pixel covers, the
+   others are widened by the reduction. Pixels past the ends are taken
+   as the end pixels. */
 static int
-scale_start_unchanged (SCALE scale)
+scale_taps_init (ScaleTaps * t, EpsScaleFilter filter, int src, int scaled, int num, int den)
 {
+	double inv = (double) den / (double) num;	/* source pixels a scaled pixel covers */
+	double width = (inv > 1.0) ? inv : 1.0;
+	double support;
+	double center, sum, w;
+	double * fw = NULL;
+	int * q;
+	int o, i, k, first, big, total;
+
+	switch (filter) {
+	case EPS_SCALE_FILTER_BICUBIC:
+		support = 2.0 * width;
+		break;
+	case EPS_SCALE_FILTER_BILINEAR:
+		support = width;
+		break;
+	default:
+		support = inv / 2.0 + 0.5;
+		break;
+	}
+
+	t->taps = (int) (2.0 * support) + 2;
+	if (t->taps > src) {
+		t->taps = src;
+	}
+	t->start = (int *) eps_malloc(sizeof(int) * (scaled + 1));
+	t->weight = (int *) eps_malloc(sizeof(int) * (scaled + 1) * t->taps);
+	t->same = (char *) eps_malloc(scaled + 1);
+	fw = (double *) eps_malloc(sizeof(double) * t->taps);
+	if (t->start == NULL || t->weight == NULL || t->same == NULL || fw == NULL) {
+		if (fw) {
+			eps_free(fw);
+		}
+		return 1;
+	}
+
+	for (o = 0; o < scaled; o++) {
+		center = (o + 0.5) * inv;
+		first = (int) (center - support);
+		if (first > src - t->taps) {
+			first = src - t->taps;
+		}
+		if (first < 0) {
+			first = 0;
+		}
+		t->start[o] = first;
+
+		memset(fw, 0, sizeof(double) * t->taps);
+		sum = 0.0;
+		for (i = (int) (center - support) - 1; i <= (int) (center + support) + 1; i++) {
+			if (filter == EPS_SCALE_FILTER_BOX) {
+				double a = (i > center - inv / 2.0) ? i : center - inv / 2.0;
+				double b = (i + 1 < center + inv / 2.0) ? i + 1 : center + inv / 2.0;
+				w = (b > a) ? b - a : 0.0;
+			} else {
+				w = scale_filter_kernel(filter, (i + 0.5 - center) / width);
+			}
+			k = ((i < 0) ? 0 : (i >= src) ? src - 1 : i) - first;
+			if (w != 0.0 && k >= 0 && k < t->taps) {
+				fw[k] += w;
+				sum += w;
+			}
+		}
+
+		/* rounded to integers summing to one exactly, so a flat area
+		   stays as it is */
+		q = t->weight + o * t->taps;
+		total = 0;
+		big = 0;
+		for (k = 0; k < t->taps; k++) {
+			w = (sum != 0.0) ? fw[k] / sum : ((k == 0) ? 1.0 : 0.0);
+			q[k] = (int) (w * SCALE_FILTER_ONE + ((w < 0.0) ? -0.5 : 0.5));
+			total += q[k];
+			if (q[k] > q[big]) {
+				big = k;
+			}
+		}
+		q[big] += SCALE_FILTER_ONE - total;
+
+		t->same[o] = (o > 0 && t->start[o] == t->start[o - 1]
+			&& memcmp(q, q - t->taps, sizeof(int) * t->taps) == 0) ? 1 : 0;
+	}
+
+	eps_free(fw);
+
 	return 0;
 }
 
-static int
-scale_rasterout_unchanged (SCALE scale, char * raster, int bytes, int pixels, int * outraster)
+/* resamples source pixels across into scaled pixels [left, right) */
+static void
+scale_filter_across (const ScaleTaps * t, const unsigned char * src, unsigned char * dst, int bpp, int left, int right)
 {
-	EpsScale * lp_scale = (EpsScale *) scale;
-	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	const int * w;
+	const unsigned char * s;
+	int taps = t->taps;
+	int o, c, k, v;
 
-	int nraster = 0;
-	int error = lp_data->pipe->output(lp_data->pipe->output_h, raster, bytes, pixels, &nraster);
-	if (error == 0) {
-		*outraster = nraster;
+	if (bpp == 1) {
+		for (o = left; o < right; o++) {
+			w = t->weight + o * taps;
+			s = src + t->start[o];
+			v = SCALE_FILTER_ONE / 2;
+			for (k = 0; k < taps; k++) {
+				v += w[k] * s[k];
+			}
+			v >>= SCALE_FILTER_BITS;
+			dst[o] = SCALE_FILTER_CLAMP(v);
+		}
+		return;
 	}
 
-	return error;
+	if (bpp == 3) {
+		int v1, v2;
+
+		for (o = left; o < right; o++) {
+			w = t->weight + o * taps;
+			s = src + t->start[o] * 3;
+			v = v1 = v2 = SCALE_FILTER_ONE / 2;
+			for (k = 0; k < taps; k++, s += 3) {
+				v += w[k] * s[0];
+				v1 += w[k] * s[1];
+				v2 += w[k] * s[2];
+			}
+			v >>= SCALE_FILTER_BITS;
+			v1 >>= SCALE_FILTER_BITS;
+			v2 >>= SCALE_FILTER_BITS;
+			dst[o * 3] = SCALE_FILTER_CLAMP(v);
+			dst[o * 3 + 1] = SCALE_FILTER_CLAMP(v1);
+			dst[o * 3 + 2] = SCALE_FILTER_CLAMP(v2);
+		}
+		return;
+	}
+
+	for (o = left; o < right; o++) {
+		w = t->weight + o * taps;
+		s = src + t->start[o] * bpp;
+		for (c = 0; c < bpp; c++) {
+			v = SCALE_FILTER_ONE / 2;
+			for (k = 0; k < taps; k++) {
+				v += w[k] * s[k * bpp + c];
+			}
+			v >>= SCALE_FILTER_BITS;
+			dst[o * bpp + c] = SCALE_FILTER_CLAMP(v);
+		}
+	}
 }
 
+/* ring slot of source line index, the lines past the last one taken are
+   taken as the last one */
 static int
-scale_end_unchanged (SCALE scale)
+scale_filter_slot (MethodFilter * lp_method, int index, int last)
 {
-	return 0;
+	return ((index < last) ? index : last) % lp_method->y.taps;
 }
 
-// Use nearest neighbour interpolation
-typedef struct _MethodNearest {
-	float scale;
-	char * scaled_p;
-	int scaled_bytes;
-	int scaled_pixels;
-	float print_one_more;
-} MethodNearest;
-
+/* id of the line all the rows of scaled line o are, -1 if they differ */
 static int
-scale_start_nearest (SCALE scale)
+scale_filter_single (MethodFilter * lp_method, int o, int last)
 {
-	int eps_error = 0;
+	int id = lp_method->row_id[scale_filter_slot(lp_method, lp_method->y.start[o], last)];
+	int k;
 
-	EpsScale * lp_scale = (EpsScale *) scale;
+	for (k = 1; k < lp_method->y.taps; k++) {
+		if (lp_method->row_id[scale_filter_slot(lp_method, lp_method->y.start[o] + k, last)] != id) {
+			return -1;
+		}
+	}
+
+	return id;
+}
+
+/* sums the rows of scaled line o into scaled_p, within the extents of the
+   rows which count */
+static void
+scale_filter_down (MethodFilter * lp_method, int o, int last, int bpp, EpsRasterExtent * extent)
+{
+	const int * w = lp_method->y.weight + o * lp_method->y.taps;
+	const unsigned char * row;
+	unsigned char * dst = (unsigned char *) lp_method->scaled_p;
+	EpsRasterExtent * e;
+	int * acc = lp_method->acc;
+	int slot, k, x, a, b, v;
+
+	extent->left = 0;
+	extent->right = 0;
+	for (k = 0; k < lp_method->y.taps; k++) {
+		e = &lp_method->row_extent[scale_filter_slot(lp_method, lp_method->y.start[o] + k, last)];
+		if (w[k] == 0 || EPS_RASTER_EXTENT_BLANK(e)) {
+			continue;
+		}
+		if (EPS_RASTER_EXTENT_BLANK(extent)) {
+			*extent = *e;
+		} else {
+			extent->left = (e->left < extent->left) ? e->left : extent->left;
+			extent->right = (e->right > extent->right) ? e->right : extent->right;
+		}
+	}
+
+	if (EPS_RASTER_EXTENT_BLANK(extent)) {
+		memset(dst, 0xFF, lp_method->scaled_bytes);
+		extent->left = 0;
+		extent->right = 0;
+		return;
+	}
+
+	a = extent->left * bpp;
+	b = extent->right * bpp;
+	for (x = a; x < b; x++) {
+		acc[x] = SCALE_FILTER_ONE / 2;
+	}
+	for (k = 0; k < lp_method->y.taps; k++) {
+		if (w[k] == 0) {
+			continue;
+		}
+		slot = scale_filter_slot(lp_method, lp_method->y.start[o] + k, last);
+		row = (const unsigned char *) lp_method->rows + slot * lp_method->scaled_bytes;
+		for (x = a; x < b; x++) {
+			acc[x] += w[k] * row[x];
+		}
+	}
+
+	memset(dst, 0xFF, a);
+	for (x = a; x < b; x++) {
+		v = acc[x] >> SCALE_FILTER_BITS;
+		dst[x] = SCALE_FILTER_CLAMP(v);
+	}
+	memset(dst + b, 0xFF, lp_method->scaled_bytes - b);
+}
+
+/* Sends the scaled lines whose rows reach no further than source line
+   limit, lines past last taken as last. Equal scaled lines in a row go
+   as one repeated line. */
+static int
+scale_filter_emit (EpsScale * lp_scale, int limit, int last, int * outraster)
+{
 	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
-	MethodNearest * p = (MethodNearest *) eps_malloc(sizeof(MethodNearest));
+	MethodFilter * lp_method = (MethodFilter *) lp_scale->method_data;
+	int bpp = lp_data->bytes_per_pixel;
+	int taps = lp_method->y.taps;
+	EpsRasterExtent extent;
+	int o, n, id;
+	int eps_error = 0;
+	int nraster = 0;
 
-	if (p) {
-		p->print_one_more = 0.0f;
-		if (lp_scale->x_scale < lp_scale->y_scale) {
-			p->scale = lp_scale->x_scale;
+	while (eps_error == 0 && lp_method->next_out < lp_method->scaled_lines
+			&& lp_method->y.start[lp_method->next_out] + taps - 1 <= limit) {
+		o = lp_method->next_out;
+		id = scale_filter_single(lp_method, o, last);
+		if (id >= 0) {
+			/* the weights sum to one, the row is the line */
+			memcpy(lp_method->scaled_p, lp_method->rows + scale_filter_slot(lp_method, lp_method->y.start[o], last) * lp_method->scaled_bytes, lp_method->scaled_bytes);
+			extent = lp_method->row_extent[scale_filter_slot(lp_method, lp_method->y.start[o], last)];
 		} else {
-			p->scale = lp_scale->y_scale;
+			scale_filter_down(lp_method, o, last, bpp, &extent);
 		}
-		p->scaled_pixels = lp_data->src_print_area_x * p->scale;
-		p->scaled_bytes = p->scaled_pixels * lp_data->bytes_per_pixel;
-		p->scaled_p = (char *) eps_malloc(p->scaled_bytes);
-		if (p->scaled_p == NULL) {
-			eps_error = 1;
+
+		for (n = 1; o + n < lp_method->scaled_lines && lp_method->y.start[o + n] + taps - 1 <= limit; n++) {
+			if (!lp_method->y.same[o + n] && (id < 0 || scale_filter_single(lp_method, o + n, last) != id)) {
+				break;
+			}
 		}
 
-		lp_scale->method_data = (void *) p;
+		if (lp_method->mirror) {
+			eps_mirror_line(lp_method->scaled_p, lp_method->scaled_p, lp_method->scaled_bytes, lp_method->scaled_pixels, bpp, &extent);
+		}
+		EPS_RASTER_PASS_EXTENT(lp_data->pipe, &extent);
+		if (n == 1) {
+			eps_error = lp_data->pipe->output(lp_data->pipe->output_h, lp_method->scaled_p, lp_method->scaled_bytes, lp_method->scaled_pixels, &nraster);
+		} else {
+			eps_error = lp_data->pipe->output_repeat(lp_data->pipe->output_repeat_h, lp_method->scaled_p, lp_method->scaled_bytes, lp_method->scaled_pixels, n, &nraster);
+		}
+		*outraster += nraster;
+		lp_method->next_out += n;
+	}
+
+	return eps_error;
+}
+
+/* takes repeat equal source lines. the line is resampled across once, and
+   copied to as many ring rows as it takes. */
+static int
+scale_filter_take (EpsScale * lp_scale, char * raster, int pixels, int repeat, EpsRasterExtent * extent, int * outraster)
+{
+	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
+	MethodFilter * lp_method = (MethodFilter *) lp_scale->method_data;
+	const ScaleTaps * x = &lp_method->x;
+	int bpp = lp_data->bytes_per_pixel;
+	int first = lp_method->rows_in % lp_method->y.taps;
+	char * row = lp_method->rows + first * lp_method->scaled_bytes;
+	EpsRasterExtent * e = &lp_method->row_extent[first];
+	int eps_error = 0;
+	int left, right, slot, i;
 
+	*outraster = 0;
+
+	if (pixels < lp_method->src_pixels) {
+		memcpy(lp_method->line_p, raster, pixels * bpp);
+		memset(lp_method->line_p + pixels * bpp, 0xFF, (lp_method->src_pixels - pixels) * bpp);
+		raster = lp_method->line_p;
+	}
+	if (extent->right > lp_method->src_pixels) {
+		extent->right = lp_method->src_pixels;
+	}
+
+	if (EPS_RASTER_EXTENT_BLANK(extent)) {
+		memset(row, 0xFF, lp_method->scaled_bytes);
+		e->left = 0;
+		e->right = 0;
 	} else {
-		eps_error = 1;
+		/* the scaled pixels whose source pixels reach the extent */
+		for (left = 0; left < lp_method->scaled_pixels && x->start[left] + x->taps <= extent->left; left++) {
+			;
+		}
+		for (right = lp_method->scaled_pixels; right > left && x->start[right - 1] >= extent->right; right--) {
+			;
+		}
+		memset(row, 0xFF, left * bpp);
+		if (lp_method->across) {
+			lp_method->across(row + left * bpp, raster + left * lp_method->down * bpp, right - left, lp_method->down);
+		} else {
+			scale_filter_across(x, (const unsigned char *) raster, (unsigned char *) row, bpp, left, right);
+		}
+		memset(row + right * bpp, 0xFF, (lp_method->scaled_pixels - right) * bpp);
+		e->left = left;
+		e->right = right;
+	}
+	lp_method->row_id[first] = lp_method->next_id++;
+
+	for (i = 0; i < repeat && eps_error == 0; i++) {
+		slot = lp_method->rows_in % lp_method->y.taps;
+		if (i > 0 && i < lp_method->y.taps) {
+			memcpy(lp_method->rows + slot * lp_method->scaled_bytes, row, lp_method->scaled_bytes);
+			lp_method->row_extent[slot] = *e;
+			lp_method->row_id[slot] = lp_method->row_id[first];
+		}
+		lp_method->rows_in++;
+		eps_error = scale_filter_emit(lp_scale, lp_method->rows_in - 1, lp_method->rows_in - 1, outraster);
 	}
 
 	return eps_error;
 }
 
 static int
-scale_rasterout_nearest (SCALE scale, char * raster, int bytes, int pixels, int * outraster)
+scale_start_filter (SCALE scale)
 {
 	EpsScale * lp_scale = (EpsScale *) scale;
 	EpsScaleOpt * lp_data = (EpsScaleOpt *) lp_scale->init_data;
-	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+	MethodFilter * p = (MethodFilter *) eps_malloc(sizeof(MethodFilter));
+	int eps_error = 1;
 
-	char * scaled_p = lp_method->scaled_p;
-	int scaled_bytes = lp_method->scaled_bytes;
-	int scaled_pixels = lp_method->scaled_pixels;
-	int printable_lines = lp_method->scale;
-	int bpp = lp_data->bytes_per_pixel;
+	do {
+		if (p == NULL) {
+			break;
+		}
+		lp_scale->method_data = (void *) p;
 
-	lp_method->print_one_more += (lp_method->scale - printable_lines);
-	if (lp_method->print_one_more >= 1.0f) {
-		printable_lines++;
-		lp_method->print_one_more -= 1.0f;
-	}
+		scale_ratio(lp_data, &p->num, &p->den);
+		p->filter = lp_data->filter;
+		p->mirror = lp_data->mirror;
+		p->src_pixels = lp_data->src_print_area_x;
+		p->scaled_pixels = (int) (((long long) lp_data->src_print_area_x * p->num) / p->den);
+		p->scaled_lines = (int) (((long long) lp_data->src_print_area_y * p->num) / p->den);
+		p->scaled_bytes = p->scaled_pixels * lp_data->bytes_per_pixel;
+		p->rows_in = 0;
+		p->next_out = 0;
+		p->next_id = 0;
 
-	if (printable_lines > 0) {
-		memset(scaled_p, 0xff, scaled_bytes);
-
-		int i;
-		char * p = scaled_p;
-		float one_more_pixel = 0.0f;
-
-		for (i = 0; i < pixels; i++) {
-			int copy_pixels = lp_method->scale;
-			one_more_pixel += (lp_method->scale - copy_pixels);
-			if (one_more_pixel >= 1.0f) {
-				copy_pixels++;
-				one_more_pixel -= 1.0f;
-			}
+		/* an exact box reduction averages whole groups across */
+		p->down = 0;
+		p->across = NULL;
+		if (p->filter == EPS_SCALE_FILTER_BOX && p->den % p->num == 0) {
+			p->down = p->den / p->num;
+			p->across = scale_ratio_kernel(lp_data->bytes_per_pixel, (p->down == 2) ? SCALE_RATIO_AVERAGE2 : SCALE_RATIO_AVERAGE);
+		}
 
-			while (copy_pixels > 0) {
-				memcpy(p, raster + (i * bpp), bpp);
-				p += bpp;
-				copy_pixels--;
-			}
+		if (scale_taps_init(&p->x, p->filter, p->src_pixels, p->scaled_pixels, p->num, p->den)
+				|| scale_taps_init(&p->y, p->filter, lp_data->src_print_area_y, p->scaled_lines, p->num, p->den)) {
+			break;
 		}
-	}
 
+		p->rows = (char *) eps_malloc(p->scaled_bytes * p->y.taps);
+		p->row_extent = (EpsRasterExtent *) eps_malloc(sizeof(EpsRasterExtent) * p->y.taps);
+		p->row_id = (int *) eps_malloc(sizeof(int) * p->y.taps);
+		p->acc = (int *) eps_malloc(sizeof(int) * p->scaled_bytes);
+		p->scaled_p = (char *) eps_malloc(p->scaled_bytes);
+		p->line_p = (char *) eps_malloc(p->src_pixels * lp_data->bytes_per_pixel);
+		if (p->rows == NULL || p->row_extent == NULL || p->row_id == NULL
+				|| p->acc == NULL || p->scaled_p == NULL || p->line_p == NULL) {
+			break;
+		}
+
+		/* a scaled line takes several source lines, none is dropped */
+		lp_data->pipe->output_ownership = EPS_RASTER_LINE_WRITABLE;
+		lp_data->pipe->caps &= ~EPS_RASTER_PIPE_LINE_LOCAL;
+
+		debuglog(("scale filter %d : %d/%d, %d x %d taps", p->filter, p->num, p->den, p->x.taps, p->y.taps));
+
+		eps_error = 0;
+
+	} while (0);
+
+	return eps_error;
+}
+
+static int
+scale_rasterout_filter (SCALE scale, char * raster, int bytes, int pixels, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsRasterExtent extent;
+
+	eps_raster_pipe_extent(lp_scale->init_data->pipe, 0, pixels, &extent);
+
+	return scale_filter_take(lp_scale, raster, pixels, 1, &extent, outraster);
+}
+
+static int
+scale_bandout_filter (SCALE scale, char * band, int stride, int lines, int bytes, int pixels, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsRasterExtent extent;
 	int eps_error = 0;
+	int nraster = 0;
+	int i;
+
 	*outraster = 0;
-	while (printable_lines > 0 && eps_error == 0) {
-		int nraster = 0;
-		eps_error = lp_data->pipe->output(lp_data->pipe->output_h, scaled_p, scaled_bytes, scaled_pixels, &nraster);
-		printable_lines--;
+	for (i = 0; i < lines && eps_error == 0; i++) {
+		eps_raster_pipe_extent(lp_scale->init_data->pipe, i, pixels, &extent);
+		eps_error = scale_filter_take(lp_scale, band + i * stride, pixels, 1, &extent, &nraster);
 		*outraster += nraster;
 	}
 
@@ -165,23 +1608,98 @@ scale_rasterout_nearest (SCALE scale, char * raster, int bytes, int pixels, int
 }
 
 static int
-scale_end_nearest (SCALE scale)
+scale_repeatout_filter (SCALE scale, char * raster, int bytes, int pixels, int repeat, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	EpsRasterExtent extent;
+
+	eps_raster_pipe_extent(lp_scale->init_data->pipe, 0, pixels, &extent);
+
+	return scale_filter_take(lp_scale, raster, pixels, repeat, &extent, outraster);
+}
+
+static int
+scale_spanout_filter (SCALE scale, const EpsRasterSpanLine * line, int * outraster)
 {
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodFilter * lp_method = (MethodFilter *) lp_scale->method_data;
+	EpsRasterExtent extent;
 
+	eps_span_expand(lp_method->line_p, line, 0, lp_method->src_pixels, 0);
+	eps_span_extent(line, &extent);
+
+	return scale_filter_take(lp_scale, lp_method->line_p, lp_method->src_pixels, line->repeat, &extent, outraster);
+}
+
+/* a short page ends as if its last line went on */
+static int
+scale_flush_filter (SCALE scale, int * outraster)
+{
 	EpsScale * lp_scale = (EpsScale *) scale;
-	MethodNearest * lp_method = (MethodNearest *) lp_scale->method_data;
+	MethodFilter * lp_method = (MethodFilter *) lp_scale->method_data;
+
+	*outraster = 0;
+	if (lp_method->rows_in == 0) {
+		return 0;
+	}
+
+	return scale_filter_emit(lp_scale, INT_MAX, lp_method->rows_in - 1, outraster);
+}
+
+static int
+scale_reset_filter (SCALE scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodFilter * lp_method = (MethodFilter *) lp_scale->method_data;
+
+	lp_method->rows_in = 0;
+	lp_method->next_out = 0;
+
+	return 0;
+}
+
+static int
+scale_end_filter (SCALE scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	MethodFilter * lp_method = (MethodFilter *) lp_scale->method_data;
+
+	if (lp_method == NULL) {
+		return 0;
+	}
+
+	scale_taps_free(&lp_method->x);
+	scale_taps_free(&lp_method->y);
+
+	if (lp_method->rows) {
+		eps_free(lp_method->rows);
+	}
+
+	if (lp_method->row_extent) {
+		eps_free(lp_method->row_extent);
+	}
+
+	if (lp_method->row_id) {
+		eps_free(lp_method->row_id);
+	}
+
+	if (lp_method->acc) {
+		eps_free(lp_method->acc);
+	}
 
-	// cleaning up own method data
 	if (lp_method->scaled_p) {
 		eps_free(lp_method->scaled_p);
 	}
 
+	if (lp_method->line_p) {
+		eps_free(lp_method->line_p);
+	}
+
 	eps_free(lp_method);
-	
+
 	return 0;
 }
 
-
 ///////////////////////////////////////////////////////////////////////////////
 //
 // * A P I for scale (extern functions)
@@ -190,6 +1708,11 @@ scale_end_nearest (SCALE scale)
 #define SCALE_SETFUNC(p, func) {			\
 	p->start = scale_start_ ## func;		\
 	p->rasterout = scale_rasterout_ ## func;	\
+	p->bandout = scale_bandout_ ## func;		\
+	p->repeatout = scale_repeatout_ ## func;	\
+	p->spanout = scale_spanout_ ## func;		\
+	p->flush = scale_flush_ ## func;		\
+	p->reset = scale_reset_ ## func;		\
 	p->end = scale_end_ ## func;			\
 }
 
@@ -203,7 +1726,10 @@ eps_init_scale (RASTERPIPE * scale_p, PIPEOPT init_p)
 	if (p && init_p) {
 		p->init_data = (EpsScaleOpt *) init_p;
 
-		if (p->init_data->do_scaling) {
+		if (p->init_data->do_scaling && p->init_data->fit) {
+			debuglog(("scale fit : cropped or padded to the printable area"));
+			SCALE_SETFUNC(p, fit);
+		} else if (p->init_data->do_scaling) {
 			p->raster_index = 0;
 			p->x_scale = (float) p->init_data->prt_print_area_x / (float) p->init_data->src_print_area_x;
 			p->y_scale = (float) p->init_data->prt_print_area_y / (float) p->init_data->src_print_area_y;
@@ -214,7 +1740,27 @@ eps_init_scale (RASTERPIPE * scale_p, PIPEOPT init_p)
 			debuglog(("prt print area y : %d", p->init_data->prt_print_area_y));
 			debuglog(("scale (%.2f, %.2f)", p->x_scale, p->y_scale));
 
-			SCALE_SETFUNC(p, nearest);
+			/* reductions are averaged unless asked otherwise */
+			if (p->init_data->filter == EPS_SCALE_FILTER_AUTO) {
+				p->init_data->filter = (p->init_data->prt_print_area_x < p->init_data->src_print_area_x
+					|| p->init_data->prt_print_area_y < p->init_data->src_print_area_y) ? EPS_SCALE_FILTER_BOX : EPS_SCALE_FILTER_NEAREST;
+			}
+
+			/* a box over whole source pixels is the nearest one */
+			if (p->init_data->filter == EPS_SCALE_FILTER_BOX) {
+				int num, den;
+
+				scale_ratio(p->init_data, &num, &den);
+				if (num % den == 0) {
+					p->init_data->filter = EPS_SCALE_FILTER_NEAREST;
+				}
+			}
+
+			if (p->init_data->filter == EPS_SCALE_FILTER_NEAREST) {
+				SCALE_SETFUNC(p, nearest);
+			} else {
+				SCALE_SETFUNC(p, filter);
+			}
 		} else {
 			debuglog(("scale not effected just input raster will return"));
 			SCALE_SETFUNC(p, unchanged);
@@ -247,12 +1793,68 @@ eps_process_scale (RASTERPIPE scale, char* raster_p, int raster_bytes, int pixel
 		}
 	} else {
 		debuglog(("SCALE FLUSHING HERE ..."));
+		error = lp_scale->flush(lp_scale, &nraster);
+		if (error == 0) {
+			*outraster = nraster;
+		}
 		lp_data->pipe->output(lp_data->pipe->output_h, NULL, 0, 0, &nraster);
 	}
 
 	return error;
 }
 
+int
+eps_process_scale_band (RASTERPIPE scale, char * band, int stride, int lines, int raster_bytes, int pixel_num, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	int error = 0;
+	int nraster = 0;
+
+	*outraster = 0;
+	error = lp_scale->bandout(lp_scale, band, stride, lines, raster_bytes, pixel_num, &nraster);
+	if (error == 0) {
+		*outraster = nraster;
+	}
+
+	return error;
+}
+
+int
+eps_process_scale_repeat (RASTERPIPE scale, char * raster_p, int raster_bytes, int pixel_num, int repeat, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+	int error = 0;
+	int nraster = 0;
+
+	*outraster = 0;
+	error = lp_scale->repeatout(lp_scale, raster_p, raster_bytes, pixel_num, repeat, &nraster);
+	if (error == 0) {
+		*outraster = nraster;
+	}
+
+	return error;
+}
+
+int
+eps_process_scale_span (RASTERPIPE scale, const EpsRasterSpanLine * line, int * outraster)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+
+	*outraster = 0;
+
+	return lp_scale->spanout(lp_scale, line, outraster);
+}
+
+int
+eps_reset_scale (RASTERPIPE scale)
+{
+	EpsScale * lp_scale = (EpsScale *) scale;
+
+	lp_scale->raster_index = 0;
+
+	return lp_scale->reset(lp_scale);
+}
+
 int
 eps_free_scale (RASTERPIPE scale)
 {
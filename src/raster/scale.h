@@ -39,10 +39,17 @@ typedef struct EpsScaleOpt {
 	int src_print_area_y;
 	int prt_print_area_x;
 	int prt_print_area_y;
+	int mirror;		/* scaled lines are written mirrored */
+	EpsScaleFilter filter;
+	int fit;		/* cropped or padded to the printable area, not scaled */
 } EpsScaleOpt;
 
 int eps_init_scale (RASTERPIPE *, PIPEOPT);
 int eps_process_scale (RASTERPIPE, char *, int, int, int *);
+int eps_process_scale_band (RASTERPIPE, char *, int, int, int, int, int *);
+int eps_process_scale_repeat (RASTERPIPE, char *, int, int, int, int *);
+int eps_process_scale_span (RASTERPIPE, const EpsRasterSpanLine *, int *);
+int eps_reset_scale (RASTERPIPE);
 int eps_free_scale (RASTERPIPE);
 
 
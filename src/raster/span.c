@@ -0,0 +1,294 @@
+/*
+   Copyright (C) Seiko Epson Corporation 2009.
+ 
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free  Software Foundation, Inc., 
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <string.h>
+#include "memory.h"
+#include "span.h"
+
+static const char white_pixel[4] = { (char) 0xFF, (char) 0xFF, (char) 0xFF, (char) 0xFF };
+
+static int
+span_same_pixel(const char * a, const char * b, int bpp)
+{
+	switch (bpp) {
+	case 1:
+		return a[0] == b[0];
+	case 3:
+		return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+	default:
+		return memcmp(a, b, bpp) == 0;
+	}
+}
+
+static int
+span_is_white(const EpsRasterSpan * span, int bpp)
+{
+	int k;
+
+	if (span->step != 0) {
+		return 0;
+	}
+
+	for (k = 0; k < bpp; k++) {
+		if (span->data[k] != (char) 0xFF) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int
+span_put(EpsRasterSpan * spans, int * num_span, int max_span, const char * data, int length, int step)
+{
+	if (*num_span == max_span) {
+		return 1;
+	}
+
+	spans[*num_span].data = data;
+	spans[*num_span].length = length;
+	spans[*num_span].step = step;
+	(*num_span)++;
+
+	return 0;
+}
+
+/* count pixels, doubling the bytes written so far */
+static void
+span_fill(char * dst, const char * pixel, int count, int bpp)
+{
+	int bytes = count * bpp;
+	int done = bpp;
+	int n;
+
+	if (count <= 0) {
+		return;
+	}
+
+	if (bpp == 1) {
+		memset(dst, pixel[0], count);
+		return;
+	}
+
+	memcpy(dst, pixel, bpp);
+	while (done < bytes) {
+		n = (done < bytes - done) ? done : bytes - done;
+		memcpy(dst + done, dst, n);
+		done += n;
+	}
+}
+
+static void
+span_flip(EpsRasterSpan * span)
+{
+	if (span->step != 0) {
+		span->data += (span->length - 1) * span->step;
+		span->step = -span->step;
+	}
+}
+
+/* grows *spans to hold need spans, returns 1 when out of memory */
+int
+eps_span_reserve (EpsRasterSpan ** spans, int * size, int need)
+{
+	if (*size < need) {
+		if (*spans) {
+			eps_free(*spans);
+		}
+		*spans = (EpsRasterSpan *) eps_malloc(sizeof(EpsRasterSpan) * need);
+		*size = (*spans) ? need : 0;
+	}
+
+	return (*spans) ? 0 : 1;
+}
+
+/* a flat white span of length pixels */
+void
+eps_span_white (EpsRasterSpan * span, int length)
+{
+	span->data = white_pixel;
+	span->length = length;
+	span->step = 0;
+}
+
+/* Splits the extent of a line into flat runs of two pixels or more and
+   the single pixels between them, the margins are flat white. Returns the
+   number of spans, or -1 when more than max_span are needed. */
+int
+eps_span_encode (const char * line, int pixels, int bpp, const EpsRasterExtent * extent, EpsRasterSpan * spans, int max_span)
+{
+	int left = extent->left;
+	int right = extent->right;
+	int single = -1;	/* first of the pending single pixels */
+	int num_span = 0;
+	int error = 0;
+	int i, run;
+
+	if (EPS_RASTER_EXTENT_BLANK(extent)) {
+		left = pixels;
+		right = pixels;
+	}
+
+	if (left > 0) {
+		error = span_put(spans, &num_span, max_span, white_pixel, left, 0);
+	}
+
+	for (i = left; i < right && error == 0; i += run) {
+		for (run = 1; i + run < right && span_same_pixel(line + i * bpp, line + (i + run) * bpp, bpp); run++) {
+			;
+		}
+		if (run == 1) {
+			if (single < 0) {
+				single = i;
+			}
+			continue;
+		}
+		if (single >= 0) {
+			error = span_put(spans, &num_span, max_span, line + single * bpp, i - single, bpp);
+			single = -1;
+		}
+		if (error == 0) {
+			error = span_put(spans, &num_span, max_span, line + i * bpp, run, 0);
+		}
+	}
+
+	if (error == 0 && single >= 0) {
+		error = span_put(spans, &num_span, max_span, line + single * bpp, right - single, bpp);
+	}
+
+	if (error == 0 && right < pixels) {
+		error = span_put(spans, &num_span, max_span, white_pixel, pixels - right, 0);
+	}
+
+	return (error) ? -1 : num_span;
+}
+
+/* Writes pixels [left, right) of the line to dst. With blank set dst is
+   white already, and white runs are skipped. */
+void
+eps_span_expand (char * dst, const EpsRasterSpanLine * line, int left, int right, int blank)
+{
+	const EpsRasterSpan * span = line->spans;
+	int bpp = line->bytes_per_pixel;
+	const char * p;
+	char * d;
+	int x = 0;
+	int a, b, i, k;
+
+	for (i = 0; i < line->num_span && x < right; x += span[i].length, i++) {
+		a = (x > left) ? x : left;
+		b = (x + span[i].length < right) ? x + span[i].length : right;
+		if (a >= b || (blank && span_is_white(&span[i], bpp))) {
+			continue;
+		}
+
+		d = dst + (a - left) * bpp;
+		p = span[i].data + (a - x) * span[i].step;
+		if (span[i].step == 0) {
+			span_fill(d, p, b - a, bpp);
+		} else if (span[i].step == bpp) {
+			memcpy(d, p, (b - a) * bpp);
+		} else {
+			for (k = a; k < b; k++) {
+				memcpy(d, p, bpp);
+				d += bpp;
+				p += span[i].step;
+			}
+		}
+	}
+
+	if (!blank && x < right) {
+		a = (x > left) ? x : left;
+		memset(dst + (a - left) * bpp, 0xFF, (right - a) * bpp);
+	}
+}
+
+/* reverses the order of the spans and of the pixels in each */
+void
+eps_span_mirror (EpsRasterSpan * spans, int num_span)
+{
+	EpsRasterSpan tmp;
+	int i = 0;
+	int j = num_span - 1;
+
+	for (; i < j; i++, j--) {
+		tmp = spans[i];
+		spans[i] = spans[j];
+		spans[j] = tmp;
+		span_flip(&spans[i]);
+		span_flip(&spans[j]);
+	}
+
+	if (i == j) {
+		span_flip(&spans[i]);
+	}
+}
+
+/* copies the spans covering pixels [left, right), returns their number */
+int
+eps_span_clip (EpsRasterSpan * dst, const EpsRasterSpan * src, int num_span, int left, int right)
+{
+	int num_clip = 0;
+	int x = 0;
+	int a, b, i;
+
+	for (i = 0; i < num_span && x < right; x += src[i].length, i++) {
+		a = (x > left) ? x : left;
+		b = (x + src[i].length < right) ? x + src[i].length : right;
+		if (a < b) {
+			dst[num_clip].data = src[i].data + (a - x) * src[i].step;
+			dst[num_clip].length = b - a;
+			dst[num_clip].step = src[i].step;
+			num_clip++;
+		}
+	}
+
+	return num_clip;
+}
+
+/* the white runs at both ends make the margins */
+void
+eps_span_extent (const EpsRasterSpanLine * line, EpsRasterExtent * extent)
+{
+	const EpsRasterSpan * span = line->spans;
+	int bpp = line->bytes_per_pixel;
+	int i = 0;
+	int j = line->num_span - 1;
+
+	extent->left = 0;
+	extent->right = line->pixels;
+
+	while (i < line->num_span && span_is_white(&span[i], bpp)) {
+		extent->left += span[i].length;
+		i++;
+	}
+
+	if (i == line->num_span || extent->left >= line->pixels) {
+		extent->left = 0;
+		extent->right = 0;
+		return;
+	}
+
+	while (j > i && span_is_white(&span[j], bpp)) {
+		extent->right -= span[j].length;
+		j--;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+   Copyright (C) Seiko Epson Corporation 2009.
+ 
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free  Software Foundation, Inc., 
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "raster.h"
+
+#ifndef __EPS_SPAN_H__
+#define __EPS_SPAN_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+/* most spans a line of pixels may take to be sent as spans, a busier
+   line is cheaper as bytes */
+#define EPS_SPAN_MAX(pixels)	((pixels) / 8 + 2)
+
+int eps_span_reserve (EpsRasterSpan **, int *, int);
+void eps_span_white (EpsRasterSpan *, int);
+int eps_span_encode (const char *, int, int, const EpsRasterExtent *, EpsRasterSpan *, int);
+void eps_span_expand (char *, const EpsRasterSpanLine *, int, int, int);
+void eps_span_mirror (EpsRasterSpan *, int);
+int eps_span_clip (EpsRasterSpan *, const EpsRasterSpan *, int, int, int);
+void eps_span_extent (const EpsRasterSpanLine *, EpsRasterExtent *);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __EPS_SPAN_H__ */
@@ -0,0 +1,198 @@
+/*
+   Copyright (C) Seiko Epson Corporation 2009.
+ 
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free  Software Foundation, Inc., 
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <pthread.h>
+#include "worker-pool.h"
+
+/* workers take jobs from one FIFO queue; a finished job is flagged done
+   under the pool lock and waiters are woken through job_done. */
+typedef struct EpsWorkerPool {
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;
+	pthread_cond_t job_done;
+	pthread_t * threads;
+	int num_thread;
+	int quit;
+	EpsWorkerJob * head;
+	EpsWorkerJob * tail;
+} EpsWorkerPool;
+
+static void *
+worker_main(void * arg)
+{
+	EpsWorkerPool * pool = (EpsWorkerPool *) arg;
+	EpsWorkerJob * job;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->head == NULL && pool->quit == 0) {
+			pthread_cond_wait(&pool->job_ready, &pool->lock);
+		}
+
+		if (pool->head == NULL) { /* quit */
+			break;
+		}
+
+		job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		job->func(job->arg);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->job_done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+WORKERPOOL
+workerpool_create_instance(int threads)
+{
+	EpsWorkerPool * pool = NULL;
+	int error = 1;
+
+	do {
+		if (threads < 1) {
+			break;
+		}
+
+		pool = (EpsWorkerPool *) eps_malloc(sizeof(EpsWorkerPool));
+		if (pool == NULL) {
+			break;
+		}
+
+		pthread_mutex_init(&pool->lock, NULL);
+		pthread_cond_init(&pool->job_ready, NULL);
+		pthread_cond_init(&pool->job_done, NULL);
+		pool->quit = 0;
+		pool->head = NULL;
+		pool->tail = NULL;
+		pool->num_thread = 0;
+
+		pool->threads = (pthread_t *) eps_malloc(sizeof(pthread_t) * threads);
+		if (pool->threads == NULL) {
+			break;
+		}
+
+		for (; pool->num_thread < threads; pool->num_thread++) {
+			if (pthread_create(&pool->threads[pool->num_thread], NULL, worker_main, pool)) {
+				break;
+			}
+		}
+		if (pool->num_thread == 0) {
+			break;
+		}
+
+		debuglog(("worker pool : %d threads", pool->num_thread));
+
+		error = 0;
+
+	} while (0);
+
+	if (error && pool) {
+		workerpool_destroy_instance(pool);
+		pool = NULL;
+	}
+
+	return (WORKERPOOL) pool;
+}
+
+void
+workerpool_destroy_instance(WORKERPOOL instance)
+{
+	EpsWorkerPool * pool = (EpsWorkerPool *) instance;
+	int i;
+
+	if (pool) {
+		pthread_mutex_lock(&pool->lock);
+		pool->quit = 1;
+		pthread_cond_broadcast(&pool->job_ready);
+		pthread_mutex_unlock(&pool->lock);
+
+		for (i = 0; i < pool->num_thread; i++) {
+			pthread_join(pool->threads[i], NULL);
+		}
+
+		if (pool->threads) {
+			eps_free(pool->threads);
+		}
+
+		pthread_cond_destroy(&pool->job_done);
+		pthread_cond_destroy(&pool->job_ready);
+		pthread_mutex_destroy(&pool->lock);
+		eps_free(pool);
+	}
+}
+
+int
+workerpool_submit(WORKERPOOL instance, EpsWorkerJob *job)
+{
+	EpsWorkerPool * pool = (EpsWorkerPool *) instance;
+
+	if (pool == NULL || job == NULL || job->func == NULL) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	job->done = 0;
+	job->next = NULL;
+	if (pool->tail) {
+		pool->tail->next = job;
+	} else {
+		pool->head = job;
+	}
+	pool->tail = job;
+	pthread_cond_signal(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+int
+workerpool_is_done(WORKERPOOL instance, EpsWorkerJob *job)
+{
+	EpsWorkerPool * pool = (EpsWorkerPool *) instance;
+	int done;
+
+	pthread_mutex_lock(&pool->lock);
+	done = job->done;
+	pthread_mutex_unlock(&pool->lock);
+
+	return done;
+}
+
+void
+workerpool_wait(WORKERPOOL instance, EpsWorkerJob *job)
+{
+	EpsWorkerPool * pool = (EpsWorkerPool *) instance;
+
+	pthread_mutex_lock(&pool->lock);
+	while (job->done == 0) {
+		pthread_cond_wait(&pool->job_done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
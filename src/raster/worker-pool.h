@@ -0,0 +1,54 @@
+/*
+   Copyright (C) Seiko Epson Corporation 2009.
+ 
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, write to the Free  Software Foundation, Inc., 
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "raster.h"
+
+#ifndef __EPS_WORKER_POOL_H__
+#define __EPS_WORKER_POOL_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+typedef void (* WORKERPOOL_FUNC) (void *);
+
+/* a job is owned by the caller and must stay valid until it is done */
+typedef struct EpsWorkerJob {
+	WORKERPOOL_FUNC func;
+	void * arg;
+	int done;
+	struct EpsWorkerJob * next;
+} EpsWorkerJob;
+
+typedef void * WORKERPOOL;
+
+WORKERPOOL workerpool_create_instance(int threads);
+int workerpool_submit(WORKERPOOL instance, EpsWorkerJob *job);
+int workerpool_is_done(WORKERPOOL instance, EpsWorkerJob *job);
+void workerpool_wait(WORKERPOOL instance, EpsWorkerJob *job);
+void workerpool_destroy_instance(WORKERPOOL instance);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __EPS_WORKER_POOL_H__ */
@@ -351,7 +351,8 @@ static int print_page (void)
 
 	cups_page_header_t header;
 
-	EpsRasterPipeline * pipeline = NULL;
+	EpsRasterCache printCache;
+	EpsRasterCache fetchCache;
 	char * image_raw = NULL;
 	RASTER raster_h;
 
@@ -362,10 +363,12 @@ static int print_page (void)
 	EPS_BOOL bAbort;
 
 	EpsPageInfo page = { 0 };
+	EpsPageInfo prepare;
 	EpsRasterOpt rasteropt;
 
 	int error;
 	size_t nraster;
+	int band_lines;
 	int i;
 	EpsPageManager		*pageManager;
 	EpsPageRegion		 pageRegion;
@@ -374,12 +377,17 @@ static int print_page (void)
 	rasteropt.drv_handle = NULL;
 	rasteropt.raster_output = pipeOut;
 
+	/* pipelines live for the whole job, see raster_helper_cache_get */
+	memset(&printCache, 0, sizeof(printCache));
+	memset(&fetchCache, 0, sizeof(fetchCache));
+
 
 	error = setup_filter_option (&filterPrintOption);
 	if(error) {
 		error = 1;
 		return error;
 	}
+	rasteropt.threads = filterPrintOption.rasterThreads;
 
 	while (JobCanceled == 0 && error == 0 && cupsRasterReadHeader (Raster, &header)) {
 
@@ -390,14 +398,19 @@ static int print_page (void)
 		pageRegion.height = header.cupsHeight;
 		pageRegion.bytesPerLine = header.cupsBytesPerLine;
 		pageRegion.bitsPerPixel = header.cupsBitsPerPixel;
-		pageManager = pageManagerCreate(pageRegion, filterPrintOption, rasterSource);
+		/* a 1x1 page is prepared and printed by one pipeline */
+		if (filterPrintOption.pageLayout == EPS_PAGE_LAYOUT_1x1) {
+			pageManager = pageManagerCreateRaw(pageRegion, filterPrintOption, rasterSource, &prepare);
+		} else {
+			pageManager = pageManagerCreate(pageRegion, filterPrintOption, rasterSource, &fetchCache);
+		}
 		if (pageManager == NULL) {
 			error = 1;
 			break;
 		}
 		pageManagerGetPageRegion(pageManager, &pageRegion);
 		
-		image_raw = (char * ) eps_malloc(pageRegion.bytesPerLine);
+		image_raw = (char * ) eps_malloc(pageRegion.bytesPerLine * EPS_RASTER_BAND_LINES);
 		if (image_raw == NULL) {
 			error = 1;
 			break;
@@ -418,14 +431,22 @@ static int print_page (void)
 			page.reverse = (flipVertical) ? 1 : 0;
 			page.mirror = (flipHorizontal) ? 1 : 0;
 			page.scale = ((page.src_print_area_x != page.prt_print_area_x) || (page.src_print_area_y != page.prt_print_area_y)) ? 1 : 0;
+			page.scale_filter = filterPrintOption.scaleFilter;
+			page.scale_tolerance = filterPrintOption.scaleTolerance;
+			page.reverse_memory = filterPrintOption.reverseMemory;
 		}
 
 		do {
-			pipeline = (EpsRasterPipeline *) raster_helper_create_pipeline(&page, EPS_RASTER_PROCESS_MODE_PRINTING);
-			if (eps_raster_init(&raster_h, &rasteropt, pipeline)) {
+			if (filterPrintOption.pageLayout == EPS_PAGE_LAYOUT_1x1) {
+				raster_h = raster_helper_cache_get_chain(&printCache, &prepare, &page, EPS_RASTER_PROCESS_MODE_PRINTING, &rasteropt);
+			} else {
+				raster_h = raster_helper_cache_get(&printCache, &page, EPS_RASTER_PROCESS_MODE_PRINTING, &rasteropt);
+			}
+			if (raster_h == NULL) {
 				error = 1;
 				break;
 			}
+			raster_helper_plan_chain(printCache.pipeline);
 
 			if (epcgStartPage()) {
 				epcgEndPage(TRUE);  /* Abort */
@@ -433,16 +454,23 @@ static int print_page (void)
 				break;
 			}
 
+			band_lines = 0;
 			for (i = 0; i < pageRegion.height; i++) {
-				if ((pageManagerGetRaster(pageManager, image_raw, pageRegion.bytesPerLine) != EPS_OK) || (JobCanceled)) {
+				if ((pageManagerGetRaster(pageManager, image_raw + band_lines * pageRegion.bytesPerLine, pageRegion.bytesPerLine) != EPS_OK) || (JobCanceled)) {
 					error = 1;
 					break;
 				}
 
-				if (eps_raster_print(raster_h, image_raw, pageRegion.bytesPerLine, pageRegion.width, (int *)&nraster)) {
+				band_lines++;
+				if (band_lines < EPS_RASTER_BAND_LINES && i < pageRegion.height - 1) {
+					continue;
+				}
+
+				if (eps_raster_print_band(raster_h, image_raw, pageRegion.bytesPerLine, band_lines, pageRegion.bytesPerLine, pageRegion.width, (int *)&nraster)) {
 					error  = 1;
 					break;
 				}
+				band_lines = 0;
 			}
 
 			// flushing page
@@ -458,21 +486,16 @@ static int print_page (void)
 			pageHeight = 0;
 #endif
 
-			safeFree(raster_h, eps_raster_free);
-			safeFree(pipeline, raster_helper_destroy_pipeline);
-
 		} while (error == 0 && pageManagerIsNextPage(pageManager) == TRUE);
 
 		safeFree(image_raw, eps_free);
-		safeFree(raster_h, eps_raster_free);
-		safeFree(pipeline, raster_helper_destroy_pipeline);
 		safeFree(pageManager, pageManagerDestroy);
 	}
 
 	safeFree(image_raw, eps_free);
-	safeFree(raster_h, eps_raster_free);
-	safeFree(pipeline, raster_helper_destroy_pipeline);
 	safeFree(pageManager, pageManagerDestroy);
+	raster_helper_cache_clear(&printCache);
+	raster_helper_cache_clear(&fetchCache);
 
 	debuglog(("TRACE OUT=%d", error));
 